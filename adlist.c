@@ -4,6 +4,12 @@
 list *listCreate(void){
     list *p;
     p = zmalloc(sizeof(struct list));
+    if(p == NULL) return NULL;
+    p->head = p->tail = NULL;
+    p->length = 0;
+    p->free = NULL;
+    p->dup = NULL;
+    p->match = NULL;
     return p;
 }
 
@@ -47,12 +53,13 @@ void listRelease(list *list){
 list *listNodeAddHead(list *list, void *value){
     listNode *node;
     node = zmalloc(sizeof(listNode));
+    node->prev = NULL;
     node->next = list->head;
     node->value = value;
     if(list->length == 0)
         list->tail = node;
     else
-        list->head->next = node;
+        list->head->prev = node;
     list->head = node;
     list->length++;
     return list;
@@ -63,6 +70,7 @@ list *listNodeAddTail(list *list, void *value){
     listNode *node;
     node = zmalloc(sizeof(listNode));
     node->prev = list->tail;
+    node->next = NULL;
     node->value = value;
     if(list->length == 0 )
         list->head = node;
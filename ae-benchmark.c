@@ -0,0 +1,190 @@
+// ae-benchmark: an echo server on ae over many socketpairs, comparing the
+// select and io_uring backends. A client thread keeps `active` connections
+// busy, one request each per round, while the rest stay idle like the
+// long lived clients of a real server.
+//
+//   ae-benchmark [conns] [active] [rounds]
+//
+// syscalls/req counts the server side read(), write() and the calls the
+// backend spent waiting for events. With io_uring the loop receives into
+// its own buffers (AE_RECV) and replies go out through aeSendv(), so the
+// only syscalls left are the io_uring_enter() calls.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+
+#include "ae.h"
+#include "zmalloc.h"
+
+#define REQ_LEN 16
+
+static int conns = 1000, active = 64, rounds = 20000;
+static int *cfds; // client side of every pair
+static int stopfd[2];
+static long long reads, writes;
+
+// a reply aeSendv() is still sending
+typedef struct echoReply {
+    char buf[REQ_LEN*4];
+    struct iovec iov;
+} echoReply;
+static echoReply *replies; // by connection
+
+static long long ustime(void){
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec*1000000+tv.tv_usec;
+}
+
+static void echoSent(aeEventLoop *el, int fd, void *privdata, int res){
+    echoReply *r = privdata;
+    AE_NOTUSED(el);
+    AE_NOTUSED(fd);
+
+    if(res != (int)r->iov.iov_len) exit(1);
+}
+
+static void echoHandler(aeEventLoop *el, int fd, void *privdata, int mask){
+    echoReply *r = privdata;
+    ssize_t n;
+    AE_NOTUSED(mask);
+
+    if(el->recvbuf){
+        if((n = el->recvlen) <= 0 || n > (ssize_t)sizeof(r->buf)) return;
+        memcpy(r->buf, el->recvbuf, n);
+    }else{
+        reads++;
+        if((n = read(fd, r->buf, sizeof(r->buf))) <= 0) return;
+    }
+    r->iov.iov_base = r->buf;
+    r->iov.iov_len = n;
+    if(aeSendv(el, fd, &r->iov, 1, echoSent, r) == AE_OK) return;
+    writes++;
+    if(write(fd, r->buf, n) != n) exit(1);
+}
+
+static void stopHandler(aeEventLoop *el, int fd, void *privdata, int mask){
+    AE_NOTUSED(fd);
+    AE_NOTUSED(privdata);
+    AE_NOTUSED(mask);
+    aeEventLoopStop(el);
+}
+
+// connections are picked with a stride so the busy ones are spread over
+// the whole fd range
+static void *clientThread(void *arg){
+    char req[REQ_LEN], rep[REQ_LEN];
+    int stride = conns/active;
+    AE_NOTUSED(arg);
+
+    memset(req, 'x', sizeof(req));
+    for(int r = 0; r < rounds; r++){
+        int base = r % stride;
+
+        for(int j = 0; j < active; j++)
+            if(write(cfds[base+j*stride], req, sizeof(req)) != sizeof(req)) exit(1);
+        for(int j = 0; j < active; j++)
+            if(read(cfds[base+j*stride], rep, sizeof(rep)) != sizeof(rep)) exit(1);
+    }
+    if(write(stopfd[1], "x", 1) != 1) exit(1);
+    return NULL;
+}
+
+static void run(int backend){
+    aeEventLoop *el;
+    aeFileEvent *fe;
+    pthread_t tid;
+    long long start, elapsed, requests = (long long)rounds*active;
+    int *sfds = zmalloc(sizeof(int)*conns);
+
+    aeSetBackend(backend);
+    el = aeCreateEventLoop();
+    if(backend == AE_BACKEND_IO_URING && !el->apidata){
+        printf("io_uring: not available\n");
+        aeEventLoopDelete(el);
+        zfree(sfds);
+        return;
+    }
+    for(int j = 0; j < conns; j++){
+        int sv[2];
+
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1){
+            perror("socketpair");
+            exit(1);
+        }
+        sfds[j] = sv[0];
+        cfds[j] = sv[1];
+        if(backend == AE_BACKEND_SELECT && sv[0] >= FD_SETSIZE){
+            printf("%-8s conns:%-6d skipped, fds above FD_SETSIZE\n", aeGetApiName(el), conns);
+            for(int k = 0; k <= j; k++){
+                close(sfds[k]);
+                close(cfds[k]);
+            }
+            goto cleanup;
+        }
+    }
+    if(pipe(stopfd) == -1) exit(1);
+    for(int j = 0; j <= conns; j++){
+        fe = zmalloc(sizeof(*fe));
+        fe->fd = j < conns ? sfds[j] : stopfd[0];
+        fe->mask = j < conns ? AE_READABLE|AE_RECV : AE_READABLE;
+        fe->fileProc = j < conns ? echoHandler : stopHandler;
+        fe->finalizerProc = NULL;
+        fe->clientData = j < conns ? &replies[j] : NULL;
+        aeCreateFileEvent(el, fe);
+    }
+
+    reads = writes = 0;
+    el->pollcalls = 0;
+    start = ustime();
+    pthread_create(&tid, NULL, clientThread, NULL);
+    aeMain(el);
+    elapsed = ustime()-start;
+    pthread_join(tid, NULL);
+
+    printf("%-8s conns:%-6d active:%-4d req/s:%-10.0f syscalls/req:%.2f (wait calls %lld)\n",
+        aeGetApiName(el), conns, active, (double)requests*1000000/elapsed,
+        (double)(reads+writes+el->pollcalls)/requests, el->pollcalls);
+
+    for(int j = 0; j < conns; j++){
+        aeDeleteFileEvent(el, sfds[j], AE_READABLE);
+        close(sfds[j]);
+        close(cfds[j]);
+    }
+    aeDeleteFileEvent(el, stopfd[0], AE_READABLE);
+    close(stopfd[0]);
+    close(stopfd[1]);
+cleanup:
+    aeEventLoopDelete(el);
+    zfree(sfds);
+}
+
+int main(int argc, char **argv){
+    struct rlimit rl;
+
+    if(argc > 1) conns = atoi(argv[1]);
+    if(argc > 2) active = atoi(argv[2]);
+    if(argc > 3) rounds = atoi(argv[3]);
+    if(conns < 1 || active < 1 || active > conns || rounds < 1){
+        fprintf(stderr, "usage: ae-benchmark [conns] [active] [rounds]\n");
+        return 1;
+    }
+    rl.rlim_cur = rl.rlim_max = conns*2+64;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    cfds = zmalloc(sizeof(int)*conns);
+    replies = zmalloc(sizeof(echoReply)*conns);
+    run(AE_BACKEND_SELECT);
+    run(AE_BACKEND_IO_URING);
+    zfree(replies);
+    zfree(cfds);
+    return 0;
+}
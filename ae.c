@@ -1,21 +1,61 @@
 #include "ae.h"
 #include <sys/select.h>
+#include <sys/time.h>
+#include <string.h>
 #include <stddef.h>
 #include <time.h>
 #include <stdio.h>
 #include "zmalloc.h"
 #include <errno.h>
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include "ae_io_uring.c"
+#else
+struct aeApiState;
+static struct aeApiState *aeApiCreate(void) { return NULL; }
+static void aeApiFree(struct aeApiState *st) { AE_NOTUSED(st); }
+static void aeApiAddEvent(aeEventLoop *eventLoop, aeFileEvent *fe) { AE_NOTUSED(eventLoop); AE_NOTUSED(fe); }
+static void aeApiDelEvent(aeEventLoop *eventLoop, aeFileEvent *fe) { AE_NOTUSED(eventLoop); zfree(fe); }
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) { AE_NOTUSED(eventLoop); AE_NOTUSED(tvp); return 0; }
+static void aeApiEnter(aeEventLoop *eventLoop, int wait, struct timeval *tvp) { AE_NOTUSED(eventLoop); AE_NOTUSED(wait); AE_NOTUSED(tvp); }
+static int aeApiSend(aeEventLoop *eventLoop, int fd, struct iovec *iov, int iovcnt, aeSendProc *proc, void *clientData) {
+    AE_NOTUSED(eventLoop); AE_NOTUSED(fd); AE_NOTUSED(iov); AE_NOTUSED(iovcnt); AE_NOTUSED(proc); AE_NOTUSED(clientData);
+    return AE_ERR;
+}
+#endif
+
+static int aeBackend = AE_BACKEND_SELECT;
+
+// for the event loops created from now on
+void aeSetBackend(int backend){
+    aeBackend = backend;
+}
+
+const char *aeGetApiName(aeEventLoop *eventLoop){
+    return eventLoop->apidata ? "io_uring" : "select";
+}
+
 aeEventLoop *aeCreateEventLoop(void){
     aeEventLoop *eventLoop;
     
     eventLoop = zmalloc(sizeof(*eventLoop));
     if(!eventLoop) return NULL;
-    fflush(stdout);
     eventLoop->fileEvent = NULL;
     eventLoop->timeEvent = NULL;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
+    eventLoop->beforesleep = NULL;
+    eventLoop->aftersleep = NULL;
+    eventLoop->apidata = (aeBackend == AE_BACKEND_IO_URING) ? aeApiCreate() : NULL;
+    eventLoop->pollcalls = 0;
+    eventLoop->recvbuf = NULL;
+    eventLoop->recvlen = 0;
     return eventLoop;
 }
 
@@ -24,6 +64,7 @@ void *aeEventLoopStop(aeEventLoop *eventLoop){
 }
 
 void *aeEventLoopDelete(aeEventLoop *eventLoop){
+    if(eventLoop->apidata) aeApiFree(eventLoop->apidata);
     zfree(eventLoop);
 }
 
@@ -36,77 +77,78 @@ void *aeEventLoopProcess(aeEventLoop *eventLoop, int flags){
     aeFileEvent *fe;
     aeTimeEvent *te;
     
-    fe = eventLoop->fileEvent;
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_ZERO(&efds);
-    while(fe){
-        if(fe->mask & AE_READABLE)
-            FD_SET(fe->fd, &rfds);
-        if(fe->mask & AE_WRITABLE)
-            FD_SET(fe->fd, &wfds);
-        if(fe->mask & AE_EXCEPTION)
-            FD_SET(fe->fd, &efds);
-        if(maxfd < fe->fd) maxfd = fe->fd;
-        fe = fe->next;
-    }
-
-    // get timeval of nearest timeEvent
+    // sleep until the nearest time event is due, but at most one second
     struct timeval tvNear, tvNow;
     aeTimeEvent *nearTE;
-    nearTE = aeFindNearestTimeEvent(eventLoop);
+    tvNear.tv_sec = 1;
+    tvNear.tv_usec = 0;
+    nearTE = (flags & AE_TIMEEVENT) ? aeFindNearestTimeEvent(eventLoop) : NULL;
     if(nearTE){
-        gettimeofday(&tvNow);
-        if(tvNow.tv_sec < nearTE->when_sec){
-            if(tvNow.tv_usec < nearTE->when_msec * 1000){
-                tvNear.tv_sec = nearTE->when_sec - tvNow.tv_sec;
-                tvNear.tv_usec = nearTE->when_msec * 1000 - tvNow.tv_usec;
-            }else{
-                tvNear.tv_sec = nearTE->when_sec - tvNow.tv_sec - 1;
-                tvNear.tv_usec = nearTE->when_msec * 1000 + 1000000 - tvNow.tv_usec;
-            }
-        }else{
-            if(tvNow.tv_usec == nearTE->when_sec && tvNow.tv_usec < nearTE->when_msec * 1000){
-                tvNear.tv_sec = 0;
-                tvNear.tv_usec = nearTE->when_msec * 1000 - tvNow.tv_usec;
-            }else{
-                tvNear.tv_sec = 0;
-                tvNear.tv_usec = 0;
-            }
+        long long ms;
+
+        gettimeofday(&tvNow, NULL);
+        ms = (nearTE->when_sec - tvNow.tv_sec) * 1000 +
+            nearTE->when_msec - tvNow.tv_usec / 1000;
+        if(ms < 0) ms = 0;
+        if(ms < 1000){
+            tvNear.tv_sec = 0;
+            tvNear.tv_usec = ms * 1000;
         }
     }
+    if(flags & AE_DONT_WAIT){
+        tvNear.tv_sec = 0;
+        tvNear.tv_usec = 0;
+    }
 
-    // find FileEvent of ready fd, then process
-    // no need to delete the fileEvent after process
-    int select_ret;
-    tvNear.tv_sec = 1;
-    select_ret = select(maxfd + 1, &rfds, &wfds, &efds, &tvNear);
-    printf("select %d \n", select_ret);
-    fflush(stdout);
-    if(select_ret == -1)
-        printf("select error %s\n", strerror(errno));
-    if(select_ret > 0){
-        printf("select ok %d\n", select_ret);
+    // the loading loop asks for file events only, timers must not fire then
+    if((flags & AE_FILEEVENT) && eventLoop->apidata){
+        aeApiPoll(eventLoop, &tvNear);
+    }else if(flags & AE_FILEEVENT){
         fe = eventLoop->fileEvent;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_ZERO(&efds);
         while(fe){
-            if((FD_ISSET(fe->fd, &rfds) && (fe->mask & AE_READABLE)) ||
-                (FD_ISSET(fe->fd, &wfds) && (fe->mask & AE_WRITABLE)) ||
-                (FD_ISSET(fe->fd, &efds) && (fe->mask & AE_EXCEPTION)) ){
-                int mask;
-                if(FD_ISSET(fe->fd, &rfds) && (fe->mask & AE_READABLE))
-                    mask |= AE_READABLE;
-                if(FD_ISSET(fe->fd, &wfds) && (fe->mask & AE_WRITABLE))
-                    mask |= AE_WRITABLE;
-                if(FD_ISSET(fe->fd, &efds) && (fe->mask & AE_EXCEPTION))
-                    mask |= AE_EXCEPTION;
-
-                fe->fileProc(eventLoop, fe->fd, fe->clientData, mask);
-                fe = eventLoop->fileEvent;
-                FD_CLR(fe->fd, &rfds);
-                FD_CLR(fe->fd, &wfds);
-                FD_CLR(fe->fd, &efds);
-            }else{
-                fe = fe->next;
+            if(fe->mask & AE_READABLE)
+                FD_SET(fe->fd, &rfds);
+            if(fe->mask & AE_WRITABLE)
+                FD_SET(fe->fd, &wfds);
+            if(fe->mask & AE_EXCEPTION)
+                FD_SET(fe->fd, &efds);
+            if(maxfd < fe->fd) maxfd = fe->fd;
+            fe = fe->next;
+        }
+
+        // find FileEvent of ready fd, then process
+        // no need to delete the fileEvent after process
+        int select_ret;
+        eventLoop->pollcalls++;
+        select_ret = select(maxfd + 1, &rfds, &wfds, &efds, &tvNear);
+        if(eventLoop->aftersleep)
+            eventLoop->aftersleep(eventLoop);
+        if(select_ret > 0){
+            fe = eventLoop->fileEvent;
+            while(fe){
+                if((FD_ISSET(fe->fd, &rfds) && (fe->mask & AE_READABLE)) ||
+                    (FD_ISSET(fe->fd, &wfds) && (fe->mask & AE_WRITABLE)) ||
+                    (FD_ISSET(fe->fd, &efds) && (fe->mask & AE_EXCEPTION)) ){
+                    int mask = 0, fd = fe->fd;
+                    if(FD_ISSET(fe->fd, &rfds) && (fe->mask & AE_READABLE))
+                        mask |= AE_READABLE;
+                    if(FD_ISSET(fe->fd, &wfds) && (fe->mask & AE_WRITABLE))
+                        mask |= AE_WRITABLE;
+                    if(FD_ISSET(fe->fd, &efds) && (fe->mask & AE_EXCEPTION))
+                        mask |= AE_EXCEPTION;
+
+                    // the handler may delete fe, so clear its fd before restarting
+                    fe->fileProc(eventLoop, fd, fe->clientData, mask);
+                    FD_CLR(fd, &rfds);
+                    FD_CLR(fd, &wfds);
+                    FD_CLR(fd, &efds);
+                    fe = eventLoop->fileEvent;
+                }else{
+                    fe = fe->next;
+                }
             }
         }
     }
@@ -116,19 +158,22 @@ void *aeEventLoopProcess(aeEventLoop *eventLoop, int flags){
    // 2. we don't process events registerd by events processed in this loop by maxid
 
    int maxId = eventLoop->timeEventNextId - 1;
-   te = eventLoop->timeEvent;
+   te = (flags & AE_TIMEEVENT) ? eventLoop->timeEvent : NULL;
    while(te){
        // skip new events
        if(te->id > maxId){
            te = te->next;
+           continue;
        }
 
-       gettimeofday(&tvNow);
-       if(te->when_sec > tvNow.tv_sec || 
+       gettimeofday(&tvNow, NULL);
+       if(te->when_sec < tvNow.tv_sec || 
                (te->when_sec == tvNow.tv_sec && 
-                te->when_msec * 1000 >= tvNow.tv_usec)){
-           te->timeProc(eventLoop, te->id, te->clientData);
-           aeDeleteTimeEvent(eventLoop, te->id);
+                te->when_msec * 1000 <= tvNow.tv_usec)){
+           long long id = te->id;
+
+           te->timeProc(eventLoop, id, te->clientData);
+           aeDeleteTimeEvent(eventLoop, id);
            te = eventLoop->timeEvent;
        }else{
            te = te->next;
@@ -139,15 +184,43 @@ void *aeEventLoopProcess(aeEventLoop *eventLoop, int flags){
 
 void *aeMain(aeEventLoop *eventLoop){
     eventLoop->stop = 0;
-    while(!eventLoop->stop)
+    while(!eventLoop->stop){
+        if(eventLoop->beforesleep)
+            eventLoop->beforesleep(eventLoop);
         aeEventLoopProcess(eventLoop, AE_ALLEVENT);
+    }
+}
+
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep){
+    eventLoop->beforesleep = beforesleep;
+}
+
+void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep){
+    eventLoop->aftersleep = aftersleep;
 }
 
 void *aeWait(aeEventLoop *eventLoop);
 
+// Queues a send of iov to go to the kernel with the next wait for events.
+// iov must stay valid until proc gets the bytes sent, or -errno. AE_ERR
+// when the backend can't, the caller writes itself then.
+int aeSendv(aeEventLoop *eventLoop, int fd, struct iovec *iov, int iovcnt, aeSendProc *proc, void *clientData){
+    if(!eventLoop->apidata) return AE_ERR;
+    return aeApiSend(eventLoop, fd, iov, iovcnt, proc, clientData);
+}
+
+// Hands what is queued to the kernel now, e.g. before closing an fd a
+// queued send still refers to.
+void aeSubmit(aeEventLoop *eventLoop){
+    if(eventLoop->apidata) aeApiEnter(eventLoop, 0, NULL);
+}
+
 int aeCreateFileEvent(aeEventLoop *eventLoop, aeFileEvent *fileEvent){
     fileEvent->next = eventLoop->fileEvent;
     eventLoop->fileEvent = fileEvent;
+    fileEvent->uring_state = 0;
+    fileEvent->deleted = 0;
+    if(eventLoop->apidata) aeApiAddEvent(eventLoop, fileEvent);
     return AE_OK;
 }
 
@@ -158,15 +231,18 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask){
     cur = eventLoop->fileEvent;
 
     while(cur){
-        if(cur->fd == fd && cur->mask == mask){
+        if(cur->fd == fd && (cur->mask & ~AE_RECV) == (mask & ~AE_RECV)){
             if(prev)
                 prev->next = cur->next;
             else
-                eventLoop->fileEvent->next = cur->next;
+                eventLoop->fileEvent = cur->next;
 
             if(cur->finalizerProc)
                cur->finalizerProc(eventLoop, cur->clientData); 
-            zfree(cur);
+            if(eventLoop->apidata)
+                aeApiDelEvent(eventLoop, cur);
+            else
+                zfree(cur);
 
             return;
         }
@@ -190,14 +266,14 @@ void aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id){
     aeTimeEvent *prev, *cur;
 
     prev = NULL;
-    cur = eventLoop->fileEvent;
+    cur = eventLoop->timeEvent;
 
     while(cur){
         if(cur->id == id ){
             if(prev)
                 prev->next = cur->next;
             else
-                eventLoop->timeEvent->next = cur->next;
+                eventLoop->timeEvent = cur->next;
 
             if(cur->finalizerProc)
                cur->finalizerProc(eventLoop, cur->clientData); 
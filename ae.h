@@ -1,10 +1,13 @@
 #ifndef AE_H
 #define AE_H
 struct aeEventLoop;
+struct iovec;
 
 typedef void aeFileEventProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
 typedef void aeTimeEventProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop,  void *clientData);
+typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
+typedef void aeSendProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int res);
 
 typedef struct aeFileEvent {
     int fd;
@@ -13,6 +16,9 @@ typedef struct aeFileEvent {
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
     struct aeFileEvent *next;
+    // io_uring backend only
+    int uring_state;
+    int deleted; // unlinked, freed once the kernel is done with it
 } aeFileEvent;
 
 
@@ -31,6 +37,14 @@ typedef struct aeEventLoop {
     aeFileEvent *fileEvent;
     aeTimeEvent *timeEvent;
     int stop;
+    aeBeforeSleepProc *beforesleep;
+    aeBeforeSleepProc *aftersleep; // called once the wait for events returns
+    struct aeApiState *apidata; // io_uring state, NULL when using select
+    long long pollcalls; // syscalls spent waiting for events
+    // AE_RECV: what the loop read for the running handler, 0 bytes at EOF
+    // and -errno on errors. NULL when the handler has to read itself.
+    char *recvbuf;
+    int recvlen;
 } aeEventLoop;
 
 #define AE_OK 0
@@ -40,6 +54,7 @@ typedef struct aeEventLoop {
 #define AE_READABLE 1
 #define AE_WRITABLE 2
 #define AE_EXCEPTION 4
+#define AE_RECV 8 // with AE_READABLE alone: the loop reads, see recvbuf
 
 // event
 #define AE_FILEEVENT 1
@@ -48,7 +63,13 @@ typedef struct aeEventLoop {
 #define AE_DONT_WAIT 4
 #define AE_NO_MORE -1
 
+// backends, io_uring falls back to select when the kernel lacks it
+#define AE_BACKEND_SELECT 0
+#define AE_BACKEND_IO_URING 1
+
 #define AE_NOTUSED(V) ((void) V)
+void aeSetBackend(int backend);
+const char *aeGetApiName(aeEventLoop *eventLoop);
 aeEventLoop *aeCreateEventLoop(void);
 void *aeEventLoopStop(aeEventLoop *eventLoop);
 void *aeEventLoopDelete(aeEventLoop *eventLoop);
@@ -60,6 +81,10 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, aeFileEvent *fileEvent);
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask);
 int aeCreateTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *timeEvent);
 void aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id);
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep);
+int aeSendv(aeEventLoop *eventLoop, int fd, struct iovec *iov, int iovcnt, aeSendProc *proc, void *clientData);
+void aeSubmit(aeEventLoop *eventLoop);
 #endif
 
 
@@ -0,0 +1,367 @@
+// io_uring backend, included by ae.c. Every file event gets a one shot
+// IORING_OP_POLL_ADD, armed again once its handler ran, so events stay
+// level triggered like with select(). Events created AE_READABLE|AE_RECV
+// get an IORING_OP_RECV instead, multishot where the kernel has it (6.0),
+// into a ring of query buffers the loop owns and registers with the
+// kernel: the handler finds the bytes in eventLoop->recvbuf and never
+// calls read(). aeSendv() queues IORING_OP_SENDMSG. All the polls, recvs
+// and sends queued in one loop iteration and the wait for the next events
+// go to the kernel in a single io_uring_enter(). Raw syscalls, no liburing.
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define AE_URING_ENTRIES 4096
+#define AE_URING_BUFS 256 // query buffers, a power of two
+#define AE_URING_BUFSIZE 16384
+#define AE_URING_BGID 0
+#define AE_URING_SEND 1 // user_data tag of sends, events are never odd
+
+// aeFileEvent.uring_state
+#define AE_URING_IDLE 0 // its poll failed or recv ended, it waits to be deleted
+#define AE_URING_QUEUED 1 // in st->arm, polled at the next aeApiPoll()
+#define AE_URING_INFLIGHT 2 // the kernel holds a poll or recv for it
+
+// an aeSendv() the kernel works on
+typedef struct aeUringSend{
+    struct msghdr msg;
+    aeSendProc *proc;
+    void *clientData;
+    int fd;
+} aeUringSend;
+
+typedef struct aeApiState{
+    int ringfd;
+    unsigned sqentries;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqring, *cqring;
+    size_t sqringsz, cqringsz, sqessz;
+    aeFileEvent **arm; // events to poll at the next iteration
+    int armlen, armsize;
+    struct io_uring_buf_ring *br; // query buffers lent to recvs, NULL without
+    char *brmem;
+    unsigned short brtail;
+    int multishot; // 0 once the kernel refused a multishot recv
+} aeApiState;
+
+// Hands buffer bid back to the kernel for the next recvs.
+static void aeApiLendBuffer(aeApiState *st, int bid){
+    struct io_uring_buf *buf = &st->br->bufs[st->brtail & (AE_URING_BUFS-1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(st->brmem + (size_t)bid*AE_URING_BUFSIZE);
+    buf->len = AE_URING_BUFSIZE;
+    buf->bid = bid;
+    __atomic_store_n(&st->br->tail, ++st->brtail, __ATOMIC_RELEASE);
+}
+
+// Registers the query buffers. Without them (before 5.19) AE_RECV events
+// are polled and their handlers read() themselves.
+static void aeApiCreateBuffers(aeApiState *st){
+    struct io_uring_buf_reg reg;
+    size_t ringsz = AE_URING_BUFS*sizeof(struct io_uring_buf);
+
+    st->br = mmap(NULL, ringsz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(st->br == MAP_FAILED){
+        st->br = NULL;
+        return;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)st->br;
+    reg.ring_entries = AE_URING_BUFS;
+    reg.bgid = AE_URING_BGID;
+    if(syscall(__NR_io_uring_register, st->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1){
+        munmap(st->br, ringsz);
+        st->br = NULL;
+        return;
+    }
+    st->brmem = zmalloc((size_t)AE_URING_BUFS*AE_URING_BUFSIZE);
+    st->brtail = 0;
+    for(int j = 0; j < AE_URING_BUFS; j++)
+        aeApiLendBuffer(st, j);
+    st->multishot = 1;
+}
+
+static aeApiState *aeApiCreate(void){
+    struct io_uring_params p;
+    aeApiState *st;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    if((fd = syscall(__NR_io_uring_setup, AE_URING_ENTRIES, &p)) == -1)
+        return NULL;
+    // waits with a timeout need EXT_ARG (5.11), and completions must
+    // never be dropped when the CQ ring is full
+    if(!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)){
+        close(fd);
+        return NULL;
+    }
+
+    st = zmalloc(sizeof(*st));
+    st->ringfd = fd;
+    st->sqentries = p.sq_entries;
+    st->sqringsz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    st->cqringsz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        if(st->cqringsz > st->sqringsz) st->sqringsz = st->cqringsz;
+        st->cqringsz = st->sqringsz;
+    }
+    st->sqessz = p.sq_entries*sizeof(struct io_uring_sqe);
+    st->sqring = mmap(NULL, st->sqringsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        st->cqring = st->sqring;
+    else
+        st->cqring = mmap(NULL, st->cqringsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    st->sqes = mmap(NULL, st->sqessz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(st->sqring == MAP_FAILED || st->cqring == MAP_FAILED || st->sqes == MAP_FAILED){
+        if(st->sqes != MAP_FAILED) munmap(st->sqes, st->sqessz);
+        if(st->cqring != MAP_FAILED && st->cqring != st->sqring) munmap(st->cqring, st->cqringsz);
+        if(st->sqring != MAP_FAILED) munmap(st->sqring, st->sqringsz);
+        close(fd);
+        zfree(st);
+        return NULL;
+    }
+
+    st->sqhead = (unsigned*)((char*)st->sqring + p.sq_off.head);
+    st->sqtail = (unsigned*)((char*)st->sqring + p.sq_off.tail);
+    st->sqmask = (unsigned*)((char*)st->sqring + p.sq_off.ring_mask);
+    st->sqarray = (unsigned*)((char*)st->sqring + p.sq_off.array);
+    st->cqhead = (unsigned*)((char*)st->cqring + p.cq_off.head);
+    st->cqtail = (unsigned*)((char*)st->cqring + p.cq_off.tail);
+    st->cqmask = (unsigned*)((char*)st->cqring + p.cq_off.ring_mask);
+    st->cqes = (struct io_uring_cqe*)((char*)st->cqring + p.cq_off.cqes);
+    st->arm = NULL;
+    st->armlen = 0;
+    st->armsize = 0;
+    aeApiCreateBuffers(st);
+    return st;
+}
+
+static void aeApiFree(aeApiState *st){
+    munmap(st->sqes, st->sqessz);
+    if(st->cqring != st->sqring) munmap(st->cqring, st->cqringsz);
+    munmap(st->sqring, st->sqringsz);
+    close(st->ringfd);
+    if(st->br){
+        munmap(st->br, AE_URING_BUFS*sizeof(struct io_uring_buf));
+        zfree(st->brmem);
+    }
+    zfree(st->arm);
+    zfree(st);
+}
+
+// Submits what is queued and, with wait, sleeps until a completion or
+// the timeout.
+static void aeApiEnter(aeEventLoop *eventLoop, int wait, struct timeval *tvp){
+    aeApiState *st = eventLoop->apidata;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned tosubmit = *st->sqtail - __atomic_load_n(st->sqhead, __ATOMIC_ACQUIRE);
+    unsigned flags = 0;
+
+    if(!wait && tosubmit == 0) return;
+    memset(&arg, 0, sizeof(arg));
+    if(wait){
+        flags = IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG;
+        if(tvp){
+            ts.tv_sec = tvp->tv_sec;
+            ts.tv_nsec = tvp->tv_usec*1000LL;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    eventLoop->pollcalls++;
+    syscall(__NR_io_uring_enter, st->ringfd, tosubmit, wait ? 1 : 0, flags,
+        wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+}
+
+static struct io_uring_sqe *aeApiGetSqe(aeEventLoop *eventLoop){
+    aeApiState *st = eventLoop->apidata;
+    unsigned tail = *st->sqtail, idx;
+    struct io_uring_sqe *sqe;
+
+    // full: hand what is there to the kernel first
+    if(tail - __atomic_load_n(st->sqhead, __ATOMIC_ACQUIRE) == st->sqentries)
+        aeApiEnter(eventLoop, 0, NULL);
+    idx = tail & *st->sqmask;
+    sqe = &st->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    st->sqarray[idx] = idx;
+    __atomic_store_n(st->sqtail, tail+1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static void aeApiQueue(aeApiState *st, aeFileEvent *fe){
+    if(st->armlen == st->armsize){
+        st->armsize = st->armsize ? st->armsize*2 : 64;
+        st->arm = zrealloc(st->arm, sizeof(aeFileEvent*)*st->armsize);
+    }
+    st->arm[st->armlen++] = fe;
+    fe->uring_state = AE_URING_QUEUED;
+}
+
+// the loop reads for fe, see AE_RECV
+static int aeApiIsRecv(aeApiState *st, aeFileEvent *fe){
+    return st->br && fe->mask == (AE_READABLE|AE_RECV);
+}
+
+static void aeApiAddEvent(aeEventLoop *eventLoop, aeFileEvent *fe){
+    fe->deleted = 0;
+    aeApiQueue(eventLoop->apidata, fe);
+}
+
+// fe is already unlinked. The kernel may still point to it, so it is freed
+// once its poll or recv completes.
+static void aeApiDelEvent(aeEventLoop *eventLoop, aeFileEvent *fe){
+    struct io_uring_sqe *sqe;
+
+    fe->deleted = 1;
+    if(fe->uring_state == AE_URING_IDLE){
+        zfree(fe);
+    }else if(fe->uring_state == AE_URING_INFLIGHT){
+        sqe = aeApiGetSqe(eventLoop);
+        sqe->opcode = aeApiIsRecv(eventLoop->apidata, fe) ?
+            IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE;
+        sqe->addr = (uint64_t)(uintptr_t)fe;
+        sqe->user_data = 0;
+    }
+    // queued ones are freed when the queue is flushed
+}
+
+static int aeApiSend(aeEventLoop *eventLoop, int fd, struct iovec *iov, int iovcnt, aeSendProc *proc, void *clientData){
+    struct io_uring_sqe *sqe = aeApiGetSqe(eventLoop);
+    aeUringSend *op = zmalloc(sizeof(*op));
+
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = iov;
+    op->msg.msg_iovlen = iovcnt;
+    op->proc = proc;
+    op->clientData = clientData;
+    op->fd = fd;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)&op->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)op | AE_URING_SEND;
+    return AE_OK;
+}
+
+// A recv completed: res bytes are in buffer bid, 0 is EOF, < 0 an error.
+static int aeApiRecvDone(aeEventLoop *eventLoop, aeFileEvent *fe, int res, unsigned flags){
+    aeApiState *st = eventLoop->apidata;
+    int more = flags & IORING_CQE_F_MORE, bid = -1;
+
+    if(flags & IORING_CQE_F_BUFFER) bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if(fe->deleted){
+        if(bid != -1) aeApiLendBuffer(st, bid);
+        if(!more) zfree(fe);
+        return 0;
+    }
+    if(res == -ENOBUFS || (res == -EINVAL && st->multishot)){
+        // every buffer is out, they are back by the next iteration; or
+        // a kernel without multishot recv
+        if(res == -EINVAL) st->multishot = 0;
+        if(!more) aeApiQueue(st, fe);
+        return 0;
+    }
+    // queued before the handler runs, which may delete it
+    if(!more && res > 0) aeApiQueue(st, fe);
+    else if(!more) fe->uring_state = AE_URING_IDLE;
+    eventLoop->recvbuf = bid != -1 ? st->brmem + (size_t)bid*AE_URING_BUFSIZE : st->brmem;
+    eventLoop->recvlen = res;
+    fe->fileProc(eventLoop, fe->fd, fe->clientData, AE_READABLE);
+    eventLoop->recvbuf = NULL;
+    if(bid != -1) aeApiLendBuffer(st, bid);
+    return 1;
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp){
+    aeApiState *st = eventLoop->apidata;
+    unsigned head, tail;
+    int processed = 0, armlen = st->armlen;
+
+    for(int j = 0; j < armlen; j++){
+        aeFileEvent *fe = st->arm[j];
+        struct io_uring_sqe *sqe;
+        unsigned events = 0;
+
+        if(fe->deleted){
+            zfree(fe);
+            continue;
+        }
+        sqe = aeApiGetSqe(eventLoop);
+        sqe->fd = fe->fd;
+        sqe->user_data = (uint64_t)(uintptr_t)fe;
+        fe->uring_state = AE_URING_INFLIGHT;
+        if(aeApiIsRecv(st, fe)){
+            sqe->opcode = IORING_OP_RECV;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = AE_URING_BGID;
+            if(st->multishot) sqe->ioprio = IORING_RECV_MULTISHOT;
+            continue;
+        }
+        if(fe->mask & AE_READABLE) events |= POLLIN;
+        if(fe->mask & AE_WRITABLE) events |= POLLOUT;
+        if(fe->mask & AE_EXCEPTION) events |= POLLPRI;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = events;
+    }
+    st->armlen = 0;
+
+    // a zero timeout only submits, what is ready already is in the CQ ring
+    aeApiEnter(eventLoop, !(tvp && tvp->tv_sec == 0 && tvp->tv_usec == 0), tvp);
+    if(eventLoop->aftersleep)
+        eventLoop->aftersleep(eventLoop);
+
+    head = *st->cqhead;
+    tail = __atomic_load_n(st->cqtail, __ATOMIC_ACQUIRE);
+    while(head != tail){
+        struct io_uring_cqe *cqe = &st->cqes[head & *st->cqmask];
+        uint64_t data = cqe->user_data;
+        aeFileEvent *fe = (aeFileEvent*)(uintptr_t)data;
+        int res = cqe->res, mask = 0;
+        unsigned flags = cqe->flags;
+
+        __atomic_store_n(st->cqhead, ++head, __ATOMIC_RELEASE);
+        if(data & AE_URING_SEND){
+            aeUringSend *op = (aeUringSend*)(uintptr_t)(data & ~(uint64_t)AE_URING_SEND);
+
+            op->proc(eventLoop, op->fd, op->clientData, res);
+            zfree(op);
+            continue;
+        }
+        if(fe == NULL) continue; // a POLL_REMOVE or ASYNC_CANCEL
+        if(aeApiIsRecv(st, fe)){
+            processed += aeApiRecvDone(eventLoop, fe, res, flags);
+            if(head == tail) tail = __atomic_load_n(st->cqtail, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        if(fe->deleted){
+            zfree(fe);
+            continue;
+        }
+        if(res < 0){
+            // nothing to wait on any more, likely a closed fd
+            fe->uring_state = AE_URING_IDLE;
+            continue;
+        }
+        if(res & (POLLIN|POLLHUP|POLLERR)) mask |= AE_READABLE;
+        if(res & (POLLOUT|POLLHUP|POLLERR)) mask |= AE_WRITABLE;
+        if(res & POLLPRI) mask |= AE_EXCEPTION;
+        // queued before the handler runs, which may delete it
+        aeApiQueue(st, fe);
+        if(mask & fe->mask){
+            fe->fileProc(eventLoop, fe->fd, fe->clientData, mask & fe->mask);
+            processed++;
+        }
+        if(head == tail) tail = __atomic_load_n(st->cqtail, __ATOMIC_ACQUIRE);
+    }
+    return processed;
+}
@@ -1,5 +1,8 @@
+#define _GNU_SOURCE // accept4()
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <stddef.h>
@@ -10,6 +13,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include "anet.h"
 
@@ -35,9 +39,14 @@ static int anetTcpGenericConnect(char *err, char *addr, int port, int flags){
     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on_opt, sizeof(on_opt));
 
     struct sockaddr_in sa;
+    char ip[32];
+    memset(&sa, 0, sizeof(sa));
     sa.sin_family = AF_INET;
-    sa.sin_port = port;
-    anetResolve(err, addr, &sa.sin_addr);
+    sa.sin_port = htons(port);
+    if(anetResolve(err, addr, ip) == ANET_ERR || inet_aton(ip, &sa.sin_addr) == 0){
+        close(s);
+        return ANET_ERR;
+    }
 
     if(flags & ANET_CONNECT_NONBLOCK){
         if(anetNonBlock(err, s)!= ANET_OK){
@@ -67,9 +76,10 @@ int anetTcpNonBlockConnect(char *err, char *addr, int port){
     return anetTcpGenericConnect(err, addr, port, ANET_CONNECT_NONBLOCK);
 }
 
+// like read() but keeps going until count bytes, EOF or an error
 int anetRead(int fd, char *buf, int count){
-    int tot_len, nread = 0 ;
-    while(1){
+    int tot_len = 0, nread = 0 ;
+    while(tot_len != count){
         nread = read(fd, buf, count - tot_len);
         if(nread == -1) return -1;
         if(nread == 0) return tot_len;
@@ -80,8 +90,8 @@ int anetRead(int fd, char *buf, int count){
 }
 
 int anetWrite(int fd, void *buf, int count){
-    int tot_len, nwrite = 0;
-    while(1){
+    int tot_len = 0, nwrite = 0;
+    while(tot_len != count){
         nwrite = write(fd, buf, count - tot_len);
         if (nwrite == 0) return tot_len;
         if(nwrite == -1) return -1;
@@ -108,59 +118,216 @@ int anetResolve(char *err, char *host, char *ipbuf){
     return ANET_OK;
 }
 
-int anetTcpServer(char *err, int port, char *bindaddr){
-    int s, on=1;
-    struct sockaddr_in sa;
+static int anetListen(char *err, int s, struct sockaddr *sa, socklen_t len, int backlog){
+    if(bind(s, sa, len) == -1){
+        anetSetError(err, "bind:%s\n", strerror(errno));
+        close(s);
+        return ANET_ERR;
+    }
 
-    if((s = socket(AF_INET, SOCK_STREAM, 0)) == -1){
-        anetSetError(err, "creating socket:%s\n", strerror(errno));
+    // the kernel silently caps backlog to net.core.somaxconn
+    if(listen(s, backlog) == -1){
+        anetSetError(err, "listen:%s\n", strerror(errno));
+        close(s);
         return ANET_ERR;
     }
-    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    return ANET_OK;
+}
 
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_addr.s_addr = htonl(INADDR_ANY);
-    if(bindaddr){
-        if(inet_aton(bindaddr, &sa.sin_addr) == 0){
-            anetSetError(err, "Invalid bind address \n");
+// af is AF_INET or AF_INET6, a NULL bindaddr means any address
+static int anetTcpGenericServer(char *err, int port, char *bindaddr, int af, int backlog, int reuseport){
+    int s = -1, on = 1, rv;
+    char portstr[8];
+    struct addrinfo hints, *servinfo, *p;
+
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = af;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if((rv = getaddrinfo(bindaddr, portstr, &hints, &servinfo)) != 0){
+        anetSetError(err, "Invalid bind address: %s\n", gai_strerror(rv));
+        return ANET_ERR;
+    }
+    for(p = servinfo; p != NULL; p = p->ai_next){
+        if((s = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+            continue;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        // an IPv6 listener does not take the IPv4 connections too
+        if(af == AF_INET6 && setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) == -1){
+            anetSetError(err, "setsockopt IPV6_V6ONLY: %s\n", strerror(errno));
             close(s);
-            return ANET_ERR;
+            s = ANET_ERR;
+            break;
         }
+        // several sockets bound to the same port, the kernel spreads the
+        // incoming connections between them
+        if(reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1){
+            anetSetError(err, "setsockopt SO_REUSEPORT: %s\n", strerror(errno));
+            close(s);
+            s = ANET_ERR;
+            break;
+        }
+        if(anetListen(err, s, p->ai_addr, p->ai_addrlen, backlog) == ANET_ERR)
+            s = ANET_ERR;
+        break;
+    }
+    if(p == NULL){
+        anetSetError(err, "unable to bind socket: %s\n", strerror(errno));
+        s = ANET_ERR;
     }
+    freeaddrinfo(servinfo);
+    return s;
+}
 
-    if(bind(s, (struct sockaddr*)&sa, sizeof(sa)) == -1){
-        anetSetError(err, "bind:%s\n", strerror(errno));
-        close(s);
+int anetTcpServer(char *err, int port, char *bindaddr, int backlog){
+    return anetTcpGenericServer(err, port, bindaddr, AF_INET, backlog, 0);
+}
+
+int anetTcpServerReusePort(char *err, int port, char *bindaddr, int backlog){
+    return anetTcpGenericServer(err, port, bindaddr, AF_INET, backlog, 1);
+}
+
+int anetTcp6Server(char *err, int port, char *bindaddr, int backlog){
+    return anetTcpGenericServer(err, port, bindaddr, AF_INET6, backlog, 0);
+}
+
+// perm, when not 0, is applied to the socket file
+int anetUnixServer(char *err, char *path, mode_t perm, int backlog){
+    int s;
+    struct sockaddr_un sa;
+
+    if(strlen(path) >= sizeof(sa.sun_path)){
+        anetSetError(err, "unix socket path too long\n");
         return ANET_ERR;
     }
-
-    if(listen(s, 32) == -1){
-        anetSetError(err, "listen:%s\n", strerror(errno));
+    if((s = socket(AF_LOCAL, SOCK_STREAM, 0)) == -1){
+        anetSetError(err, "creating socket:%s\n", strerror(errno));
+        return ANET_ERR;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_LOCAL;
+    strncpy(sa.sun_path, path, sizeof(sa.sun_path)-1);
+    if(anetListen(err, s, (struct sockaddr*)&sa, sizeof(sa), backlog) == ANET_ERR)
+        return ANET_ERR;
+    if(perm && chmod(sa.sun_path, perm) == -1){
+        anetSetError(err, "chmod %s: %s\n", path, strerror(errno));
         close(s);
         return ANET_ERR;
     }
-
     return s;
 }
 
-int anetAccept(char *err, int serversock, char *ip, int *port){
-    struct sockaddr_in sa;
+static int anetGenericAccept(char *err, int s, struct sockaddr *sa, socklen_t *len){
     int fd;
-    unsigned int saLen;
 
     while(1){
-        fd = accept(serversock, (struct sockaddr *)&sa, &saLen);
+#ifdef __linux__
+        fd = accept4(s, sa, len, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+        fd = accept(s, sa, len);
+        if(fd != -1 && (anetNonBlock(err, fd) == ANET_ERR ||
+                        fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)){
+            close(fd);
+            return ANET_ERR;
+        }
+#endif
         if(fd == -1){
             if(errno == EINTR)
                 continue;
-            else{
-            }
+            anetSetError(err, "accept: %s\n", strerror(errno));
+            return ANET_ERR;
         }
+        return fd;
+    }
+}
+
+// The accepted socket is already non blocking and close-on-exec. On a non
+// blocking listener ANET_ERR with errno EAGAIN means nothing is pending.
+// ip must hold INET6_ADDRSTRLEN bytes.
+int anetAccept(char *err, int serversock, char *ip, int *port){
+    struct sockaddr_storage sa;
+    socklen_t saLen = sizeof(sa);
+    int fd;
+
+    if((fd = anetGenericAccept(err, serversock, (struct sockaddr*)&sa, &saLen)) == ANET_ERR)
+        return ANET_ERR;
+    if(sa.ss_family == AF_INET){
+        struct sockaddr_in *s = (struct sockaddr_in *)&sa;
+        if(ip) inet_ntop(AF_INET, &s->sin_addr, ip, INET6_ADDRSTRLEN);
+        if(port) *port = ntohs(s->sin_port);
+    }else{
+        struct sockaddr_in6 *s = (struct sockaddr_in6 *)&sa;
+        if(ip) inet_ntop(AF_INET6, &s->sin6_addr, ip, INET6_ADDRSTRLEN);
+        if(port) *port = ntohs(s->sin6_port);
+    }
+    return fd;
+}
+
+// "ip:port" of the peer, "unix" for unix sockets. buf should hold
+// INET6_ADDRSTRLEN+8 bytes.
+int anetPeerToString(int fd, char *buf, size_t len){
+    struct sockaddr_storage sa;
+    socklen_t saLen = sizeof(sa);
+    char ip[INET6_ADDRSTRLEN];
+
+    if(getpeername(fd, (struct sockaddr*)&sa, &saLen) == -1){
+        snprintf(buf, len, "?:0");
+        return ANET_ERR;
+    }
+    if(sa.ss_family == AF_INET){
+        struct sockaddr_in *s = (struct sockaddr_in *)&sa;
+        inet_ntop(AF_INET, &s->sin_addr, ip, sizeof(ip));
+        snprintf(buf, len, "%s:%d", ip, ntohs(s->sin_port));
+    }else if(sa.ss_family == AF_INET6){
+        struct sockaddr_in6 *s = (struct sockaddr_in6 *)&sa;
+        inet_ntop(AF_INET6, &s->sin6_addr, ip, sizeof(ip));
+        snprintf(buf, len, "[%s]:%d", ip, ntohs(s->sin6_port));
+    }else{
+        snprintf(buf, len, "unix");
+    }
+    return ANET_OK;
+}
+
+int anetUnixAccept(char *err, int serversock){
+    struct sockaddr_un sa;
+    socklen_t saLen = sizeof(sa);
+
+    return anetGenericAccept(err, serversock, (struct sockaddr*)&sa, &saLen);
+}
+
+static int anetUnixGenericConnect(char *err, char *path, int flags){
+    int s;
+    struct sockaddr_un sa;
+
+    if((s = socket(AF_LOCAL, SOCK_STREAM, 0)) == -1){
+        anetSetError(err, "creating socket:%s\n", strerror(errno));
+        return ANET_ERR;
     }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_LOCAL;
+    strncpy(sa.sun_path, path, sizeof(sa.sun_path)-1);
+    if((flags & ANET_CONNECT_NONBLOCK) && anetNonBlock(err, s) != ANET_OK){
+        close(s);
+        return ANET_ERR;
+    }
+    if(connect(s, (struct sockaddr*)&sa, sizeof(sa)) == -1){
+        if(errno == EINPROGRESS && (flags & ANET_CONNECT_NONBLOCK))
+            return s;
+        anetSetError(err, "connect: %s\n", strerror(errno));
+        close(s);
+        return ANET_ERR;
+    }
+    return s;
 }
 
+int anetUnixConnect(char *err, char *path){
+    return anetUnixGenericConnect(err, path, ANET_CONNECT_NONE);
+}
 
+int anetUnixNonBlockConnect(char *err, char *path){
+    return anetUnixGenericConnect(err, path, ANET_CONNECT_NONBLOCK);
+}
 
 int anetNonBlock(char *err, int fd){
     int flags;
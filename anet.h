@@ -5,13 +5,22 @@
 #define ANET_ERR -1
 #define ANET_ERR_LEN 256
 
+#include <sys/types.h>
+
 int anetTcpConnect(char *err, char *addr, int port);
 int anetTcpNonBlockConnect(char *err, char *addr, int port);
 int anetRead(int fd, char *buf, int count);
 int anetWrite(int fd, void *buf, int count);
 int anetResolve(char *err, char *host, char *ipbuf);
-int anetTcpServer(char *err, int port, char *bindaddr);
+int anetTcpServer(char *err, int port, char *bindaddr, int backlog);
+int anetTcpServerReusePort(char *err, int port, char *bindaddr, int backlog);
+int anetTcp6Server(char *err, int port, char *bindaddr, int backlog);
+int anetUnixServer(char *err, char *path, mode_t perm, int backlog);
+int anetUnixConnect(char *err, char *path);
+int anetUnixNonBlockConnect(char *err, char *path);
 int anetAccept(char *err, int serversock, char *ip, int *port);
+int anetUnixAccept(char *err, int serversock);
+int anetPeerToString(int fd, char *buf, size_t len);
 int anetNonBlock(char *err, int fd);
 int anetTcpNoDelay(char *err, int fd);
 int anetTcpKeepAlive(char *err, int fd);
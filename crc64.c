@@ -0,0 +1,24 @@
+#include "crc64.h"
+
+#define CRC64_POLY 0x95ac9329ac4bc9b5ULL // 0xad93d23594c935a9 reflected
+
+static uint64_t crc64_table[256];
+static int crc64_table_ready = 0;
+
+static void crc64InitTable(void){
+    for(int i = 0; i < 256; i++){
+        uint64_t crc = i;
+
+        for(int j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC64_POLY : crc >> 1;
+        crc64_table[i] = crc;
+    }
+    crc64_table_ready = 1;
+}
+
+uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l){
+    if(!crc64_table_ready) crc64InitTable();
+    for(uint64_t j = 0; j < l; j++)
+        crc = crc64_table[(uint8_t)crc ^ s[j]] ^ (crc >> 8);
+    return crc;
+}
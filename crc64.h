@@ -0,0 +1,10 @@
+#ifndef CRC64_H
+#define CRC64_H
+
+#include <stdint.h>
+
+// crc-64-jones, reflected, no final xor: crc64(0, "123456789", 9) is
+// 0xe9c6d914c4b8d9ca
+uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
+
+#endif
@@ -1,16 +1,25 @@
 // api
 
 #include "dict.h"
+#include "zmalloc.h"
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
+#include <ctype.h>
 
 static unsigned int _dictNextPower(unsigned int size);
 static int _dictKeyIndex(dict *ht, const void *key);
+static unsigned long _dictRev(unsigned long v);
+static unsigned long _dictNextCursor(unsigned long cursor, unsigned long mask);
 
 dict *dictCreate(dictType *type, void *privData){
     dict *d;
     d = zmalloc(sizeof(struct dict));
+    d->table = NULL;
     d->type = type;
+    d->size = 0;
+    d->sizemask = 0;
+    d->used = 0;
     d->privData = privData;
     return d;
 }
@@ -25,6 +34,7 @@ int dictExpand(dict *ht, unsigned int size){
     n.size = realsize;
     n.sizemask = realsize - 1;
     n.table = zmalloc(realsize*sizeof(dictEntry*));
+    memset(n.table, 0, realsize*sizeof(dictEntry*));
     n.used = ht->used;
 
     // recalculate index and move data
@@ -53,11 +63,14 @@ int dictAdd(dict *ht, void *key, void *value){
     int index;
     dictEntry *entry;
 
+    // -1 if the key already exists
+    if((index = _dictKeyIndex(ht, key)) == -1)
+        return DICT_ERR;
+
     entry = zmalloc(sizeof(struct dictEntry));
     dictSetHashKey(ht, entry, key);
     dictSetHashVal(ht, entry, value);
 
-    index = _dictKeyIndex(ht, key);
     entry->next = ht->table[index];
     ht->table[index] = entry;
     ht->used++;
@@ -78,6 +91,7 @@ static int dictGenericDelete(dict *ht, const void *key, int nofree){
     dictEntry *he, *hePrev;
     unsigned int keyHash;
 
+    if(ht->size == 0) return DICT_ERR;
     keyHash = dictHashKey(ht, key) & ht->sizemask;
     he = ht->table[keyHash];
     hePrev = NULL;
@@ -112,26 +126,15 @@ int dictDeleteNoFree(dict *ht, const void *key){
 }
 
 void dictRelease(dict *ht){
-    dictEntry *he, *heNext;
-    for(int i=0; i<=ht->size && ht->used>0; i++){
-        he = ht->table[i];
-        while(he){
-            heNext = he->next;
-            dictFreeEntryKey(ht, he);
-            dictFreeEntryVal(ht, he);
-            zfree(he);
-            he = heNext;
-        }
-        zfree(ht->table);
-        zfree(ht);
-    }
+    dictEmpty(ht);
+    zfree(ht);
 }
 
-
 dictEntry *dictFind(dict *ht, const void *key){
     dictEntry *he;
     unsigned int keyHash;
 
+    if(ht->size == 0) return NULL;
     keyHash = dictHashKey(ht, key) & ht->sizemask;
     he = ht->table[keyHash];
 
@@ -146,7 +149,10 @@ dictEntry *dictFind(dict *ht, const void *key){
 dictIterator *dictGetIterator(dict *ht){
     dictIterator *iter;
     iter = zmalloc(sizeof(dictIterator));
+    iter->ht = ht;
     iter->index = -1;
+    iter->entry = NULL;
+    iter->nextEntry = NULL;
     return iter;
 }
 
@@ -154,7 +160,7 @@ dictEntry *dictNext(dictIterator *iter){
     while(1){
         if(iter->entry == NULL){
             iter->index++;
-            if (iter->index > iter->ht->size)
+            if (iter->index >= (int)iter->ht->size)
                 return NULL;
             iter->entry = iter->ht->table[iter->index];
         }else{
@@ -181,8 +187,71 @@ unsigned int dictGenHashFunction(const unsigned char *buf, int len){
     return hash;
 }
 
+// same, ignoring case
+unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len){
+    unsigned int hash = 5381;
 
-void dictEmpty(dict *ht);
+    while(len--)
+        hash = ((hash<<5) + hash) + (tolower(*buf++));
+    return hash;
+}
+
+
+// free every entry, the dict stays usable
+void dictEmpty(dict *ht){
+    for(unsigned int i=0; i<ht->size && ht->used>0; i++){
+        dictEntry *he = ht->table[i], *heNext;
+
+        while(he){
+            heNext = he->next;
+            dictFreeEntryKey(ht, he);
+            dictFreeEntryVal(ht, he);
+            zfree(he);
+            ht->used--;
+            he = heNext;
+        }
+    }
+    zfree(ht->table);
+    ht->table = NULL;
+    ht->size = 0;
+    ht->sizemask = 0;
+    ht->used = 0;
+}
+
+// Calls fn on the entries of one bucket and returns the cursor of the
+// next call, 0 once the whole table was visited. Start with 0. The
+// cursor walks the bucket index with its bits reversed, so every entry
+// present for the whole scan is returned even if the table was resized in
+// between, some maybe twice. fn must not add or delete entries.
+unsigned long dictScan(dict *ht, unsigned long cursor, dictScanFunction *fn, void *privData){
+    unsigned long mask;
+    dictEntry *he;
+
+    if(ht->size == 0) return 0;
+    mask = ht->sizemask;
+    he = ht->table[cursor & mask];
+    while(he){
+        dictEntry *heNext = he->next;
+
+        fn(privData, he);
+        he = heNext;
+    }
+    return _dictNextCursor(cursor, mask);
+}
+
+// dictScan() for active defrag: fn may move the entry it gets to another
+// allocation and returns where it is now, the bucket is linked to that.
+unsigned long dictDefragScan(dict *ht, unsigned long cursor, dictDefragFunction *fn, void *privData){
+    dictEntry **link;
+
+    if(ht->size == 0) return 0;
+    link = &ht->table[cursor & ht->sizemask];
+    while(*link){
+        *link = fn(privData, *link);
+        link = &(*link)->next;
+    }
+    return _dictNextCursor(cursor, ht->sizemask);
+}
 
 // private func
 static int _dictExpandIfNeeded(dict *ht) {
@@ -222,4 +291,20 @@ static int _dictKeyIndex(dict *ht, const void *key){
     return keyHash;
 }
 
+static unsigned long _dictRev(unsigned long v){
+    unsigned long s = 8*sizeof(v), mask = ~0UL;
 
+    while((s >>= 1) > 0){
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+// increments the reversed cursor, carrying over the unmasked bits
+static unsigned long _dictNextCursor(unsigned long cursor, unsigned long mask){
+    cursor |= ~mask;
+    cursor = _dictRev(cursor);
+    cursor++;
+    return _dictRev(cursor);
+}
@@ -30,6 +30,9 @@ typedef struct dict {
     void *privData;
 } dict;
 
+typedef void dictScanFunction(void *privData, const dictEntry *de);
+typedef dictEntry *dictDefragFunction(void *privData, dictEntry *de);
+
 typedef struct dictIterator {
     dict *ht;
     int index;
@@ -84,7 +87,10 @@ void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *ht);
 void dictPrintStats(dict *ht);
 unsigned int dictGenHashFunction(const unsigned char *buf, int len);
+unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len);
 void dictEmpty(dict *ht);
+unsigned long dictScan(dict *ht, unsigned long cursor, dictScanFunction *fn, void *privData);
+unsigned long dictDefragScan(dict *ht, unsigned long cursor, dictDefragFunction *fn, void *privData);
 
 extern dictType dictTypeHeapStringCopyKey;
 extern dictType dictTypeHeapStrings;
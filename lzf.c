@@ -0,0 +1,116 @@
+// LZF compression: a stream of runs, each starting with a control byte
+//   000LLLLL                       L+1 literal bytes follow
+//   LLLooooo oooooooo              back reference, L+2 bytes at offset o+1
+//   111ooooo LLLLLLLL oooooooo     long back reference, L+9 bytes
+#include <string.h>
+#include "lzf.h"
+
+#define LZF_HLOG 14
+#define LZF_HSIZE (1 << LZF_HLOG)
+#define LZF_MAX_LIT (1 << 5)
+#define LZF_MAX_OFF (1 << 13)
+#define LZF_MAX_REF ((1 << 8) + (1 << 3))
+
+#define LZF_HASH(p) \
+    (((((unsigned int)(p)[0] << 16) | ((p)[1] << 8) | (p)[2]) * 2654435761U) >> (32 - LZF_HLOG))
+
+unsigned int lzf_compress(const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len){
+    const unsigned char *htab[LZF_HSIZE];
+    const unsigned char *ip = in_data, *in_end = ip + in_len;
+    unsigned char *op = out_data, *out_end = op + out_len;
+    int lit = 0;
+
+    if(!in_len || !out_len) return 0;
+    memset(htab, 0, sizeof(htab));
+
+    op++; // room for the control byte of the first literal run
+    while(ip + 2 < in_end){
+        const unsigned char **hslot = &htab[LZF_HASH(ip)];
+        const unsigned char *ref = *hslot;
+        unsigned int off;
+
+        *hslot = ip;
+        if(ref && (off = ip - ref - 1) < LZF_MAX_OFF &&
+           ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]){
+            unsigned int len = 2;
+            unsigned int maxlen = in_end - ip - len;
+
+            if(maxlen > LZF_MAX_REF) maxlen = LZF_MAX_REF;
+            if(op - !lit + 3 + 1 >= out_end) return 0;
+
+            // close the literal run, dropping it if empty
+            op[-lit - 1] = lit - 1;
+            op -= !lit;
+
+            do len++; while(len < maxlen && ref[len] == ip[len]);
+            len -= 2; // the reference always copies at least 3 bytes
+
+            if(len < 7){
+                *op++ = (off >> 8) + (len << 5);
+            }else{
+                *op++ = (off >> 8) + (7 << 5);
+                *op++ = len - 7;
+            }
+            *op++ = off;
+
+            ip += len + 2;
+            lit = 0;
+            op++;
+        }else{
+            if(op >= out_end) return 0;
+            lit++;
+            *op++ = *ip++;
+            if(lit == LZF_MAX_LIT){
+                op[-lit - 1] = lit - 1;
+                lit = 0;
+                op++;
+            }
+        }
+    }
+
+    if(op + 3 > out_end) return 0;
+    while(ip < in_end){
+        lit++;
+        *op++ = *ip++;
+        if(lit == LZF_MAX_LIT){
+            op[-lit - 1] = lit - 1;
+            lit = 0;
+            op++;
+        }
+    }
+    op[-lit - 1] = lit - 1;
+    op -= !lit;
+    return op - (unsigned char *)out_data;
+}
+
+unsigned int lzf_decompress(const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len){
+    const unsigned char *ip = in_data, *in_end = ip + in_len;
+    unsigned char *op = out_data, *out_end = op + out_len;
+
+    while(ip < in_end){
+        unsigned int ctrl = *ip++;
+
+        if(ctrl < LZF_MAX_LIT){
+            ctrl++;
+            if(op + ctrl > out_end || ip + ctrl > in_end) return 0;
+            memcpy(op, ip, ctrl);
+            op += ctrl;
+            ip += ctrl;
+        }else{
+            unsigned int len = ctrl >> 5;
+            unsigned char *ref = op - ((ctrl & 0x1f) << 8) - 1;
+
+            if(len == 7){
+                if(ip >= in_end) return 0;
+                len += *ip++;
+            }
+            if(ip >= in_end) return 0;
+            ref -= *ip++;
+            len += 2;
+            if(op + len > out_end || ref < (unsigned char *)out_data) return 0;
+            // source and destination may overlap, copy byte by byte
+            while(len--) *op++ = *ref++;
+        }
+    }
+    return op - (unsigned char *)out_data;
+}
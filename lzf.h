@@ -0,0 +1,10 @@
+#ifndef LZF_H
+#define LZF_H
+
+// LZF compatible codec. Both functions return the number of bytes written
+// to out_data, or 0 if the result does not fit in out_len (or, when
+// decompressing, if the input is corrupt).
+unsigned int lzf_compress(const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len);
+unsigned int lzf_decompress(const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len);
+
+#endif
@@ -0,0 +1,443 @@
+// micro-benchmark: repeatable timings of dict, sds, adlist and zmalloc.
+// Every benchmark runs `repeats` times on the same inputs (fixed seed) and
+// reports the median and best ns/op. Where perf_event_open() is allowed
+// the last level cache misses of the timed loop are counted too.
+//
+//   micro-benchmark [-r repeats] [-f filter] [--json]
+//
+// -f runs only the benchmarks whose name contains filter. --json prints one
+// document meant to be stored and compared between commits.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#include "dict.h"
+#include "sds.h"
+#include "adlist.h"
+#include "zmalloc.h"
+
+#define MAX_REPEATS 64
+
+typedef struct benchArg {
+    long n;
+    int keylen;
+} benchArg;
+
+typedef struct benchSample {
+    long long ns, ops, bytes, misses;
+} benchSample;
+
+static int repeats = 5, json = 0, printed = 0;
+static char *filter = NULL;
+static int perffd = -1;
+static long long started_ns;
+static benchSample *cur;
+static volatile uintptr_t sink; // keeps results the compiler could drop
+
+static long long nstime(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+static void perfInit(void){
+#ifdef __linux__
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perffd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+// the timed part of a benchmark goes between benchStart() and benchStop()
+static void benchStart(void){
+#ifdef __linux__
+    if(perffd != -1){
+        ioctl(perffd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perffd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    started_ns = nstime();
+}
+
+static void benchStop(long long ops, long long bytes){
+    cur->ns = nstime()-started_ns;
+    cur->ops = ops;
+    cur->bytes = bytes;
+    cur->misses = -1;
+#ifdef __linux__
+    if(perffd != -1){
+        long long count;
+
+        ioctl(perffd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(perffd, &count, sizeof(count)) == sizeof(count)) cur->misses = count;
+    }
+#endif
+}
+
+// ---------------------------------------------------------------- inputs
+
+static unsigned long long seed;
+
+static unsigned long long nextRandom(void){
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed*2685821657736338717ULL;
+}
+
+// n distinct keys of keylen bytes in random order, the same every run
+static sds *createKeys(long n, int keylen, char prefix){
+    sds *keys = zmalloc(sizeof(sds)*n);
+    char buf[256];
+
+    for(long j = 0; j < n; j++){
+        snprintf(buf, sizeof(buf), "%c%0*ld", prefix, keylen-1, j);
+        keys[j] = sdsnewlen(buf, keylen);
+    }
+    seed = 0x9e3779b97f4a7c15ULL;
+    for(long j = n-1; j > 0; j--){
+        long k = nextRandom() % (j+1);
+        sds tmp = keys[j];
+
+        keys[j] = keys[k];
+        keys[k] = tmp;
+    }
+    return keys;
+}
+
+static void freeKeys(sds *keys, long n){
+    for(long j = 0; j < n; j++) sdsfree(keys[j]);
+    zfree(keys);
+}
+
+// ---------------------------------------------------------------- dict
+
+static unsigned int sdsHash(const void *key){
+    return dictGenHashFunction(key, sdslen((sds)key));
+}
+
+static int sdsKeyCompare(void *privdata, const void *key1, const void *key2){
+    size_t l1 = sdslen((sds)key1), l2 = sdslen((sds)key2);
+    (void)privdata;
+
+    return l1 == l2 && memcmp(key1, key2, l1) == 0;
+}
+
+// keys belong to the benchmark, the dict only points to them
+static dictType benchDictType = {
+    sdsHash,
+    NULL,
+    NULL,
+    sdsKeyCompare,
+    NULL,
+    NULL
+};
+
+static dict *createFilledDict(sds *keys, long n){
+    dict *d = dictCreate(&benchDictType, NULL);
+
+    for(long j = 0; j < n; j++) dictAdd(d, keys[j], NULL);
+    return d;
+}
+
+// grows from empty, so every resize is paid for
+static void benchDictAdd(benchArg *a){
+    sds *keys = createKeys(a->n, a->keylen, 'k');
+    dict *d = dictCreate(&benchDictType, NULL);
+
+    benchStart();
+    for(long j = 0; j < a->n; j++) dictAdd(d, keys[j], NULL);
+    benchStop(a->n, 0);
+    dictRelease(d);
+    freeKeys(keys, a->n);
+}
+
+// same as above with the table sized upfront, the difference is the resizes
+static void benchDictAddPresized(benchArg *a){
+    sds *keys = createKeys(a->n, a->keylen, 'k');
+    dict *d = dictCreate(&benchDictType, NULL);
+
+    dictExpand(d, a->n);
+    benchStart();
+    for(long j = 0; j < a->n; j++) dictAdd(d, keys[j], NULL);
+    benchStop(a->n, 0);
+    dictRelease(d);
+    freeKeys(keys, a->n);
+}
+
+static void benchDictFind(benchArg *a){
+    sds *keys = createKeys(a->n, a->keylen, 'k');
+    dict *d = createFilledDict(keys, a->n);
+    sds *lookup = createKeys(a->n, a->keylen, 'k'); // equal keys, other memory
+    uintptr_t found = 0;
+
+    benchStart();
+    for(long j = 0; j < a->n; j++) found += (uintptr_t)dictFind(d, lookup[j]);
+    benchStop(a->n, 0);
+    sink = found;
+    dictRelease(d);
+    freeKeys(keys, a->n);
+    freeKeys(lookup, a->n);
+}
+
+static void benchDictFindMiss(benchArg *a){
+    sds *keys = createKeys(a->n, a->keylen, 'k');
+    dict *d = createFilledDict(keys, a->n);
+    sds *lookup = createKeys(a->n, a->keylen, 'm');
+    uintptr_t found = 0;
+
+    benchStart();
+    for(long j = 0; j < a->n; j++) found += (uintptr_t)dictFind(d, lookup[j]);
+    benchStop(a->n, 0);
+    sink = found;
+    dictRelease(d);
+    freeKeys(keys, a->n);
+    freeKeys(lookup, a->n);
+}
+
+static void benchDictDelete(benchArg *a){
+    sds *keys = createKeys(a->n, a->keylen, 'k');
+    dict *d = createFilledDict(keys, a->n);
+
+    benchStart();
+    for(long j = 0; j < a->n; j++) dictDelete(d, keys[j]);
+    benchStop(a->n, 0);
+    dictRelease(d);
+    freeKeys(keys, a->n);
+}
+
+// ---------------------------------------------------------------- sds
+
+// n appends of keylen bytes to a string growing from empty
+static void benchSdscatlen(benchArg *a){
+    char chunk[256];
+    sds s = sdsempty();
+
+    memset(chunk, 'x', a->keylen);
+    benchStart();
+    for(long j = 0; j < a->n; j++) s = sdscatlen(s, chunk, a->keylen);
+    benchStop(a->n, (long long)a->n*a->keylen);
+    sdsfree(s);
+}
+
+// splits a line of n fields of keylen bytes, one op per call
+static void benchSdssplitlen(benchArg *a){
+    sds line = sdsempty();
+    long calls = 4000000/a->n;
+    int count;
+
+    for(long j = 0; j < a->n; j++){
+        line = sdscatlen(line, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", a->keylen);
+        if(j != a->n-1) line = sdscatlen(line, " ", 1);
+    }
+    if(calls < 1) calls = 1;
+    benchStart();
+    for(long j = 0; j < calls; j++){
+        sds *tokens = sdssplitlen(line, sdslen(line), " ", 1, &count);
+
+        for(int k = 0; k < count; k++) sdsfree(tokens[k]);
+        zfree(tokens);
+    }
+    benchStop(calls, (long long)calls*sdslen(line));
+    sdsfree(line);
+}
+
+// consumes a buffer of n bytes keylen at a time from the front, the way
+// the query buffer is consumed
+static void benchSdsrange(benchArg *a){
+    sds s = sdsnewlen(NULL, a->n);
+    long ops = a->n/a->keylen;
+
+    benchStart();
+    for(long j = 0; j < ops; j++) s = sdsrange(s, a->keylen, -1);
+    benchStop(ops, (long long)ops*a->keylen);
+    sdsfree(s);
+}
+
+// ---------------------------------------------------------------- adlist
+
+static void benchListPush(benchArg *a){
+    list *l = listCreate();
+
+    benchStart();
+    for(long j = 0; j < a->n; j++){
+        if(j & 1) listNodeAddTail(l, (void*)j);
+        else listNodeAddHead(l, (void*)j);
+    }
+    benchStop(a->n, 0);
+    listRelease(l);
+}
+
+static void benchListPop(benchArg *a){
+    list *l = listCreate();
+
+    for(long j = 0; j < a->n; j++) listNodeAddTail(l, (void*)j);
+    benchStart();
+    for(long j = 0; j < a->n; j++) listDelNode(l, (j & 1) ? listLast(l) : listFirst(l));
+    benchStop(a->n, 0);
+    listRelease(l);
+}
+
+// random positions in a list of n elements
+static void benchListIndex(benchArg *a){
+    list *l = listCreate();
+    long ops = 20000000/a->n;
+    uintptr_t found = 0;
+
+    if(ops < 100) ops = 100;
+    for(long j = 0; j < a->n; j++) listNodeAddTail(l, (void*)j);
+    seed = 0x9e3779b97f4a7c15ULL;
+    benchStart();
+    for(long j = 0; j < ops; j++) found += (uintptr_t)listIndex(l, nextRandom() % a->n);
+    benchStop(ops, 0);
+    sink = found;
+    listRelease(l);
+}
+
+// ---------------------------------------------------------------- zmalloc
+
+// one allocation freed right away, the allocator's fast path
+static void benchZmallocFree(benchArg *a){
+    benchStart();
+    for(long j = 0; j < a->n; j++){
+        void *p = zmalloc(a->keylen);
+
+        sink = (uintptr_t)p;
+        zfree(p);
+    }
+    benchStop(a->n, 0);
+}
+
+// n live allocations, then all of them freed in another order
+static void benchZmallocBatch(benchArg *a){
+    void **ptrs = malloc(sizeof(void*)*a->n);
+
+    benchStart();
+    for(long j = 0; j < a->n; j++) ptrs[j] = zmalloc(a->keylen);
+    for(long j = 0; j < a->n; j++) zfree(ptrs[(j*7919) % a->n]);
+    benchStop(a->n*2, 0);
+    free(ptrs);
+}
+
+// ---------------------------------------------------------------- runner
+
+static int compareSamples(const void *a, const void *b){
+    const benchSample *sa = a, *sb = b;
+    double x = (double)sa->ns/sa->ops, y = (double)sb->ns/sb->ops;
+
+    return x < y ? -1 : x > y;
+}
+
+static void runBench(char *name, void (*fn)(benchArg *a), long n, int keylen){
+    benchSample samples[MAX_REPEATS];
+    benchArg a = {n, keylen};
+    benchSample *med;
+    char params[64];
+    double misses;
+
+    if(filter && !strstr(name, filter)) return;
+    for(int j = 0; j < repeats; j++){
+        cur = &samples[j];
+        fn(&a);
+    }
+    qsort(samples, repeats, sizeof(benchSample), compareSamples);
+    med = &samples[repeats/2];
+    misses = med->misses == -1 ? -1 : (double)med->misses/med->ops;
+    if(keylen) snprintf(params, sizeof(params), "n=%ld size=%d", n, keylen);
+    else snprintf(params, sizeof(params), "n=%ld", n);
+
+    if(json){
+        printf("%s\n    {\"name\": \"%s\", \"n\": %ld, \"size\": %d, \"ops\": %lld, "
+            "\"ns_per_op\": %.2f, \"ns_per_op_min\": %.2f, ", printed ? "," : "",
+            name, n, keylen, med->ops, (double)med->ns/med->ops,
+            (double)samples[0].ns/samples[0].ops);
+        if(misses == -1) printf("\"cache_misses_per_op\": null, ");
+        else printf("\"cache_misses_per_op\": %.3f, ", misses);
+        if(med->bytes) printf("\"mb_per_sec\": %.1f}", (double)med->bytes*1000/med->ns);
+        else printf("\"mb_per_sec\": null}");
+    }else{
+        printf("%-22s %-22s %10.2f %10.2f", name, params,
+            (double)med->ns/med->ops, (double)samples[0].ns/samples[0].ops);
+        if(misses == -1) printf(" %12s", "n/a");
+        else printf(" %12.3f", misses);
+        if(med->bytes) printf(" %10.1f", (double)med->bytes*1000/med->ns);
+        printf("\n");
+    }
+    printed++;
+    fflush(stdout);
+}
+
+int main(int argc, char **argv){
+    long sizes[] = {1000, 65536, 1000000};
+    int keylens[] = {8, 64};
+
+    for(int j = 1; j < argc; j++){
+        if(!strcmp(argv[j], "-r") && j+1 < argc) repeats = atoi(argv[++j]);
+        else if(!strcmp(argv[j], "-f") && j+1 < argc) filter = argv[++j];
+        else if(!strcmp(argv[j], "--json")) json = 1;
+        else{
+            fprintf(stderr, "Usage: micro-benchmark [-r repeats] [-f filter] [--json]\n");
+            return 1;
+        }
+    }
+    if(repeats < 1 || repeats > MAX_REPEATS){
+        fprintf(stderr, "repeats must be between 1 and %d\n", MAX_REPEATS);
+        return 1;
+    }
+    perfInit();
+
+    if(json){
+        printf("{\n  \"repeats\": %d,\n  \"cache_misses\": %s,\n  \"benchmarks\": [",
+            repeats, perffd == -1 ? "false" : "true");
+    }else{
+        printf("%-22s %-22s %10s %10s %12s %10s\n", "benchmark", "params",
+            "ns/op", "best ns/op", "misses/op", "MB/s");
+    }
+
+    for(int s = 0; s < 3; s++){
+        for(int k = 0; k < 2; k++){
+            runBench("dictAdd", benchDictAdd, sizes[s], keylens[k]);
+            runBench("dictAdd/presized", benchDictAddPresized, sizes[s], keylens[k]);
+            runBench("dictFind", benchDictFind, sizes[s], keylens[k]);
+            runBench("dictFind/miss", benchDictFindMiss, sizes[s], keylens[k]);
+            runBench("dictDelete", benchDictDelete, sizes[s], keylens[k]);
+        }
+    }
+    runBench("sdscatlen", benchSdscatlen, 1000000, 16);
+    runBench("sdscatlen", benchSdscatlen, 100000, 256);
+    runBench("sdssplitlen", benchSdssplitlen, 10, 8);
+    runBench("sdssplitlen", benchSdssplitlen, 1000, 8);
+    runBench("sdssplitlen", benchSdssplitlen, 1000, 64);
+    runBench("sdsrange", benchSdsrange, 65536, 16);
+    runBench("sdsrange", benchSdsrange, 4194304, 4096);
+    runBench("listPush", benchListPush, 1000000, 0);
+    runBench("listPop", benchListPop, 1000000, 0);
+    runBench("listIndex", benchListIndex, 1000, 0);
+    runBench("listIndex", benchListIndex, 65536, 0);
+    runBench("zmalloc+zfree", benchZmallocFree, 10000000, 16);
+    runBench("zmalloc+zfree", benchZmallocFree, 10000000, 1024);
+    runBench("zmalloc/batch", benchZmallocBatch, 1000000, 16);
+    runBench("zmalloc/batch", benchZmallocBatch, 1000000, 64);
+    runBench("zmalloc/batch", benchZmallocBatch, 100000, 1024);
+
+    if(json) printf("\n  ]\n}\n");
+    if(perffd != -1) close(perffd);
+    return 0;
+}
@@ -0,0 +1,497 @@
+// mredis-benchmark: a load generator on ae and anet. Every client keeps
+// `pipeline` requests in flight over its own connection until `requests`
+// replies came back, then ops/sec and the latency percentiles are printed.
+//
+//   mredis-benchmark [-h host] [-p port] [-s socket] [-c clients] [-n requests]
+//       [-P pipeline] [-r keyspace] [-d datasize] [-t tests] [-B backend] [-q]
+//
+// -t takes a comma separated list of ping, set, get, incr, lpush, lpop, sadd
+// and lrange, each run on its own. Giving a test a weight, as in
+// "-t get:9,set:1", runs them all as a single mixed workload instead.
+// Keys are picked at random among -r of them, only key 0 is used without it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/time.h>
+#include <sys/select.h>
+
+#include "ae.h"
+#include "anet.h"
+#include "sds.h"
+#include "zmalloc.h"
+
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS ((41-HIST_SUB_BITS+1) << HIST_SUB_BITS)
+
+// how a reply is framed
+#define REPLY_LINE 0 // +OK, :1, -ERR, or a bare integer
+#define REPLY_BULK 1 // $3\r\nfoo\r\n or 3\r\nfoo\r\n, nil when missing
+#define REPLY_MULTIBULK 2 // a count followed by that many bulks
+
+typedef struct benchCommand {
+    char *name;
+    int reply;
+    int weight;
+} benchCommand;
+
+static benchCommand benchCommands[] = {
+    {"ping",REPLY_LINE,0},
+    {"set",REPLY_LINE,0},
+    {"get",REPLY_BULK,0},
+    {"incr",REPLY_LINE,0},
+    {"lpush",REPLY_LINE,0},
+    {"lrange",REPLY_MULTIBULK,0},
+    {"lpop",REPLY_BULK,0},
+    {"sadd",REPLY_LINE,0},
+    {NULL,0,0}
+};
+
+typedef struct benchClient {
+    int fd;
+    int writing; // a writable event is installed
+    sds obuf;
+    sds ibuf;
+    int *inflight; // benchCommands index of every request sent, in order
+    int head, pending;
+    long long start; // when the current batch was sent
+} benchClient;
+
+static struct config {
+    char *host;
+    int port;
+    char *socket; // unix socket path, overrides host and port
+    int numclients;
+    long long requests;
+    int pipeline;
+    long long keyspace;
+    int datasize;
+    int quiet;
+    int backend;
+    aeEventLoop *el;
+    benchClient **clients;
+    sds data;
+    // the run in progress
+    benchCommand *mix[8];
+    int mixlen, totweight;
+    long long issued, done, errors;
+    long long hist[HIST_BUCKETS];
+    unsigned long long seed;
+} config;
+
+static long long ustime(void){
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec*1000000+tv.tv_usec;
+}
+
+// same log-linear buckets as INFO commandstats
+static int histBucket(long long us){
+    int msb, b;
+
+    if(us < (1 << HIST_SUB_BITS)) return us < 0 ? 0 : us;
+    msb = 63-__builtin_clzll(us);
+    b = ((msb-HIST_SUB_BITS+1) << HIST_SUB_BITS) +
+        ((us >> (msb-HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS)-1));
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS-1;
+}
+
+static long long histBucketMax(int b){
+    int sub = (1 << HIST_SUB_BITS), shift;
+
+    if(b < sub) return b;
+    shift = (b >> HIST_SUB_BITS)-1;
+    return ((long long)(sub + (b & (sub-1))) << shift) + (1LL << shift) - 1;
+}
+
+static long long histPercentile(double perc){
+    long long seen = 0;
+
+    for(int j = 0; j < HIST_BUCKETS; j++){
+        seen += config.hist[j];
+        if(config.done && seen >= config.done*perc/100) return histBucketMax(j);
+    }
+    return 0;
+}
+
+// xorshift64*, the libc rand() is too short for big keyspaces
+static unsigned long long nextRandom(void){
+    config.seed ^= config.seed >> 12;
+    config.seed ^= config.seed << 25;
+    config.seed ^= config.seed >> 27;
+    return config.seed*2685821657736338717ULL;
+}
+
+static long long randomKey(void){
+    if(config.keyspace <= 1) return 0;
+    return (long long)(nextRandom() % (unsigned long long)config.keyspace);
+}
+
+static int pickCommand(void){
+    int r;
+
+    if(config.mixlen == 1) return config.mix[0]-benchCommands;
+    r = nextRandom() % config.totweight;
+    for(int j = 0; j < config.mixlen; j++){
+        if(r < config.mix[j]->weight) return config.mix[j]-benchCommands;
+        r -= config.mix[j]->weight;
+    }
+    return config.mix[0]-benchCommands;
+}
+
+static sds catCommand(sds buf, int cmd){
+    char *name = benchCommands[cmd].name;
+
+    if(!strcmp(name, "ping")){
+        buf = sdscat(buf, "ping\r\n");
+    }else if(!strcmp(name, "set")){
+        buf = sdscatprintf(buf, "set key:%012lld %d\r\n", randomKey(), config.datasize);
+        buf = sdscatlen(buf, config.data, config.datasize);
+        buf = sdscatlen(buf, "\r\n", 2);
+    }else if(!strcmp(name, "get")){
+        buf = sdscatprintf(buf, "get key:%012lld\r\n", randomKey());
+    }else if(!strcmp(name, "incr")){
+        buf = sdscatprintf(buf, "incr counter:%012lld\r\n", randomKey());
+    }else if(!strcmp(name, "lpush")){
+        buf = sdscatprintf(buf, "lpush mylist %d\r\n", config.datasize);
+        buf = sdscatlen(buf, config.data, config.datasize);
+        buf = sdscatlen(buf, "\r\n", 2);
+    }else if(!strcmp(name, "lpop")){
+        buf = sdscat(buf, "lpop mylist\r\n");
+    }else if(!strcmp(name, "sadd")){
+        buf = sdscatprintf(buf, "sadd myset 20\r\nelement:%012lld\r\n", randomKey());
+    }else{
+        buf = sdscat(buf, "lrange mylist 0 99\r\n");
+    }
+    return buf;
+}
+
+// length of the \r\n terminated line at p, -1 if incomplete
+static long lineLen(char *p, char *end){
+    char *nl = memchr(p, '\n', end-p);
+
+    return nl ? nl-p+1 : -1;
+}
+
+// Bytes taken by one bulk at p, 0 if it did not all arrive yet.
+static long bulkLen(char *p, char *end, int *err){
+    long l = lineLen(p, end), n;
+    char *len = p;
+
+    if(l == -1) return 0;
+    if(*p == '-' && p[1] != '1'){
+        *err = 1;
+        return l;
+    }
+    if(*len == '$') len++;
+    if(!strncmp(len, "nil", 3) || *len == '-') return l;
+    n = strtol(len, NULL, 10)+2;
+    return (end-p) >= l+n ? l+n : 0;
+}
+
+// Bytes taken by the reply at the head of c->ibuf, 0 if incomplete.
+static long replyLen(benchClient *c, int type, int *err){
+    char *p = c->ibuf, *end = c->ibuf+sdslen(c->ibuf);
+    long l, count, taken;
+
+    *err = 0;
+    if(type == REPLY_BULK) return bulkLen(p, end, err);
+    if((l = lineLen(p, end)) == -1) return 0;
+    if(*p == '-') *err = 1;
+    if(type == REPLY_LINE || *p == '-') return l;
+
+    if(*p == '*') p++;
+    count = strtol(p, NULL, 10);
+    p = c->ibuf+l;
+    for(long j = 0; j < count; j++){
+        if((taken = bulkLen(p, end, err)) == 0) return 0;
+        p += taken;
+    }
+    return p-c->ibuf;
+}
+
+static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+static void addEvent(int fd, int mask, aeFileEventProc *proc, void *data){
+    aeFileEvent *fe = zmalloc(sizeof(*fe));
+
+    fe->fd = fd;
+    fe->mask = mask;
+    fe->fileProc = proc;
+    fe->finalizerProc = NULL;
+    fe->clientData = data;
+    aeCreateFileEvent(config.el, fe);
+}
+
+// sends the next batch of requests, if any are left
+static void issueRequests(benchClient *c){
+    while(c->pending < config.pipeline && config.issued < config.requests){
+        int cmd = pickCommand();
+
+        c->obuf = catCommand(c->obuf, cmd);
+        c->inflight[(c->head+c->pending) % config.pipeline] = cmd;
+        c->pending++;
+        config.issued++;
+    }
+    if(sdslen(c->obuf) && !c->writing){
+        c->writing = 1;
+        addEvent(c->fd, AE_WRITABLE, writeHandler, c);
+    }
+    c->start = ustime();
+}
+
+static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask){
+    benchClient *c = privdata;
+    ssize_t n;
+    AE_NOTUSED(el);
+    AE_NOTUSED(mask);
+
+    n = write(fd, c->obuf, sdslen(c->obuf));
+    if(n == -1){
+        if(errno == EAGAIN) return;
+        fprintf(stderr, "Writing to the server: %s\n", strerror(errno));
+        exit(1);
+    }
+    c->obuf = sdsrange(c->obuf, n, -1);
+    if(sdslen(c->obuf) == 0){
+        c->writing = 0;
+        aeDeleteFileEvent(config.el, fd, AE_WRITABLE);
+    }
+}
+
+static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask){
+    benchClient *c = privdata;
+    char buf[16*1024];
+    ssize_t n;
+    long len;
+    int err;
+    AE_NOTUSED(el);
+    AE_NOTUSED(mask);
+
+    n = read(fd, buf, sizeof(buf));
+    if(n == -1 && errno == EAGAIN) return;
+    if(n <= 0){
+        fprintf(stderr, "Reading from the server: %s\n", n ? strerror(errno) : "connection closed");
+        exit(1);
+    }
+    c->ibuf = sdscatlen(c->ibuf, buf, n);
+    while(c->pending && (len = replyLen(c, benchCommands[c->inflight[c->head]].reply, &err)) > 0){
+        c->ibuf = sdsrange(c->ibuf, len, -1);
+        c->head = (c->head+1) % config.pipeline;
+        c->pending--;
+        config.done++;
+        config.errors += err;
+        config.hist[histBucket(ustime()-c->start)]++;
+    }
+    if(config.done == config.requests){
+        aeEventLoopStop(config.el);
+        return;
+    }
+    if(c->pending == 0) issueRequests(c);
+}
+
+static benchClient *createClient(void){
+    char err[ANET_ERR_LEN];
+    benchClient *c;
+    int fd;
+
+    if(config.socket){
+        if((fd = anetUnixNonBlockConnect(err, config.socket)) == ANET_ERR){
+            fprintf(stderr, "Connecting to %s: %s\n", config.socket, err);
+            exit(1);
+        }
+    }else if((fd = anetTcpNonBlockConnect(err, config.host, config.port)) == ANET_ERR){
+        fprintf(stderr, "Connecting to %s:%d: %s\n", config.host, config.port, err);
+        exit(1);
+    }
+    if(config.backend == AE_BACKEND_SELECT && fd >= FD_SETSIZE){
+        fprintf(stderr, "Too many clients for select(), use -B io_uring\n");
+        exit(1);
+    }
+    if(!config.socket) anetTcpNoDelay(NULL, fd);
+    c = zmalloc(sizeof(*c));
+    c->fd = fd;
+    c->writing = 0;
+    c->obuf = sdsempty();
+    c->ibuf = sdsempty();
+    c->inflight = zmalloc(sizeof(int)*config.pipeline);
+    c->head = 0;
+    c->pending = 0;
+    addEvent(fd, AE_READABLE, readHandler, c);
+    return c;
+}
+
+static void freeClient(benchClient *c){
+    aeDeleteFileEvent(config.el, c->fd, AE_READABLE);
+    if(c->writing) aeDeleteFileEvent(config.el, c->fd, AE_WRITABLE);
+    close(c->fd);
+    sdsfree(c->obuf);
+    sdsfree(c->ibuf);
+    zfree(c->inflight);
+    zfree(c);
+}
+
+static void runBenchmark(char *title){
+    long long start, elapsed;
+
+    config.issued = config.done = config.errors = 0;
+    memset(config.hist, 0, sizeof(config.hist));
+    for(int j = 0; j < config.numclients; j++)
+        config.clients[j] = createClient();
+    start = ustime();
+    for(int j = 0; j < config.numclients; j++)
+        issueRequests(config.clients[j]);
+    aeMain(config.el);
+    elapsed = ustime()-start;
+    for(int j = 0; j < config.numclients; j++)
+        freeClient(config.clients[j]);
+    if(elapsed == 0) elapsed = 1;
+
+    if(config.quiet){
+        printf("%s: %.2f requests per second, p50=%.3f msec%s\n", title,
+            (double)config.done*1000000/elapsed, histPercentile(50)/1000.0,
+            config.errors ? " (error replies)" : "");
+        return;
+    }
+    printf("====== %s ======\n", title);
+    printf("  %lld requests completed in %.2f seconds\n", config.done, elapsed/1000000.0);
+    printf("  %d parallel clients, pipeline %d\n", config.numclients, config.pipeline);
+    printf("  %d bytes payload, keyspace %lld\n", config.datasize, config.keyspace);
+    if(config.errors) printf("  %lld error replies\n", config.errors);
+    printf("  latency (msec): p50=%.3f p90=%.3f p99=%.3f p99.9=%.3f max=%.3f\n",
+        histPercentile(50)/1000.0, histPercentile(90)/1000.0, histPercentile(99)/1000.0,
+        histPercentile(99.9)/1000.0, histPercentile(100)/1000.0);
+    printf("  %.2f requests per second\n\n", (double)config.done*1000000/elapsed);
+}
+
+// Fills the weights from -t. Returns 1 for a mixed run, -1 on errors.
+static int parseTests(char *spec){
+    int count, mixed = 0, known;
+    sds *tests = sdssplitlen(spec, strlen(spec), ",", 1, &count);
+
+    for(int j = 0; j < count; j++){
+        char *w = strchr(tests[j], ':');
+
+        if(w) *w++ = '\0';
+        known = 0;
+        for(int k = 0; benchCommands[k].name; k++){
+            if(strcasecmp(tests[j], benchCommands[k].name)) continue;
+            benchCommands[k].weight = w ? atoi(w) : 1;
+            known = 1;
+        }
+        if(!known || (w && atoi(w) <= 0)){
+            fprintf(stderr, "Unknown test '%s'\n", tests[j]);
+            mixed = -1;
+        }
+        if(w && mixed != -1) mixed = 1;
+    }
+    for(int j = 0; j < count; j++) sdsfree(tests[j]);
+    zfree(tests);
+    return mixed;
+}
+
+static void usage(void){
+    fprintf(stderr,
+"Usage: mredis-benchmark [-h host] [-p port] [-s socket] [-c clients]\n"
+"    [-n requests] [-P pipeline] [-r keyspace] [-d datasize] [-t tests]\n"
+"    [-B backend] [-q]\n\n"
+" -s <socket>      connect to a unix socket instead of host and port\n"
+" -c <clients>     parallel connections (default 50)\n"
+" -n <requests>    total requests (default 100000)\n"
+" -P <pipeline>    requests in flight per connection (default 1)\n"
+" -r <keyspace>    use random keys among that many (default 1, a single key)\n"
+" -d <size>        SET/LPUSH value size in bytes (default 3)\n"
+" -t <tests>       ping,set,get,incr,lpush,lrange,lpop,sadd (default all),\n"
+"                  name:weight runs them as a single mix, e.g. get:9,set:1\n"
+" -B <backend>     select or io_uring event loop (default select)\n"
+" -q               one line per test\n");
+    exit(1);
+}
+
+int main(int argc, char **argv){
+    char *tests = "ping,set,get,incr,lpush,lrange,lpop,sadd";
+    int mixed;
+
+    config.host = "127.0.0.1";
+    config.port = 6379;
+    config.socket = NULL;
+    config.numclients = 50;
+    config.requests = 100000;
+    config.pipeline = 1;
+    config.keyspace = 1;
+    config.datasize = 3;
+    config.quiet = 0;
+    config.backend = AE_BACKEND_SELECT;
+    config.seed = (unsigned long long)ustime() | 1;
+
+    for(int j = 1; j < argc; j++){
+        int more = j+1 < argc;
+
+        if(!strcmp(argv[j], "-h") && more) config.host = argv[++j];
+        else if(!strcmp(argv[j], "-p") && more) config.port = atoi(argv[++j]);
+        else if(!strcmp(argv[j], "-s") && more) config.socket = argv[++j];
+        else if(!strcmp(argv[j], "-c") && more) config.numclients = atoi(argv[++j]);
+        else if(!strcmp(argv[j], "-n") && more) config.requests = atoll(argv[++j]);
+        else if(!strcmp(argv[j], "-P") && more) config.pipeline = atoi(argv[++j]);
+        else if(!strcmp(argv[j], "-r") && more) config.keyspace = atoll(argv[++j]);
+        else if(!strcmp(argv[j], "-d") && more) config.datasize = atoi(argv[++j]);
+        else if(!strcmp(argv[j], "-t") && more) tests = argv[++j];
+        else if(!strcmp(argv[j], "-B") && more){
+            j++;
+            if(!strcasecmp(argv[j], "select")) config.backend = AE_BACKEND_SELECT;
+            else if(!strcasecmp(argv[j], "io_uring")) config.backend = AE_BACKEND_IO_URING;
+            else usage();
+        }
+        else if(!strcmp(argv[j], "-q")) config.quiet = 1;
+        else usage();
+    }
+    if(config.numclients < 1 || config.requests < 1 || config.pipeline < 1 ||
+        config.keyspace < 1 || config.datasize < 1) usage();
+    if((mixed = parseTests(tests)) == -1) usage();
+
+    config.data = sdsnewlen(NULL, config.datasize);
+    memset(config.data, 'x', config.datasize);
+    config.clients = zmalloc(sizeof(benchClient*)*config.numclients);
+    aeSetBackend(config.backend);
+    config.el = aeCreateEventLoop();
+
+    if(mixed){
+        sds title = sdsempty();
+
+        config.mixlen = config.totweight = 0;
+        for(int k = 0; benchCommands[k].name; k++){
+            if(!benchCommands[k].weight) continue;
+            config.mix[config.mixlen++] = &benchCommands[k];
+            config.totweight += benchCommands[k].weight;
+            title = sdscatprintf(title, "%s%s:%d", sdslen(title) ? "," : "",
+                benchCommands[k].name, benchCommands[k].weight);
+        }
+        runBenchmark(title);
+        sdsfree(title);
+    }else{
+        for(int k = 0; benchCommands[k].name; k++){
+            char title[32];
+            int j;
+
+            if(!benchCommands[k].weight) continue;
+            config.mix[0] = &benchCommands[k];
+            config.mixlen = 1;
+            config.totweight = 1;
+            for(j = 0; benchCommands[k].name[j] && j < 30; j++)
+                title[j] = toupper(benchCommands[k].name[j]);
+            title[j] = '\0';
+            if(!strcmp(title, "LRANGE")) strcpy(title, "LRANGE (first 100 elements)");
+            runBenchmark(title);
+        }
+    }
+
+    aeEventLoopDelete(config.el);
+    zfree(config.clients);
+    sdsfree(config.data);
+    return 0;
+}
@@ -8,11 +8,45 @@
 # include <errno.h>
 # include <signal.h>
 # include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <stdarg.h>
+# include <unistd.h>
+# include <pthread.h>
+# include <stdint.h>
+# include <sys/time.h>
+# include <sys/wait.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <fcntl.h>
+# include <sched.h>
+# include <poll.h>
+# include <sys/socket.h>
+# include <sys/uio.h>
+# ifdef __linux__
+# include <sys/sendfile.h>
+# include <netinet/in.h>
+# include <linux/errqueue.h>
+# endif
+# include "crc64.h"
+# include "lzf.h"
 
 
+# define REDIS_VERSION "0.1"
 # define REDIS_MAX_ARGS 16
 # define REDIS_CMD_BULK 1
 # define REDIS_CMD_INLINE 2
+# define REDIS_CMD_KEYSPACE 4 // works on the whole keyspace, runs with the other shards paused
+# define REDIS_CMD_WRITE 8 // may modify the dataset, propagated
+# define REDIS_CMD_READONLY 16 // only reads the dataset
+# define REDIS_CMD_DENYOOM 32 // may grow memory usage
+# define REDIS_CMD_FAST 64 // O(1) or O(log N), never blocks the loop for long
+# define REDIS_CMD_SCATTER 128 // runs on every shard's slice of the db, replies merged
+# define REDIS_CMD_NOSHARD 256 // not available in shard mode
+// command latency histogram: 8 linear sub-buckets per power of two, so a
+// bucket is at most 12.5% wide, up to 2^41 usec
+# define REDIS_CMD_HIST_SUB_BITS 3
+# define REDIS_CMD_HIST_BUCKETS ((41-REDIS_CMD_HIST_SUB_BITS+1) << REDIS_CMD_HIST_SUB_BITS)
 # define REDIS_DEBUG 0
 # define REDIS_NOTICE 1
 # define REDIS_WARNING 2
@@ -20,8 +54,56 @@
 # define REDIS_DEFAULT_DBNUM 16
 // replication
 # define REDIS_REPL_NONE 0
-# define REDIS_REPL_CONNECT 1
-# define REDIS_REPL_CONNECTED 2
+# define REDIS_REPL_CONNECT 1 // slave side
+# define REDIS_REPL_TRANSFER 2
+# define REDIS_REPL_CONNECTED 3
+# define REDIS_REPL_WAIT_BGSAVE_START 4 // master side, per slave
+# define REDIS_REPL_WAIT_BGSAVE_END 5
+# define REDIS_REPL_SEND_BULK 6
+# define REDIS_REPL_ONLINE 7
+# define REDIS_REPL_TIMEOUT 60
+# define REDIS_ZEROCOPY_LINGER 60 // seconds a freed client's sends may take
+# define REDIS_REPL_BACKLOG_SIZE (1024*1024)
+# define REDIS_RUN_ID_SIZE 40
+# define REDIS_IOBUF_LEN (16*1024)
+# define REDIS_TCP_BACKLOG 511
+# define REDIS_MAX_ACCEPTS_PER_CALL 1000
+# define REDIS_MAX_WRITE_PER_EVENT (1024*64) // then the next client gets its turn
+# define REDIS_SEND_IOV 64 // replies gathered in one io_uring send
+// output buffer limit classes
+# define REDIS_CLIENT_LIMIT_CLASS_NORMAL 0
+# define REDIS_CLIENT_LIMIT_CLASS_SLAVE 1
+# define REDIS_CLIENT_LIMIT_NUM_CLASSES 2
+// slow log
+# define REDIS_SLOWLOG_LOG_SLOWER_THAN 10000 // usec
+# define REDIS_SLOWLOG_MAX_LEN 128
+# define REDIS_SLOWLOG_ENTRY_MAX_STRING 128 // longer arguments are truncated
+# define REDIS_PEER_ID_LEN 64
+// latency monitor
+# define REDIS_LATENCY_TS_LEN 160 // samples kept per event
+// hot keys, a count-min sketch of DEPTH rows of WIDTH counters
+# define REDIS_HOTKEYS_DEPTH 4
+# define REDIS_HOTKEYS_WIDTH 4096 // power of two
+# define REDIS_HOTKEYS_TOP 32
+# define REDIS_HOTKEYS_DECAY_SECS 10 // counters are halved this often
+// big keys scan
+# define REDIS_BIGKEYS_TOP 10 // kept per type
+# define REDIS_BIGKEYS_SLICE_US 1000 // scanned per run of the timer
+# define REDIS_BIGKEYS_PERIOD_MS 10
+// active defrag
+# define REDIS_DEFRAG_PERIOD_MS 10 // a slice plus the pause after it
+# define REDIS_DEFRAG_MAX_ELEMENTS 1000 // bigger lists and sets keep their elements
+# define REDIS_DEFRAG_IDLE_SECS 60 // wait after a pass that did not help, unless it got worse
+# define REDIS_REPL_DISKLESS_SYNC_DELAY 5
+# define REDIS_RDB_EOF_MARK_SIZE 40
+
+// where the BGSAVE child writes the dump
+# define REDIS_RDB_CHILD_TYPE_DISK 0
+# define REDIS_RDB_CHILD_TYPE_SOCKET 1
+
+// how a slave loads the dump of a full resync
+# define REDIS_REPL_DISKLESS_LOAD_DISABLED 0
+# define REDIS_REPL_DISKLESS_LOAD_SWAPDB 1
 
 # define ANET_ERR_LEN 1024
 # define REDIS_CONFIGLINE_MAX 1024
@@ -32,10 +114,64 @@
 # define REDIS_LIST 1
 # define REDIS_SET 2
 # define REDIS_HASH 3
+// dump file opcodes, share the byte with the object types
+# define REDIS_RESIZEDB 253 // number of keys of the db that follows
+# define REDIS_SELECTDB 254
+# define REDIS_EOF 255
+# define REDIS_RDB_VERSION 3
+// dump file string encodings, in the low two bits of the string header
+# define REDIS_RDB_ENC_RAW 0
+# define REDIS_RDB_ENC_INT 1 // decimal string stored as a zigzag varint
+# define REDIS_RDB_ENC_LZF 2
+# define REDIS_RDB_COMPRESS_MIN_LEN 20
+# define REDIS_RDB_MAX_STRING (512*1024*1024) // when the dump size is unknown
+# define REDIS_RDB_MIN_ENTRY 3 // type, key and value take a byte at least
+// loading
+# define REDIS_LOADING_BUFLEN (1024*1024)
+# define REDIS_LOADING_EVENTS_BYTES (2*1024*1024) // serve clients this often
+# define REDIS_LOAD_BATCH_LEN 1024
+# define REDIS_LOAD_QUEUE_LEN 64 // power of two
+// append only file
+# define REDIS_AOF_FSYNC_NO 0
+# define REDIS_AOF_FSYNC_ALWAYS 1
+# define REDIS_AOF_FSYNC_EVERYSEC 2
+# define REDIS_AOF_LINE_MAX 1024 // like the inline protocol
+# define REDIS_AOF_DIFF_CHUNK (64*1024) // sent to the rewrite child per iteration
 # define REDIS_OK 0 
-# define REDIS_OK -1 
+# define REDIS_ERR -1 
+// client flags
+# define REDIS_CLOSE 1
+# define REDIS_SLAVE 2
+# define REDIS_MASTER 4
+# define REDIS_CLOSE_ASAP 8 // set by I/O threads, freed by main thread
+# define REDIS_PENDING_READ 16
+# define REDIS_PENDING_WRITE 32
+# define REDIS_PENDING_COMMAND 64 // argv parsed by an I/O thread
+# define REDIS_SHARD_WAIT 128 // command forwarded, waiting for the owner shard
+# define REDIS_SHARD_PROXY 256 // runs commands forwarded from other shards
+# define REDIS_AOF_CLIENT 512 // replays the append only file
+# define REDIS_PRE_PSYNC 1024 // slave that used SYNC, gets no +FULLRESYNC
+# define REDIS_ZEROCOPY 2048 // SO_ZEROCOPY is on for the socket
+# define REDIS_NO_ZEROCOPY 4096 // the socket refused SO_ZEROCOPY
+// I/O threads
+# define REDIS_IO_THREADS_MAX 128
+# define REDIS_IO_THREADS_OP_IDLE 0
+# define REDIS_IO_THREADS_OP_READ 1
+# define REDIS_IO_THREADS_OP_WRITE 2
+// shards
+# define REDIS_SHARDS_MAX 256
+# define REDIS_SHARD_QUEUE_LEN 1024 // power of two
+# define REDIS_SHARD_MSG_CALL 0
+# define REDIS_SHARD_MSG_REPLY 1
+// MEMORY USAGE looks at this many elements of an aggregate by default
+# define REDIS_MEMORY_SAMPLES 5
 
 
+struct saveparam {
+    time_t seconds;
+    int changes;
+};
+
 typedef struct redisObj {
     int type;
     void *ptr;
@@ -49,6 +185,14 @@ struct redisCommand {
     redisCommandProc *proc;
     int arity;
     int flags;
+    // argv positions of the keys, lastkey < 0 counts from the end
+    int firstkey;
+    int lastkey;
+    int keystep;
+    // stats, shards update them concurrently
+    long long calls;
+    long long microseconds;
+    long long latency_hist[REDIS_CMD_HIST_BUCKETS];
 };
 
 typedef struct redisClient {
@@ -62,16 +206,133 @@ typedef struct redisClient {
     list *reply;
 
     int sentlen;
+    size_t reply_bytes; // total length of the objects in reply
+    time_t obuf_soft_limit_reached_time; // 0 while under the soft limit
     time_t lastinteraction;
     int flags;
-    int slaveseldb; // slave select db
+    int replstate; // slaves only
+    int repldbfd; // dump being sent
+    off_t repldboff;
+    off_t repldbsize;
+    sds replpreamble; // bulk length sent before the dump
+    long long read_reploff; // master only, stream bytes read
+    long long reploff; // master only, stream bytes applied
+    struct redisCommand *lastcmd; // last command run, checked before the lookup
+    list *zcpinned; // replies sent with MSG_ZEROCOPY the kernel still reads
+    unsigned int zcseq; // id of the next MSG_ZEROCOPY send
+    struct clientSend *sending; // replies io_uring is sending
 } redisClient;
 
+// replies handed to aeSendv(), pinned until the kernel is done with them
+typedef struct clientSend {
+    redisClient *c; // NULL once the client is freed
+    int count;
+    robj *objs[REDIS_SEND_IOV];
+    struct iovec iov[REDIS_SEND_IOV];
+} clientSend;
+
+// a class of clients is disconnected once its pending replies exceed
+// hard_limit_bytes, or soft_limit_bytes for soft_limit_seconds; 0 is no limit
+typedef struct clientBufferLimitsConfig {
+    unsigned long long hard_limit_bytes;
+    unsigned long long soft_limit_bytes;
+    time_t soft_limit_seconds;
+} clientBufferLimitsConfig;
+
+// a command that ran for longer than slowlog-log-slower-than
+typedef struct slowlogEntry {
+    long long id;
+    time_t time;
+    long long duration; // usec
+    int argc;
+    sds argv[REDIS_MAX_ARGS];
+    char peer[REDIS_PEER_ID_LEN];
+} slowlogEntry;
+
+// latency monitor: the worst latency of an event in one second
+typedef struct latencySample {
+    int32_t time;
+    uint32_t latency; // ms
+} latencySample;
+
+typedef struct latencyTimeSeries {
+    int idx; // where the next sample goes
+    uint32_t max; // all time worst
+    latencySample samples[REDIS_LATENCY_TS_LEN];
+} latencyTimeSeries;
+
+// a key in the top of the hot keys sketch
+typedef struct hotKey {
+    sds key;
+    int dictid;
+    uint64_t hash;
+    uint32_t count; // sketch estimate
+} hotKey;
+
+// one of the largest keys of a type found by BIGKEYS
+typedef struct bigKey {
+    sds key;
+    int dictid;
+    long long size; // bytes for strings, elements otherwise
+    size_t memory; // see MEMORY USAGE
+} bigKey;
+
+// a reply object held until the MSG_ZEROCOPY send with id seq completes
+typedef struct zcPinned {
+    robj *obj;
+    unsigned int seq;
+} zcPinned;
+
+// the socket of a freed client, kept until its zero copy sends completed
+typedef struct zcClosing {
+    int fd;
+    list *pinned;
+    time_t since;
+} zcClosing;
+
+// single producer single consumer ring, one per pair of shards
+typedef struct spscQueue {
+    // padded apart rather than aligned: zmalloc only guarantees 8 bytes
+    unsigned long head; // written by the consumer
+    char pad[64-sizeof(unsigned long)];
+    unsigned long tail; // written by the producer
+    unsigned long mask;
+    void **slots;
+} spscQueue;
+
+typedef struct redisShard {
+    int id;
+    pthread_t thread;
+    aeEventLoop *el;
+    int fd; // SO_REUSEPORT listener
+    dict **dict; // this shard's slice of every db
+    list *clients;
+    list *clients_pending_write;
+    list *zcclosing; // zcClosing, see closeParkedZerocopyClients()
+    redisClient *proxy; // executes commands forwarded by other shards
+    spscQueue **inbox; // inbox[i] is only written by shard i
+    list **outbox; // messages waiting for room in a full inbox
+    int wakefd[2];
+    int notified;
+} redisShard;
+
+typedef struct shardMsg {
+    int type;
+    int from;
+    redisClient *c;
+    struct redisCommand *cmd;
+    int dictid;
+    int argc;
+    robj *argv[REDIS_MAX_ARGS];
+    list *reply;
+} shardMsg;
+
 
 struct redisServer {
     int port;
     int fd;
-    dict *dict;
+    dict **dict;
+    dict *commands; // command name -> redisCommand, see populateCommandTable()
     
     list *clients;
     list *slaves;
@@ -84,6 +345,8 @@ struct redisServer {
     list *objfreelist;
     time_t lastsave;
     int usedmemory;
+    size_t stat_peak_memory; // highest used memory seen by the cron
+    size_t initial_memory_usage; // before loading the dataset
 
     time_t stat_starttime;
     long long stat_numcommands;
@@ -96,11 +359,61 @@ struct redisServer {
     int dbnum;
     int daemonize;
     int bgsaveinprogress;
+    pid_t bgsavechildpid;
+    long long dirty_before_bgsave;
     struct saveparam *saveparams;
     int saveparamslen;
     char *logfile;
     char *bindaddr;
+    char *bindaddr6; // IPv6 listener, NULL when there is none
+    int ipfd6;
+    char *unixsocket; // unix domain socket listener, NULL when there is none
+    mode_t unixsocketperm;
+    int sofd;
+    int tcp_backlog;
+    int reuseport; // SO_REUSEPORT even with a single shard
+    int ae_backend; // AE_BACKEND_SELECT or AE_BACKEND_IO_URING
     char *dbfilename;
+    int rdbcompression;
+    int loading_decode_thread;
+
+    // loading progress
+    int loading;
+    int loading_threaded; // a decode thread allocates objects
+    time_t loading_start_time;
+    long long loading_total_bytes;
+    long long loading_loaded_bytes;
+    long long loading_loaded_keys;
+    long long loading_events_bytes;
+
+    // append only file
+    int appendonly;
+    int appendfsync;
+    char *appendfilename;
+    int appendfd;
+    int appendseldb; // db selected by the last logged command
+    sds aofbuf; // written out once per loop iteration
+    long long aof_current_size;
+    long long aof_fsynced_size;
+    time_t aof_last_fsync;
+    int aof_fsync_in_progress; // cleared by the fsync thread
+    int aof_fsync_errno; // of the last background fsync, 0 when it worked
+    long long aof_fsync_pending_size; // covered by that fsync, -1 if none
+    pid_t aofrewritechildpid;
+    int aof_rewrite_scheduled; // BGREWRITEAOF waits for a BGSAVE
+    sds aof_rewrite_buf; // writes the rewrite child has not been sent yet
+    long long aof_rewrite_base_size; // log size after the last rewrite
+    int aof_rewrite_perc;
+    long long aof_rewrite_min_size;
+    int aof_pipe_write_data_to_child;
+    int aof_pipe_read_data_from_parent;
+    int aof_pipe_write_ack_to_parent;
+    int aof_pipe_read_ack_from_child;
+    int aof_pipe_write_ack_to_child;
+    int aof_pipe_read_ack_from_parent;
+    int aof_stop_sending_diff;
+    int aof_use_rdb_preamble;
+    sds aof_child_diff; // rewrite child only
 
     // rep
     int isslave;
@@ -108,11 +421,87 @@ struct redisServer {
     int masterport;
     redisClient *master;
     int replstate;
+    char replid[REDIS_RUN_ID_SIZE+1];
+    long long master_repl_offset; // bytes of the stream produced or applied
+    int repl_can_psync; // a slave has replid and offset of its master
+    int repl_master_dictid; // db the stream had selected when the link dropped
+    int slaveseldb; // db selected by the stream
+    robj **selectcmds; // "select <db>\r\n", shared by the AOF and the slaves
+    char *repl_backlog; // ring, NULL until the first slave attaches
+    long long repl_backlog_size;
+    long long repl_backlog_histlen;
+    long long repl_backlog_idx; // where the next byte goes
+    long long repl_backlog_off; // stream offset of the oldest byte
+    long long stat_sync_full;
+    long long stat_sync_partial_ok;
+    size_t zerocopy_threshold; // replies this large use MSG_ZEROCOPY, 0 is off
+    clientBufferLimitsConfig client_obuf_limits[REDIS_CLIENT_LIMIT_NUM_CLASSES];
+    long long slowlog_log_slower_than; // usec, < 0 disables the slow log
+    int slowlog_max_len;
+    slowlogEntry *slowlog; // ring of slowlog_max_len entries
+    int slowlog_len;
+    int slowlog_idx; // where the next entry goes
+    long long slowlog_entry_id;
+    long long latency_monitor_threshold; // ms, 0 disables the latency monitor
+    dict *latency_events; // event name -> latencyTimeSeries
+    int hotkeys_tracking;
+    uint32_t *hotkeys_sketch; // allocated by the first HOTKEYS START
+    hotKey hotkeys[REDIS_HOTKEYS_TOP]; // min-heap on count
+    int hotkeys_len;
+    time_t hotkeys_last_decay;
+    int bigkeys_active;
+    int bigkeys_gen; // tells the timer of an old scan to stop
+    int bigkeys_db;
+    unsigned long bigkeys_cursor;
+    long long bigkeys_scanned;
+    time_t bigkeys_start_time;
+    time_t bigkeys_end_time;
+    bigKey bigkeys[3][REDIS_BIGKEYS_TOP]; // per type, largest first
+    int bigkeys_len[3];
+    int active_defrag_enabled;
+    long long active_defrag_ignore_bytes; // less fragmentation is left alone
+    int active_defrag_threshold_lower; // % of fragmentation to start at
+    int active_defrag_threshold_upper; // % at which the max effort is used
+    int active_defrag_cycle_min; // % of CPU
+    int active_defrag_cycle_max;
+    int active_defrag_running; // % of CPU of the pass in progress, 0 if none
+    int active_defrag_gen; // tells the timer of an old pass to stop
+    int active_defrag_db;
+    unsigned long active_defrag_cursor;
+    long long active_defrag_start; // usec
+    long long active_defrag_start_hits;
+    double active_defrag_start_frag;
+    time_t active_defrag_last_end;
+    double active_defrag_last_gain; // fragmentation the last pass took off
+    double active_defrag_last_frag; // left by the last pass
+    long long stat_active_defrag_hits; // allocations moved
+    long long stat_active_defrag_misses; // allocations left where they were
+    long long stat_active_defrag_scanned; // keys
+    long long stat_active_defrag_skipped; // aggregates too big to walk
+    long long stat_client_outbuf_limit_disconnections;
+    long long stat_zerocopy_sends;
+    long long stat_zerocopy_copied; // the kernel fell back to copying
+    int repl_diskless_sync; // the BGSAVE child writes to the slave sockets
+    int repl_diskless_sync_delay; // seconds to wait for more slaves
+    int repl_diskless_load;
+    int rdb_child_type;
+    int rdb_pipe_read_result; // socket child: how each slave went
 
     // sort
     int sort_desc;
     int sort_alpha;
     int sort_bypattern;
+
+    // threaded I/O
+    int io_threads_num; // 1 means everything runs on the main thread
+    int io_threads_do_reads;
+    int io_threads_active;
+    list *clients_pending_read;
+    list *clients_pending_write;
+    list *zcclosing; // zcClosing of the main loop
+
+    // shared-nothing shards
+    int shards_num; // 1 means a single event loop owns all the keys
 };
 
 static void freeStringObject(robj *o);
@@ -121,14 +510,50 @@ static void freeSetObject(robj *o);
 static void decrRefCount(void *o);
 static robj *createObject(int type, void *ptr);
 static void freeClient(redisClient *c);
+static int getClientLimitClassByName(char *name);
 static int loadDb(char *filename);
 static void addReply(redisClient *c, robj *obj);
 static void addReplySds(redisClient *c, sds s);
 static void incrRefCount(robj *o);
 static int saveDbBackground(char *filename);
 static robj *createStringObject(char *ptr, size_t len);
-static void replicationFeedSlaves(struct redisCommand *cmd, int dictid, robj **argv, int argc);
+static void replicationFeedSlaves(int dictid, robj *cmdobj);
 static int syncWithMaster(void);
+static void redisLog(int level, const char *fmt, ...);
+static int processCommand(redisClient *c);
+static void resetClient(redisClient *c);
+static void processInputBuffer(redisClient *c);
+static void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
+static void acceptHandler(aeEventLoop *el, int fd, void *privData, int mask);
+static void acceptUnixHandler(aeEventLoop *el, int fd, void *privData, int mask);
+static void closeListeningSockets(void);
+static void reapZerocopyCompletions(int fd, list *pinned);
+static void parkZerocopyClient(redisClient *c);
+static int selectDb(redisClient *c, int id);
+static redisClient *createClient(int fd);
+static void populateCommandTable(void);
+static void recordCommandStats(struct redisCommand *cmd, long long duration);
+static sds catCommandStats(sds info);
+static void resetCommandStats(void);
+static void slowlogPushEntryIfNeeded(redisClient *c, robj **argv, int argc, long long duration);
+static void latencyAddSample(char *event, long long latency);
+static void hotkeysTrackCommand(struct redisCommand *cmd, int dictid, robj **argv, int argc);
+static void hotkeysCron(void);
+static void activeDefragCron(void);
+static long long ustime(void);
+static struct redisCommand *lookupCommand(char *name);
+static void feedAppendOnlyFile(int dictid, robj *cmdobj);
+static void flushAppendOnlyFile(void);
+static void aofRewriteSendDiff(void);
+static void aofReadDiffFromParent(void);
+static int rewriteAppendOnlyFileBackground(void);
+static void backgroundRewriteDoneHandler(int statloc);
+static void startBgsaveForReplication(void);
+static void updateSlavesWaitingBgsave(int ok);
+static void replicationCron(void);
+static void emptyDb(void);
+static void shardsPause(void);
+static void shardsResume(void);
 
 static void pingCommand(redisClient *c);
 static void echoCommand(redisClient *c);
@@ -146,6 +571,7 @@ static void randomkeyCommand(redisClient *c);
 static void keysCommand(redisClient *c);
 static void dbsizeCommand(redisClient *c);
 static void lastsaveCommand(redisClient *c);
+static void bgrewriteaofCommand(redisClient *c);
 static void saveCommand(redisClient *c);
 static void bgsaveCommand(redisClient *c);
 static void shutdownCommand(redisClient *c);
@@ -174,56 +600,95 @@ static void flushallCommand(redisClient *c);
 static void sortCommand(redisClient *c);
 static void lremCommand(redisClient *c);
 static void infoCommand(redisClient *c);
+static void configCommand(redisClient *c);
+static void slowlogCommand(redisClient *c);
+static void latencyCommand(redisClient *c);
+static void memoryCommand(redisClient *c);
+static void debugCommand(redisClient *c);
+static void hotkeysCommand(redisClient *c);
+static void bigkeysCommand(redisClient *c);
+
+// Feeds the latency monitor when latency, in ms, reaches the threshold.
+// Cheap enough to wrap anything that may stall the loop.
+# define latencyAddSampleIfNeeded(event, latency) do { \
+    if(server.latency_monitor_threshold && (latency) >= server.latency_monitor_threshold) \
+        latencyAddSample((event), (latency)); \
+} while(0)
 
 // ============================ global =====================
 static struct redisServer server;
+static int io_threads_op;
+static redisShard *shards;
+static __thread redisShard *curshard;
+
+// In shard mode every thread has its own loop, clients and keyspace slice.
+// Shard 0 is the main thread and aliases the server fields.
+# define currentEl() (curshard ? curshard->el : server.el)
+# define currentClients() (curshard ? curshard->clients : server.clients)
+# define currentPendingWrites() (curshard ? curshard->clients_pending_write : server.clients_pending_write)
+# define currentZcClosing() (curshard ? curshard->zcclosing : server.zcclosing)
+# define currentDb() (curshard ? curshard->dict : server.dict)
+# define shardDb(i) (server.shards_num > 1 ? shards[i].dict : server.dict)
+# define refcountAtomic() (server.io_threads_active || server.shards_num > 1)
+# define objFreeListUsable() (io_threads_op == REDIS_IO_THREADS_OP_IDLE && \
+    server.shards_num == 1 && !server.loading_threaded)
+
 static struct redisCommand cmdTable[] = {
-    {"get",getCommand,2,REDIS_CMD_INLINE},
-    {"set",setCommand,3,REDIS_CMD_BULK},
-    {"setnx",setnxCommand,3,REDIS_CMD_BULK},
-    {"del",delCommand,2,REDIS_CMD_INLINE},
-    {"exists",existsCommand,2,REDIS_CMD_INLINE},
-    {"incr",incrCommand,2,REDIS_CMD_INLINE},
-    {"decr",decrCommand,2,REDIS_CMD_INLINE},
-    {"rpush",rpushCommand,3,REDIS_CMD_BULK},
-    {"lpush",lpushCommand,3,REDIS_CMD_BULK},
-    {"rpop",rpopCommand,2,REDIS_CMD_INLINE},
-    {"lpop",lpopCommand,2,REDIS_CMD_INLINE},
-    {"llen",llenCommand,2,REDIS_CMD_INLINE},
-    {"lindex",lindexCommand,3,REDIS_CMD_INLINE},
-    {"lset",lsetCommand,4,REDIS_CMD_BULK},
-    {"lrange",lrangeCommand,4,REDIS_CMD_INLINE},
-    {"ltrim",ltrimCommand,4,REDIS_CMD_INLINE},
-    {"lrem",lremCommand,4,REDIS_CMD_BULK},
-    {"sadd",saddCommand,3,REDIS_CMD_BULK},
-    {"srem",sremCommand,3,REDIS_CMD_BULK},
-    {"sismember",sismemberCommand,3,REDIS_CMD_BULK},
-    {"scard",scardCommand,2,REDIS_CMD_INLINE},
-    {"sinter",sinterCommand,-2,REDIS_CMD_INLINE},
-    {"sinterstore",sinterstoreCommand,-3,REDIS_CMD_INLINE},
-    {"smembers",sinterCommand,2,REDIS_CMD_INLINE},
-    {"incrby",incrbyCommand,3,REDIS_CMD_INLINE},
-    {"decrby",decrbyCommand,3,REDIS_CMD_INLINE},
-    {"randomkey",randomkeyCommand,1,REDIS_CMD_INLINE},
-    {"select",selectCommand,2,REDIS_CMD_INLINE},
-    {"move",moveCommand,3,REDIS_CMD_INLINE},
-    {"rename",renameCommand,3,REDIS_CMD_INLINE},
-    {"renamenx",renamenxCommand,3,REDIS_CMD_INLINE},
-    {"keys",keysCommand,2,REDIS_CMD_INLINE},
-    {"dbsize",dbsizeCommand,1,REDIS_CMD_INLINE},
-    {"ping",pingCommand,1,REDIS_CMD_INLINE},
-    {"echo",echoCommand,2,REDIS_CMD_BULK},
-    {"save",saveCommand,1,REDIS_CMD_INLINE},
-    {"bgsave",bgsaveCommand,1,REDIS_CMD_INLINE},
-    {"shutdown",shutdownCommand,1,REDIS_CMD_INLINE},
-    {"lastsave",lastsaveCommand,1,REDIS_CMD_INLINE},
-    {"type",typeCommand,2,REDIS_CMD_INLINE},
-    {"sync",syncCommand,1,REDIS_CMD_INLINE},
-    {"flushdb",flushdbCommand,1,REDIS_CMD_INLINE},
-    {"flushall",flushallCommand,1,REDIS_CMD_INLINE},
-    {"sort",sortCommand,-2,REDIS_CMD_INLINE},
-    {"info",infoCommand,1,REDIS_CMD_INLINE},
-    {NULL,NULL,0,0}
+    {"get",getCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY|REDIS_CMD_FAST,1,1,1},
+    {"set",setCommand,3,REDIS_CMD_BULK|REDIS_CMD_WRITE|REDIS_CMD_DENYOOM|REDIS_CMD_FAST,1,1,1},
+    {"setnx",setnxCommand,3,REDIS_CMD_BULK|REDIS_CMD_WRITE|REDIS_CMD_DENYOOM|REDIS_CMD_FAST,1,1,1},
+    {"del",delCommand,2,REDIS_CMD_INLINE|REDIS_CMD_WRITE|REDIS_CMD_FAST,1,1,1},
+    {"exists",existsCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY|REDIS_CMD_FAST,1,1,1},
+    {"incr",incrCommand,2,REDIS_CMD_INLINE|REDIS_CMD_WRITE|REDIS_CMD_DENYOOM|REDIS_CMD_FAST,1,1,1},
+    {"decr",decrCommand,2,REDIS_CMD_INLINE|REDIS_CMD_WRITE|REDIS_CMD_DENYOOM|REDIS_CMD_FAST,1,1,1},
+    {"rpush",rpushCommand,3,REDIS_CMD_BULK|REDIS_CMD_WRITE|REDIS_CMD_DENYOOM|REDIS_CMD_FAST,1,1,1},
+    {"lpush",lpushCommand,3,REDIS_CMD_BULK|REDIS_CMD_WRITE|REDIS_CMD_DENYOOM|REDIS_CMD_FAST,1,1,1},
+    {"rpop",rpopCommand,2,REDIS_CMD_INLINE|REDIS_CMD_WRITE|REDIS_CMD_FAST,1,1,1},
+    {"lpop",lpopCommand,2,REDIS_CMD_INLINE|REDIS_CMD_WRITE|REDIS_CMD_FAST,1,1,1},
+    {"llen",llenCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY|REDIS_CMD_FAST,1,1,1},
+    {"lindex",lindexCommand,3,REDIS_CMD_INLINE|REDIS_CMD_READONLY,1,1,1},
+    {"lset",lsetCommand,4,REDIS_CMD_BULK|REDIS_CMD_WRITE|REDIS_CMD_DENYOOM,1,1,1},
+    {"lrange",lrangeCommand,4,REDIS_CMD_INLINE|REDIS_CMD_READONLY,1,1,1},
+    {"ltrim",ltrimCommand,4,REDIS_CMD_INLINE|REDIS_CMD_WRITE,1,1,1},
+    {"lrem",lremCommand,4,REDIS_CMD_BULK|REDIS_CMD_WRITE,1,1,1},
+    {"sadd",saddCommand,3,REDIS_CMD_BULK|REDIS_CMD_WRITE|REDIS_CMD_DENYOOM|REDIS_CMD_FAST,1,1,1},
+    {"srem",sremCommand,3,REDIS_CMD_BULK|REDIS_CMD_WRITE|REDIS_CMD_FAST,1,1,1},
+    {"sismember",sismemberCommand,3,REDIS_CMD_BULK|REDIS_CMD_READONLY|REDIS_CMD_FAST,1,1,1},
+    {"scard",scardCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY|REDIS_CMD_FAST,1,1,1},
+    {"sinter",sinterCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_READONLY|REDIS_CMD_DENYOOM,1,-1,1},
+    {"sinterstore",sinterstoreCommand,-3,REDIS_CMD_INLINE|REDIS_CMD_WRITE|REDIS_CMD_DENYOOM,1,-1,1},
+    {"smembers",sinterCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY,1,1,1},
+    {"incrby",incrbyCommand,3,REDIS_CMD_INLINE|REDIS_CMD_WRITE|REDIS_CMD_DENYOOM|REDIS_CMD_FAST,1,1,1},
+    {"decrby",decrbyCommand,3,REDIS_CMD_INLINE|REDIS_CMD_WRITE|REDIS_CMD_DENYOOM|REDIS_CMD_FAST,1,1,1},
+    {"randomkey",randomkeyCommand,1,REDIS_CMD_INLINE|REDIS_CMD_KEYSPACE|REDIS_CMD_SCATTER|REDIS_CMD_READONLY|REDIS_CMD_FAST,0,0,0},
+    {"select",selectCommand,2,REDIS_CMD_INLINE|REDIS_CMD_FAST,0,0,0},
+    {"move",moveCommand,3,REDIS_CMD_INLINE|REDIS_CMD_WRITE|REDIS_CMD_FAST,1,1,1},
+    {"rename",renameCommand,3,REDIS_CMD_INLINE|REDIS_CMD_WRITE,1,2,1},
+    {"renamenx",renamenxCommand,3,REDIS_CMD_INLINE|REDIS_CMD_WRITE,1,2,1},
+    {"keys",keysCommand,2,REDIS_CMD_INLINE|REDIS_CMD_KEYSPACE|REDIS_CMD_SCATTER|REDIS_CMD_READONLY,0,0,0},
+    {"dbsize",dbsizeCommand,1,REDIS_CMD_INLINE|REDIS_CMD_KEYSPACE|REDIS_CMD_SCATTER|REDIS_CMD_READONLY|REDIS_CMD_FAST,0,0,0},
+    {"ping",pingCommand,1,REDIS_CMD_INLINE|REDIS_CMD_FAST,0,0,0},
+    {"echo",echoCommand,2,REDIS_CMD_BULK|REDIS_CMD_FAST,0,0,0},
+    {"save",saveCommand,1,REDIS_CMD_INLINE|REDIS_CMD_KEYSPACE,0,0,0},
+    {"bgsave",bgsaveCommand,1,REDIS_CMD_INLINE|REDIS_CMD_KEYSPACE,0,0,0},
+    {"shutdown",shutdownCommand,1,REDIS_CMD_INLINE,0,0,0},
+    {"lastsave",lastsaveCommand,1,REDIS_CMD_INLINE|REDIS_CMD_FAST,0,0,0},
+    {"bgrewriteaof",bgrewriteaofCommand,1,REDIS_CMD_INLINE|REDIS_CMD_KEYSPACE|REDIS_CMD_NOSHARD,0,0,0},
+    {"type",typeCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY|REDIS_CMD_FAST,1,1,1},
+    {"sync",syncCommand,1,REDIS_CMD_INLINE|REDIS_CMD_KEYSPACE|REDIS_CMD_NOSHARD,0,0,0},
+    {"psync",syncCommand,3,REDIS_CMD_INLINE|REDIS_CMD_KEYSPACE|REDIS_CMD_NOSHARD,0,0,0},
+    {"flushdb",flushdbCommand,1,REDIS_CMD_INLINE|REDIS_CMD_KEYSPACE|REDIS_CMD_SCATTER|REDIS_CMD_WRITE,0,0,0},
+    {"flushall",flushallCommand,1,REDIS_CMD_INLINE|REDIS_CMD_KEYSPACE|REDIS_CMD_WRITE,0,0,0},
+    {"sort",sortCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_READONLY|REDIS_CMD_DENYOOM,1,1,1},
+    {"info",infoCommand,-1,REDIS_CMD_INLINE,0,0,0},
+    {"config",configCommand,-2,REDIS_CMD_INLINE,0,0,0},
+    {"slowlog",slowlogCommand,-2,REDIS_CMD_INLINE,0,0,0},
+    {"latency",latencyCommand,-2,REDIS_CMD_INLINE,0,0,0},
+    {"memory",memoryCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_READONLY,2,2,1},
+    {"debug",debugCommand,-3,REDIS_CMD_INLINE,2,2,1},
+    {"hotkeys",hotkeysCommand,-2,REDIS_CMD_INLINE,0,0,0},
+    {"bigkeys",bigkeysCommand,2,REDIS_CMD_INLINE|REDIS_CMD_KEYSPACE|REDIS_CMD_NOSHARD,0,0,0},
+    {NULL,NULL,0,0,0,0,0}
 };
 
 
@@ -233,8 +698,11 @@ static void ResetServerSaveParams() {
     server.saveparamslen = 0;
 }
 
-static void appendServerSaveParams(time_t seconds, int change) {
-
+static void appendServerSaveParams(time_t seconds, int changes) {
+    server.saveparams = zrealloc(server.saveparams, sizeof(struct saveparam)*(server.saveparamslen+1));
+    server.saveparams[server.saveparamslen].seconds = seconds;
+    server.saveparams[server.saveparamslen].changes = changes;
+    server.saveparamslen++;
 }
 
 static void initServerConfig() {
@@ -243,13 +711,42 @@ static void initServerConfig() {
     server.maxidletime = REDIS_MAXIDLETIME;
     server.dbnum = REDIS_DEFAULT_DBNUM;
     server.daemonize = 0; 
-    // server.bgsaveinprogress;
-    // server.saveparam *saveparams;
-    // server.saveparamslen;
+    server.bgsaveinprogress = 0;
+    server.bgsavechildpid = -1;
+    server.saveparams = NULL;
     // stdout
     server.logfile = NULL;
     server.bindaddr = NULL;
+    server.bindaddr6 = NULL;
+    server.ipfd6 = -1;
+    server.unixsocket = NULL;
+    server.unixsocketperm = 0;
+    server.sofd = -1;
+    server.tcp_backlog = REDIS_TCP_BACKLOG;
+    server.reuseport = 0;
+    server.ae_backend = AE_BACKEND_SELECT;
     server.dbfilename = "dump.rdb";
+    server.rdbcompression = 1;
+    server.loading_decode_thread = 0;
+    server.loading = 0;
+    server.loading_threaded = 0;
+    server.appendonly = 0;
+    server.appendfsync = REDIS_AOF_FSYNC_EVERYSEC;
+    server.appendfilename = "appendonly.aof";
+    server.appendfd = -1;
+    server.appendseldb = -1;
+    server.aof_current_size = 0;
+    server.aof_fsynced_size = 0;
+    server.aof_last_fsync = time(NULL);
+    server.aof_fsync_in_progress = 0;
+    server.aof_fsync_errno = 0;
+    server.aof_fsync_pending_size = -1;
+    server.aofrewritechildpid = -1;
+    server.aof_rewrite_scheduled = 0;
+    server.aof_rewrite_base_size = 0;
+    server.aof_rewrite_perc = 100;
+    server.aof_rewrite_min_size = 64*1024*1024;
+    server.aof_use_rdb_preamble = 1;
 
     // save para
     ResetServerSaveParams();
@@ -266,11 +763,51 @@ static void initServerConfig() {
     server.masterport = 6379;
     server.master = NULL;
     server.replstate = REDIS_REPL_NONE;
+    server.master_repl_offset = 0;
+    server.repl_can_psync = 0;
+    server.repl_master_dictid = 0;
+    server.slaveseldb = -1;
+    server.repl_backlog = NULL;
+    server.repl_backlog_size = REDIS_REPL_BACKLOG_SIZE;
+    server.stat_sync_full = 0;
+    server.stat_sync_partial_ok = 0;
+    server.zerocopy_threshold = 0;
+    server.slowlog_log_slower_than = REDIS_SLOWLOG_LOG_SLOWER_THAN;
+    server.slowlog_max_len = REDIS_SLOWLOG_MAX_LEN;
+    server.latency_monitor_threshold = 0;
+    server.hotkeys_tracking = 0;
+    server.active_defrag_enabled = 0;
+    server.active_defrag_ignore_bytes = 100*1024*1024;
+    server.active_defrag_threshold_lower = 10;
+    server.active_defrag_threshold_upper = 100;
+    server.active_defrag_cycle_min = 1;
+    server.active_defrag_cycle_max = 25;
+    server.client_obuf_limits[REDIS_CLIENT_LIMIT_CLASS_NORMAL] = (clientBufferLimitsConfig){0, 0, 0};
+    server.client_obuf_limits[REDIS_CLIENT_LIMIT_CLASS_SLAVE] = (clientBufferLimitsConfig){256*1024*1024, 64*1024*1024, 60};
+    server.stat_client_outbuf_limit_disconnections = 0;
+    server.stat_zerocopy_sends = 0;
+    server.stat_zerocopy_copied = 0;
+    server.repl_diskless_sync = 0;
+    server.repl_diskless_sync_delay = REDIS_REPL_DISKLESS_SYNC_DELAY;
+    server.repl_diskless_load = REDIS_REPL_DISKLESS_LOAD_DISABLED;
+    server.rdb_child_type = REDIS_RDB_CHILD_TYPE_DISK;
+    server.rdb_pipe_read_result = -1;
+
+    // threaded I/O
+    server.io_threads_num = 1;
+    server.io_threads_do_reads = 0;
+
+    server.shards_num = 1;
+    populateCommandTable();
 }
 
 // todo: not finished
 static void loadServerConfig(char *filename) {
-    char *fp  = open(filename, "r");
+    FILE *fp = fopen(filename, "r");
+    if(!fp){
+        redisLog(REDIS_WARNING, "Fatal error, can't open config file '%s'", filename);
+        exit(1);
+    }
     char buf[REDIS_CONFIGLINE_MAX+1], *err;
     sds line = NULL;
     int linenum = 0;
@@ -300,33 +837,191 @@ static void loadServerConfig(char *filename) {
                 goto loaderr;
             }
         }else if(!strcmp(argv[0], "port") && argc == 2){
-            server.maxidletime = atoi(argv[1]);
+            server.port = atoi(argv[1]);
             if (server.port < 1 || server.port > 65535){
                 err = "Invalid port ";
                 goto loaderr;
             }
         }else if(!strcmp(argv[0], "bind") && argc == 2){
-            server.maxidletime = atoi(argv[1]);
-            if (server.port < 1 || server.port > 65535){
-                err = "Invalid port ";
+            server.bindaddr = zstrdup(argv[1]);
+        }else if(!strcmp(argv[0], "bind6") && argc == 2){
+            server.bindaddr6 = zstrdup(argv[1]);
+        }else if(!strcmp(argv[0], "unixsocket") && argc == 2){
+            server.unixsocket = zstrdup(argv[1]);
+        }else if(!strcmp(argv[0], "unixsocketperm") && argc == 2){
+            errno = 0;
+            server.unixsocketperm = (mode_t)strtol(argv[1], NULL, 8);
+            if(errno || server.unixsocketperm > 0777){
+                err = "Invalid socket file permissions";
                 goto loaderr;
             }
-        }else if(!strcmp(argv[0], "save") && argc == 2){
-            server.maxidletime = atoi(argv[1]);
-            if (server.port < 1 || server.port > 65535){
-                err = "Invalid port ";
+        }else if(!strcmp(argv[0], "tcp-backlog") && argc == 2){
+            server.tcp_backlog = atoi(argv[1]);
+            if (server.tcp_backlog < 1){
+                err = "Invalid backlog value";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "reuseport") && argc == 2){
+            if(!strcasecmp(argv[1], "yes")) server.reuseport = 1;
+            else if(!strcasecmp(argv[1], "no")) server.reuseport = 0;
+            else {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "client-output-buffer-limit") && argc == 5){
+            int class = getClientLimitClassByName(argv[1]);
+
+            if(class == -1 || atoi(argv[4]) < 0){
+                err = "Invalid client class or soft limit seconds";
+                goto loaderr;
+            }
+            server.client_obuf_limits[class].hard_limit_bytes = strtoull(argv[2], NULL, 10);
+            server.client_obuf_limits[class].soft_limit_bytes = strtoull(argv[3], NULL, 10);
+            server.client_obuf_limits[class].soft_limit_seconds = atoi(argv[4]);
+        }else if(!strcmp(argv[0], "slowlog-log-slower-than") && argc == 2){
+            server.slowlog_log_slower_than = strtoll(argv[1], NULL, 10);
+        }else if(!strcmp(argv[0], "slowlog-max-len") && argc == 2){
+            server.slowlog_max_len = atoi(argv[1]);
+            if(server.slowlog_max_len < 1){
+                err = "slowlog-max-len must be 1 or greater";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "latency-monitor-threshold") && argc == 2){
+            server.latency_monitor_threshold = strtoll(argv[1], NULL, 10);
+            if(server.latency_monitor_threshold < 0){
+                err = "latency-monitor-threshold must be 0 or greater";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "hotkeys-tracking") && argc == 2){
+            if(!strcasecmp(argv[1], "yes")) server.hotkeys_tracking = 1;
+            else if(!strcasecmp(argv[1], "no")) server.hotkeys_tracking = 0;
+            else {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "activedefrag") && argc == 2){
+            if(!strcasecmp(argv[1], "yes")) server.active_defrag_enabled = 1;
+            else if(!strcasecmp(argv[1], "no")) server.active_defrag_enabled = 0;
+            else {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "active-defrag-ignore-bytes") && argc == 2){
+            server.active_defrag_ignore_bytes = strtoll(argv[1], NULL, 10);
+        }else if(!strcmp(argv[0], "active-defrag-threshold-lower") && argc == 2){
+            server.active_defrag_threshold_lower = atoi(argv[1]);
+        }else if(!strcmp(argv[0], "active-defrag-threshold-upper") && argc == 2){
+            server.active_defrag_threshold_upper = atoi(argv[1]);
+        }else if(!strcmp(argv[0], "active-defrag-cycle-min") && argc == 2){
+            server.active_defrag_cycle_min = atoi(argv[1]);
+        }else if(!strcmp(argv[0], "active-defrag-cycle-max") && argc == 2){
+            server.active_defrag_cycle_max = atoi(argv[1]);
+        }else if(!strcmp(argv[0], "zerocopy-threshold") && argc == 2){
+            server.zerocopy_threshold = strtoull(argv[1], NULL, 10);
+        }else if(!strcmp(argv[0], "event-loop-backend") && argc == 2){
+            if(!strcasecmp(argv[1], "select")) server.ae_backend = AE_BACKEND_SELECT;
+            else if(!strcasecmp(argv[1], "io_uring")) server.ae_backend = AE_BACKEND_IO_URING;
+            else {
+                err = "argument must be 'select' or 'io_uring'";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "save") && argc == 3){
+            int seconds = atoi(argv[1]);
+            int changes = atoi(argv[2]);
+            if (seconds < 1 || changes < 0){
+                err = "Invalid save parameters";
+                goto loaderr;
+            }
+            appendServerSaveParams(seconds, changes);
+        }else if(!strcmp(argv[0], "dbfilename") && argc == 2){
+            server.dbfilename = zstrdup(argv[1]);
+        }else if(!strcmp(argv[0], "loading-decode-thread") && argc == 2){
+            if(!strcasecmp(argv[1], "yes")) server.loading_decode_thread = 1;
+            else if(!strcasecmp(argv[1], "no")) server.loading_decode_thread = 0;
+            else {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "rdbcompression") && argc == 2){
+            if(!strcasecmp(argv[1], "yes")) server.rdbcompression = 1;
+            else if(!strcasecmp(argv[1], "no")) server.rdbcompression = 0;
+            else {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "appendonly") && argc == 2){
+            if(!strcasecmp(argv[1], "yes")) server.appendonly = 1;
+            else if(!strcasecmp(argv[1], "no")) server.appendonly = 0;
+            else {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "appendfilename") && argc == 2){
+            server.appendfilename = zstrdup(argv[1]);
+        }else if(!strcmp(argv[0], "appendfsync") && argc == 2){
+            if(!strcasecmp(argv[1], "always")) server.appendfsync = REDIS_AOF_FSYNC_ALWAYS;
+            else if(!strcasecmp(argv[1], "everysec")) server.appendfsync = REDIS_AOF_FSYNC_EVERYSEC;
+            else if(!strcasecmp(argv[1], "no")) server.appendfsync = REDIS_AOF_FSYNC_NO;
+            else {
+                err = "argument must be 'always', 'everysec' or 'no'";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "auto-aof-rewrite-percentage") && argc == 2){
+            server.aof_rewrite_perc = atoi(argv[1]);
+            if(server.aof_rewrite_perc < 0) {
+                err = "Invalid negative percentage for AOF auto rewrite";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "aof-use-rdb-preamble") && argc == 2){
+            if(!strcasecmp(argv[1], "yes")) server.aof_use_rdb_preamble = 1;
+            else if(!strcasecmp(argv[1], "no")) server.aof_use_rdb_preamble = 0;
+            else {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "auto-aof-rewrite-min-size") && argc == 2){
+            server.aof_rewrite_min_size = atoll(argv[1]);
+        }else if(!strcmp(argv[0], "slaveof") && argc == 3){
+            server.masterhost = zstrdup(argv[1]);
+            server.masterport = atoi(argv[2]);
+            server.replstate = REDIS_REPL_CONNECT;
+        }else if(!strcmp(argv[0], "repl-backlog-size") && argc == 2){
+            server.repl_backlog_size = atoll(argv[1]);
+            if(server.repl_backlog_size < 1) {
+                err = "repl-backlog-size must be 1 or greater";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "repl-diskless-sync") && argc == 2){
+            if(!strcasecmp(argv[1], "yes")) server.repl_diskless_sync = 1;
+            else if(!strcasecmp(argv[1], "no")) server.repl_diskless_sync = 0;
+            else {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "repl-diskless-sync-delay") && argc == 2){
+            server.repl_diskless_sync_delay = atoi(argv[1]);
+            if(server.repl_diskless_sync_delay < 0) {
+                err = "repl-diskless-sync-delay can't be negative";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "repl-diskless-load") && argc == 2){
+            if(!strcasecmp(argv[1], "disabled")) server.repl_diskless_load = REDIS_REPL_DISKLESS_LOAD_DISABLED;
+            else if(!strcasecmp(argv[1], "swapdb")) server.repl_diskless_load = REDIS_REPL_DISKLESS_LOAD_SWAPDB;
+            else {
+                err = "argument must be 'disabled' or 'swapdb'";
                 goto loaderr;
             }
         }else if(!strcmp(argv[0], "dir") && argc == 2){
-            server.maxidletime = atoi(argv[1]);
-            if (server.port < 1 || server.port > 65535){
-                err = "Invalid port ";
+            if(chdir(argv[1]) == -1){
+                err = "Can't chdir to the configured directory";
                 goto loaderr;
             }
         }else if(!strcmp(argv[0], "loglevel") && argc == 2){
-            server.maxidletime = atoi(argv[1]);
-            if (server.port < 1 || server.port > 65535){
-                err = "Invalid port ";
+            if(!strcasecmp(argv[1], "debug")) server.verbosity = REDIS_DEBUG;
+            else if(!strcasecmp(argv[1], "notice")) server.verbosity = REDIS_NOTICE;
+            else if(!strcasecmp(argv[1], "warning")) server.verbosity = REDIS_WARNING;
+            else {
+                err = "Invalid log level. Must be one of debug, notice, warning";
                 goto loaderr;
             }
         }else if(!strcmp(argv[0], "save") && argc == 2){
@@ -335,8 +1030,32 @@ static void loadServerConfig(char *filename) {
                 err = "Invalid port ";
                 goto loaderr;
             }
+        }else if(!strcmp(argv[0], "io-threads") && argc == 2){
+            server.io_threads_num = atoi(argv[1]);
+            if (server.io_threads_num < 1 || server.io_threads_num > REDIS_IO_THREADS_MAX){
+                err = "Invalid number of I/O threads";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "shards") && argc == 2){
+            server.shards_num = atoi(argv[1]);
+            if (server.shards_num < 1 || server.shards_num > REDIS_SHARDS_MAX){
+                err = "Invalid number of shards";
+                goto loaderr;
+            }
+        }else if(!strcmp(argv[0], "io-threads-do-reads") && argc == 2){
+            if(!strcasecmp(argv[1], "yes")) server.io_threads_do_reads = 1;
+            else if(!strcasecmp(argv[1], "no")) server.io_threads_do_reads = 0;
+            else {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
         }
+        for(int j = 0; j < argc; j++) sdsfree(argv[j]);
+        zfree(argv);
+        sdsfree(line);
     }
+    fclose(fp);
+    return;
 
     loaderr:
     fprintf(stderr, "\n*** FATAL CONFIG FILE ERROR ***\n");
@@ -348,171 +1067,5216 @@ static void loadServerConfig(char *filename) {
 
 // hash type : todo
 
-static void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask){
-    redisClient *c = (redisClient*)privdata;
-    char buf[REDIS_QUERYBUF_LEN];
-    int nread;
-    REDIS_NOTUSED(el);
-    REDIS_NOTUSED(mask);
+// ============================ utils =====================
 
-    nread = read(fd, buf, REDIS_QUERYBUF_LEN);
-    if(nread == -1){
-        if(errno == EAGAIN){
-            nread = 0;
-        }else {
-            redisLog(REDIS_DEBUG, "Reading from client: %s", strerr(errno));
-            freeClient(c);
-            return;
-        }
-    }else if (nread == 0){
-            redisLog(REDIS_DEBUG, "Client closed connection");
-            freeClient(c);
-            return;
+static void getRandomHexChars(char *p, int len) {
+    const char *charset = "0123456789abcdef";
+    FILE *fp = fopen("/dev/urandom", "r");
+
+    if(fp == NULL || fread(p, len, 1, fp) == 0) {
+        // weak, but only used to tell streams apart
+        srand(time(NULL)^getpid());
+        for(int j = 0; j < len; j++) p[j] = rand();
     }
+    if(fp) fclose(fp);
+    for(int j = 0; j < len; j++) p[j] = charset[p[j] & 0x0F];
+}
+
+static void redisLog(int level, const char *fmt, ...) {
+    va_list ap;
+    FILE *fp;
+    char *c = ".-*";
+    char buf[64];
+    time_t now;
+    struct tm tm;
+
+    if(level < server.verbosity) return;
+    fp = (server.logfile == NULL) ? stdout : fopen(server.logfile, "a");
+    if(!fp) return;
+
+    now = time(NULL);
+    strftime(buf, sizeof(buf), "%d %b %H:%M:%S", localtime_r(&now, &tm));
+    va_start(ap, fmt);
+    fprintf(fp, "%s %c ", buf, c[level]);
+    vfprintf(fp, fmt, ap);
+    fprintf(fp, "\n");
+    fflush(fp);
+    va_end(ap);
+
+    if(server.logfile) fclose(fp);
+}
+
+// ============================ dict types =====================
+// keys and set members are string objects, compared by content
+
+static unsigned int dictObjHash(const void *key) {
+    const robj *o = key;
+    return dictGenHashFunction((unsigned char*)o->ptr, sdslen((sds)o->ptr));
+}
+
+static int dictObjKeyCompare(void *privdata, const void *key1, const void *key2) {
+    const robj *o1 = key1, *o2 = key2;
+    size_t l1 = sdslen((sds)o1->ptr), l2 = sdslen((sds)o2->ptr);
+    REDIS_NOTUSED(privdata);
+
+    if(l1 != l2) return 0;
+    return memcmp(o1->ptr, o2->ptr, l1) == 0;
+}
+
+static void dictRedisObjectDestructor(void *privdata, void *val) {
+    REDIS_NOTUSED(privdata);
+    if(val) decrRefCount(val);
+}
+
+static dictType setDictType = {
+    dictObjHash,                // hash function
+    NULL,                       // key dup
+    NULL,                       // val dup
+    dictObjKeyCompare,          // key compare
+    dictRedisObjectDestructor,  // key destructor
+    NULL                        // val destructor
+};
+
+// command names are C strings, matched ignoring case
+static unsigned int dictCStrCaseHash(const void *key) {
+    return dictGenCaseHashFunction((const unsigned char*)key, strlen((const char*)key));
+}
+
+static int dictCStrKeyCaseCompare(void *privdata, const void *key1, const void *key2) {
+    REDIS_NOTUSED(privdata);
+    return strcasecmp(key1, key2) == 0;
+}
+
+static dictType commandTableDictType = {
+    dictCStrCaseHash,           // hash function
+    NULL,                       // key dup
+    NULL,                       // val dup
+    dictCStrKeyCaseCompare,     // key compare
+    NULL,                       // key destructor
+    NULL                        // val destructor
+};
+
+// event name literals -> latencyTimeSeries
+static void dictZfreeDestructor(void *privdata, void *val) {
+    REDIS_NOTUSED(privdata);
+    zfree(val);
+}
+
+static dictType latencyEventsDictType = {
+    dictCStrCaseHash,           // hash function
+    NULL,                       // key dup
+    NULL,                       // val dup
+    dictCStrKeyCaseCompare,     // key compare
+    NULL,                       // key destructor
+    dictZfreeDestructor         // val destructor
+};
+
+static dictType hashDictType = {
+    dictObjHash,                // hash function
+    NULL,                       // key dup
+    NULL,                       // val dup
+    dictObjKeyCompare,          // key compare
+    dictRedisObjectDestructor,  // key destructor
+    dictRedisObjectDestructor   // val destructor
+};
+
+// ============================ objects =====================
 
-    if(nread){
-        c->querybuf = sdscatlen(c->querybuf, buf, nread);
-        c->lastinteraction = time(NULL);
+static robj *createObject(int type, void *ptr) {
+    robj *o;
+
+    // the free list is not thread safe, skip it while other threads run
+    if(objFreeListUsable() && listLength(server.objfreelist)) {
+        listNode *head = listFirst(server.objfreelist);
+        o = listNodeValue(head);
+        listDelNode(server.objfreelist, head);
     } else {
-        return ;
+        o = zmalloc(sizeof(*o));
     }
+    o->type = type;
+    o->ptr = ptr;
+    o->refcount = 1;
+    return o;
+}
 
-again:
-    if(c->bulklen == -1){
-        char *p = strchr(c->querybuf, '\n');
-        size_t querylen;
-        if(p) {
-            sds query, *argv;
-            int argc;
+static robj *createStringObject(char *ptr, size_t len) {
+    return createObject(REDIS_STRING, sdsnewlen(ptr, len));
+}
 
-            query = c->querybuf;
-            c->querybuf = sdsempty();
-            querylen = 1 + (p-query);
-            if(sdslen(query) > querylen){
-                c->querybuf = sdscatlen(c->querybuf, query+querylen, sdslen(query) - querylen);
-            }
+static robj *createListObject(void) {
+    list *l = listCreate();
 
-            *p = '\0';
-            if(*(p-1) == '\r') *(p-1) = '\0';
-            sdsupdatelen(query);
-            if(sdslen(query) == 0){
-                sdsfree(query);
-                return;
-            }
+    listSetFreeMethod(l, decrRefCount);
+    return createObject(REDIS_LIST, l);
+}
 
-            argv = sdssplitlen(query, sdslen(query), " ", 1, &argc);
-            sdsfree(query);
-            for(int i = 0; i < argc && i < REDIS_MAX_ARGS; i++) {
-                if(sdslen(argv[i])){
-                    c->argv[c->argc] = createObject(REDIS_STRING, argv[i]);
-                    c->argc++;
-                }else
-                    sdsfree(argv[i]);
-            }
-            zfree(argv);
-            if(processCommand(c) && sdslen(c->querybuf)) goto again;
-            return;
-        } else if (sdslen(c->querybuf) >= 1024){
-            redisLog(REDIS_DEBUG, "Client protocol error");
-            freeClient(c);
-            return;
-        }
-    }else{
-        // bulk read
-        int qbl = sdslen(c->querybuf);
-        if(c->bulklen <= qbl){
-            c->argv[c->argc] = createStringObject(c->querybuf, c->bulklen-2);
-            c->argc++;
-            c->querybuf = sdsrange(c->querybuf, c->bulklen, -1);
-            processCommand(c);
-            return;
-        }
+static robj *createSetObject(void) {
+    return createObject(REDIS_SET, dictCreate(&setDictType, NULL));
+}
+
+static void freeStringObject(robj *o) {
+    sdsfree(o->ptr);
+}
+
+static void freeListObject(robj *o) {
+    listRelease((list*) o->ptr);
+}
+
+static void freeSetObject(robj *o) {
+    dictRelease((dict*) o->ptr);
+}
+
+// reply objects are shared between clients that I/O threads write
+// concurrently, and shards hand objects to each other, so refcounts are
+// atomic while other threads are around
+static void incrRefCount(robj *o) {
+    if(refcountAtomic())
+        __atomic_add_fetch(&o->refcount, 1, __ATOMIC_RELAXED);
+    else
+        o->refcount++;
+}
+
+static void decrRefCount(void *obj) {
+    robj *o = obj;
+    int refcount;
+
+    if(refcountAtomic())
+        refcount = __atomic_sub_fetch(&o->refcount, 1, __ATOMIC_ACQ_REL);
+    else
+        refcount = --o->refcount;
+    if(refcount != 0) return;
+
+    switch(o->type) {
+    case REDIS_STRING: freeStringObject(o); break;
+    case REDIS_LIST: freeListObject(o); break;
+    case REDIS_SET: freeSetObject(o); break;
     }
+    if(objFreeListUsable())
+        listNodeAddTail(server.objfreelist, o);
+    else
+        zfree(o);
 }
 
-static void acceptHandler(aeEventLoop *el, int fd, void *privData, int mask){
-    char buf[100];
-    printf("file event %d \n", fd);
-    read(fd, buf, 100);
-    printf("file content %s \n", buf);
+// ============================ client =====================
+
+static void createFileEvent(aeEventLoop *el, int fd, int mask, aeFileEventProc *proc, void *data) {
+    aeFileEvent *fe = zmalloc(sizeof(*fe));
+
+    fe->fd = fd;
+    fe->mask = mask;
+    fe->fileProc = proc;
+    fe->finalizerProc = NULL;
+    fe->clientData = data;
+    aeCreateFileEvent(el, fe);
 }
 
-static int selectDb(redisClient *c, int id){
-    c->dict = &server.dict[id];
-    c->dictid = id;
-    return REDIS_OK;
+// io_uring does the socket I/O of the clients itself, see AE_RECV and
+// sendClientReplies(). I/O threads and zero copy need plain syscalls.
+static int clientRingIO(void) {
+    return currentEl()->apidata && server.io_threads_num == 1 && !server.zerocopy_threshold;
 }
 
-static redisClient *createClient(int fd){
-    redisClient *c = zmalloc(sizeof(*c));
+static void createClientFileEvent(redisClient *c, int mask, aeFileEventProc *proc) {
+    createFileEvent(currentEl(), c->fd, mask, proc, c);
+}
 
-    anetNonBlock(NULL, fd);
-    anetTcpNoDelay(NULL, fd);
+static void unlinkClientFromList(list *l, redisClient *c) {
+    listNode *ln = listSearchKey(l, c);
+    if(ln) listDelNode(l, ln);
+}
 
-    selectDb(c, 0);
-    c->fd = fd;
-    c->querybuf = sdsempty();
-    robj *argv[REDIS_MAX_ARGS];
-    c->argc = 0 ;
+static void freeClientArgv(redisClient *c) {
+    for(int j = 0; j < c->argc; j++)
+        decrRefCount(c->argv[j]);
+    c->argc = 0;
+}
+
+static void freeClient(redisClient *c) {
+    if(c->flags & REDIS_SHARD_WAIT) {
+        // another shard still runs a command for us, free on its reply
+        aeDeleteFileEvent(currentEl(), c->fd, AE_READABLE);
+        c->flags |= REDIS_CLOSE_ASAP;
+        return;
+    }
+    aeDeleteFileEvent(currentEl(), c->fd, AE_READABLE);
+    aeDeleteFileEvent(currentEl(), c->fd, AE_WRITABLE);
+    sdsfree(c->querybuf);
+    listRelease(c->reply);
+    freeClientArgv(c);
+    // the kernel may still be sending from pinned replies after a close
+    if(c->zcpinned) reapZerocopyCompletions(c->fd, c->zcpinned);
+    // a queued send still names the fd: submit it first, and have it fail
+    // if it waits for room. It keeps its replies pinned.
+    if(c->sending) {
+        c->sending->c = NULL;
+        aeSubmit(currentEl());
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    if(c->zcpinned && listLength(c->zcpinned))
+        parkZerocopyClient(c);
+    else
+        close(c->fd);
+
+    unlinkClientFromList(currentClients(), c);
+    if(c->flags & REDIS_PENDING_READ)
+        unlinkClientFromList(server.clients_pending_read, c);
+    if(c->flags & REDIS_PENDING_WRITE)
+        unlinkClientFromList(currentPendingWrites(), c);
+    if(c->flags & REDIS_SLAVE) {
+        unlinkClientFromList(server.slaves, c);
+        if(c->repldbfd != -1) close(c->repldbfd);
+        if(c->replpreamble) sdsfree(c->replpreamble);
+    }
+    // parking took the list if anything was still in flight
+    if(c->zcpinned) listRelease(c->zcpinned);
+    if(c->flags & REDIS_MASTER) {
+        // the master won't repeat the SELECT if the stream continues
+        server.repl_master_dictid = c->dictid;
+        server.master = NULL;
+        server.replstate = REDIS_REPL_CONNECT;
+    }
+    zfree(c);
+}
+
+static void resetClient(redisClient *c) {
+    freeClientArgv(c);
     c->bulklen = -1;
-    c->reply = listCreate();
-    listSetFreeMethod(c->reply, decrRefCount);
+}
 
-    c->sentlen = 0;
-    c->lastinteraction = time(NULL);
-    c->flags = 0;
+// ---- output buffer limits ----
 
-    aeFileEvent fe;
-    fe.fd = c->fd;
-    fe.mask = AE_READABLE;
-    fe.fileProc = readQueryFromClient;
-    fe.finalizerProc = NULL;
-    fe.clientData = c;
-    aeCreateFileEvent(server.el, &fe);
-    listAddNodeTail(server.clients, c);
-    return c;
+static int getClientLimitClassByName(char *name) {
+    if(!strcasecmp(name, "normal")) return REDIS_CLIENT_LIMIT_CLASS_NORMAL;
+    if(!strcasecmp(name, "slave")) return REDIS_CLIENT_LIMIT_CLASS_SLAVE;
+    return -1;
 }
 
-static void initServer() {
-    signal(SIGHUP, SIG_IGN);
-    signal(SIGPIPE, SIG_IGN);
+static char *getClientLimitClassName(int class) {
+    return class == REDIS_CLIENT_LIMIT_CLASS_SLAVE ? "slave" : "normal";
+}
 
-    // int port;
-    server.fd = anetTcpServer(server.neterr, server.port, server.bindaddr);
-    server.dict = zmalloc(sizeof(dict*) * server.dbnum);
-    for(int i=0; i<server.dbnum; i++){
-        // server.dict[i] = dictCreate(&hashDictType, NULL);
+static int getClientLimitClass(redisClient *c) {
+    return (c->flags & REDIS_SLAVE) ? REDIS_CLIENT_LIMIT_CLASS_SLAVE : REDIS_CLIENT_LIMIT_CLASS_NORMAL;
+}
+
+// Returns 1 when the client went over the hard limit, or has been over
+// the soft limit for too long.
+static int checkClientOutputBufferLimits(redisClient *c) {
+    clientBufferLimitsConfig *l = &server.client_obuf_limits[getClientLimitClass(c)];
+    time_t now;
+
+    if(l->hard_limit_bytes && c->reply_bytes >= l->hard_limit_bytes) return 1;
+    if(!l->soft_limit_bytes || c->reply_bytes < l->soft_limit_bytes) {
+        c->obuf_soft_limit_reached_time = 0;
+        return 0;
     }
-    server.clients = listCreate();
-    server.slaves = listCreate();
-    server.el = aeCreateEventLoop();
+    now = time(NULL);
+    if(c->obuf_soft_limit_reached_time == 0) {
+        c->obuf_soft_limit_reached_time = now;
+        return 0;
+    }
+    return now-c->obuf_soft_limit_reached_time >= l->soft_limit_seconds;
+}
 
-    // stat
-    // char neterr[ANET_ERR_LEN];
-    server.dirty  = 0;
-    server.cronloops = 0;
-    server.objfreelist = listCreate();
-    server.lastsave = time(NULL);
-    server.usedmemory = 0;
+// Called while a command may still use the client, so it is only flagged
+// and queued for write, where it gets freed.
+static void closeClientOnOutputBufferLimitReached(redisClient *c) {
+    if(c->flags & REDIS_CLOSE_ASAP) return;
+    if(!checkClientOutputBufferLimits(c)) return;
+    redisLog(REDIS_WARNING, "Client %s scheduled to be closed for overcoming of output buffer limits (%zu bytes pending)",
+        getClientLimitClassName(getClientLimitClass(c)), c->reply_bytes);
+    server.stat_client_outbuf_limit_disconnections++;
+    c->flags |= REDIS_CLOSE_ASAP;
+    if(!(c->flags & REDIS_PENDING_WRITE)) {
+        c->flags |= REDIS_PENDING_WRITE;
+        listNodeAddTail(currentPendingWrites(), c);
+    }
+}
 
-    server.stat_starttime = time(NULL);
-    server.stat_numcommands = 0 ;
-    server.stat_numconnections = 0 ;
+// Replies are not written here: the client is queued and flushed by
+// beforeSleep, so most replies go out without a writable handler and the
+// writes can be handed to the I/O threads.
+static void addReply(redisClient *c, robj *obj) {
+    // the master does not read what we answer to its stream
+    if(c->flags & REDIS_MASTER) return;
+    // a slave's output is held back until its dump has been sent
+    if(!(c->flags & (REDIS_PENDING_WRITE|REDIS_SHARD_PROXY|REDIS_AOF_CLIENT)) &&
+       listLength(c->reply) == 0 &&
+       (!(c->flags & REDIS_SLAVE) || c->replstate == REDIS_REPL_ONLINE)) {
+        c->flags |= REDIS_PENDING_WRITE;
+        listNodeAddTail(currentPendingWrites(), c);
+    }
+    listNodeAddTail(c->reply, obj);
+    incrRefCount(obj);
+    c->reply_bytes += sdslen(obj->ptr);
+    if(!(c->flags & (REDIS_SHARD_PROXY|REDIS_AOF_CLIENT)))
+        closeClientOnOutputBufferLimitReached(c);
 }
 
-int main(int argc, char **argv) {
-    initServerConfig();
-    // loadServerConfig();
-    initServer();
-    aeFileEvent fe;
-    fe.fd = server.fd;
-    fe.mask = AE_READABLE;
-    fe.fileProc = acceptHandler;
-    fe.finalizerProc = NULL;
-    fe.clientData = NULL;
-    aeCreateFileEvent(server.el, &fe);
-    printf("hello4");
-    fflush(stdout);
+static void addReplySds(redisClient *c, sds s) {
+    robj *o = createObject(REDIS_STRING, s);
+    addReply(c, o);
+    decrRefCount(o);
+}
+
+// ---- zero copy replies ----
+// Large replies are sent with MSG_ZEROCOPY: the kernel reads the object
+// memory while transmitting, so the object is pinned with a reference
+// until the completion for that send shows up on the socket error queue.
+// A pending completion makes the fd readable, so readQueryFromClient()
+// reaps them.
+
+static void freeZerocopyPinned(void *ptr) {
+    zcPinned *zp = ptr;
+
+    decrRefCount(zp->obj);
+    zfree(zp);
+}
+
+# if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+static int clientCanZerocopy(redisClient *c) {
+    int one = 1;
+
+    if(c->flags & REDIS_ZEROCOPY) return 1;
+    if(c->flags & REDIS_NO_ZEROCOPY) return 0;
+    // unix sockets and old kernels refuse it
+    if(setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+        c->flags |= REDIS_NO_ZEROCOPY;
+        return 0;
+    }
+    c->flags |= REDIS_ZEROCOPY;
+    return 1;
+}
+
+static int writeZerocopy(redisClient *c, robj *o, char *buf, size_t len) {
+    zcPinned *zp;
+    int nwritten = send(c->fd, buf, len, MSG_ZEROCOPY);
+
+    // out of optmem for the notifications, copy this one
+    if(nwritten == -1 && errno == ENOBUFS) return write(c->fd, buf, len);
+    if(nwritten <= 0) return nwritten;
+    __atomic_fetch_add(&server.stat_zerocopy_sends, 1, __ATOMIC_RELAXED);
+    if(c->zcpinned == NULL) {
+        c->zcpinned = listCreate();
+        listSetFreeMethod(c->zcpinned, freeZerocopyPinned);
+    }
+    // one reference per object, for its last send
+    if(listLength(c->zcpinned) &&
+       (zp = listNodeValue(listLast(c->zcpinned)))->obj == o) {
+        zp->seq = c->zcseq++;
+        return nwritten;
+    }
+    zp = zmalloc(sizeof(*zp));
+    zp->obj = o;
+    zp->seq = c->zcseq++;
+    incrRefCount(o);
+    listNodeAddTail(c->zcpinned, zp);
+    return nwritten;
+}
+
+// Completions come as ranges of send ids, in order for TCP.
+static void reapZerocopyCompletions(int fd, list *pinned) {
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+
+    while(listLength(pinned)) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) return;
+        for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr = (void*)CMSG_DATA(cm);
+            listNode *ln;
+
+            if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                 (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) ||
+               serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                __atomic_add_fetch(&server.stat_zerocopy_copied, serr->ee_data-serr->ee_info+1, __ATOMIC_RELAXED);
+            while((ln = listFirst(pinned)) != NULL &&
+                  (int)(((zcPinned*)listNodeValue(ln))->seq-serr->ee_data) <= 0)
+                listDelNode(pinned, ln);
+        }
+    }
+}
+# else
+static int clientCanZerocopy(redisClient *c) {
+    REDIS_NOTUSED(c);
+    return 0;
+}
+
+static int writeZerocopy(redisClient *c, robj *o, char *buf, size_t len) {
+    REDIS_NOTUSED(o);
+    return write(c->fd, buf, len);
+}
+
+static void reapZerocopyCompletions(int fd, list *pinned) {
+    REDIS_NOTUSED(fd);
+    REDIS_NOTUSED(pinned);
+}
+# endif
+
+// A freed client's socket is only shut down while the kernel still sends
+// from its pinned replies. The loop that owns it closes it and drops the
+// references once the last completion is reaped, or resets it when the
+// peer stopped reading for REDIS_ZEROCOPY_LINGER seconds.
+static void parkZerocopyClient(redisClient *c) {
+    zcClosing *zc = zmalloc(sizeof(*zc));
+
+    shutdown(c->fd, SHUT_RDWR);
+    zc->fd = c->fd;
+    zc->pinned = c->zcpinned;
+    zc->since = time(NULL);
+    c->zcpinned = NULL;
+    listNodeAddTail(currentZcClosing(), zc);
+}
+
+// called from beforeSleep, so at least once a second
+static void closeParkedZerocopyClients(void) {
+    list *l = currentZcClosing();
+    listNode *ln, *next;
+    time_t now;
+
+    if(listLength(l) == 0) return;
+    now = time(NULL);
+    for(ln = listFirst(l); ln; ln = next) {
+        zcClosing *zc = listNodeValue(ln);
+
+        next = listNextNode(ln);
+        reapZerocopyCompletions(zc->fd, zc->pinned);
+        if(listLength(zc->pinned)) {
+            struct linger lg = {1, 0};
+
+            if(now - zc->since < REDIS_ZEROCOPY_LINGER) continue;
+            // a reset drops the send queue and its page references
+            setsockopt(zc->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        }
+        close(zc->fd);
+        listRelease(zc->pinned);
+        zfree(zc);
+        listDelNode(l, ln);
+    }
+}
+
+// Write as much of the reply list as the socket takes. Called from I/O
+// threads too, so on error the client is only flagged and the caller
+// (always on the main thread) frees it.
+static int writeToClient(redisClient *c) {
+    int nwritten = 0, totwritten = 0, objlen;
+    robj *o;
+
+    if(c->flags & REDIS_CLOSE_ASAP) return REDIS_ERR;
+    while(listLength(c->reply)) {
+        o = listNodeValue(listFirst(c->reply));
+        objlen = sdslen(o->ptr);
+
+        if(objlen == 0) {
+            listDelNode(c->reply, listFirst(c->reply));
+            continue;
+        }
+        if(server.zerocopy_threshold && (size_t)(objlen-c->sentlen) >= server.zerocopy_threshold &&
+           clientCanZerocopy(c))
+            nwritten = writeZerocopy(c, o, ((char*)o->ptr)+c->sentlen, objlen-c->sentlen);
+        else
+            nwritten = write(c->fd, ((char*)o->ptr)+c->sentlen, objlen-c->sentlen);
+        if(nwritten <= 0) break;
+        c->sentlen += nwritten;
+        totwritten += nwritten;
+        if(c->sentlen == objlen) {
+            listDelNode(c->reply, listFirst(c->reply));
+            c->sentlen = 0;
+            c->reply_bytes -= objlen;
+        }
+        // leave the rest to the writable handler, slaves are not capped
+        // so they keep up with the stream
+        if(totwritten > REDIS_MAX_WRITE_PER_EVENT && !(c->flags & REDIS_SLAVE)) break;
+    }
+    if(nwritten == -1 && errno != EAGAIN) {
+        redisLog(REDIS_DEBUG, "Error writing to client: %s", strerror(errno));
+        c->flags |= REDIS_CLOSE_ASAP;
+        return REDIS_ERR;
+    }
+    if(totwritten > 0) c->lastinteraction = time(NULL);
+    return REDIS_OK;
+}
+
+static void clientRepliesSent(aeEventLoop *el, int fd, void *privdata, int res);
+
+// With io_uring the head of the reply list, up to REDIS_SEND_IOV replies,
+// goes out in one SENDMSG the loop submits with its next wait, and the
+// completion sends the rest. Returns REDIS_ERR when the loop can't, the
+// caller writes then. Slaves get direct writes around their stream, so
+// they keep using writeToClient().
+static int sendClientReplies(redisClient *c) {
+    clientSend *cs;
+    listNode *ln;
+    int sentlen = c->sentlen;
+
+    if(!clientRingIO() || (c->flags & REDIS_SLAVE)) return REDIS_ERR;
+    if(c->sending) return REDIS_OK;
+
+    cs = zmalloc(sizeof(*cs));
+    cs->c = c;
+    cs->count = 0;
+    for(ln = listFirst(c->reply); ln && cs->count < REDIS_SEND_IOV; ln = ln->next) {
+        robj *o = listNodeValue(ln);
+        int objlen = sdslen(o->ptr);
+
+        if(objlen > sentlen) {
+            cs->iov[cs->count].iov_base = ((char*)o->ptr)+sentlen;
+            cs->iov[cs->count].iov_len = objlen-sentlen;
+            cs->objs[cs->count++] = o;
+            incrRefCount(o);
+        }
+        sentlen = 0;
+    }
+    if(cs->count == 0) {
+        // only empty replies
+        while(listLength(c->reply)) listDelNode(c->reply, listFirst(c->reply));
+        zfree(cs);
+        return REDIS_OK;
+    }
+    if(aeSendv(currentEl(), c->fd, cs->iov, cs->count, clientRepliesSent, cs) == AE_ERR) {
+        for(int j = 0; j < cs->count; j++) decrRefCount(cs->objs[j]);
+        zfree(cs);
+        return REDIS_ERR;
+    }
+    c->sending = cs;
+    return REDIS_OK;
+}
+
+// res bytes of the replies went out, or -errno
+static void clientRepliesSent(aeEventLoop *el, int fd, void *privdata, int res) {
+    clientSend *cs = privdata;
+    redisClient *c = cs->c;
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(fd);
+
+    for(int j = 0; j < cs->count; j++) decrRefCount(cs->objs[j]);
+    zfree(cs);
+    if(!c) return;
+    c->sending = NULL;
+    if(res < 0) {
+        redisLog(REDIS_DEBUG, "Error writing to client: %s", strerror(-res));
+        freeClient(c);
+        return;
+    }
+    if(res > 0) c->lastinteraction = time(NULL);
+    while(listLength(c->reply)) {
+        robj *o = listNodeValue(listFirst(c->reply));
+        int objlen = sdslen(o->ptr);
+
+        if(objlen-c->sentlen > res) {
+            c->sentlen += res;
+            break;
+        }
+        res -= objlen-c->sentlen;
+        listDelNode(c->reply, listFirst(c->reply));
+        c->sentlen = 0;
+        c->reply_bytes -= objlen;
+    }
+    if(listLength(c->reply)) sendClientReplies(c);
+}
+
+static void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    redisClient *c = (redisClient*)privdata;
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(fd);
+    REDIS_NOTUSED(mask);
+
+    if(writeToClient(c) == REDIS_ERR) {
+        freeClient(c);
+        return;
+    }
+    if(listLength(c->reply) == 0)
+        aeDeleteFileEvent(currentEl(), c->fd, AE_WRITABLE);
+}
+
+static int handleClientsWithPendingWrites(void) {
+    list *pending = currentPendingWrites();
+    int processed = listLength(pending);
+    listNode *ln;
+
+    while((ln = listFirst(pending)) != NULL) {
+        redisClient *c = listNodeValue(ln);
+
+        c->flags &= ~REDIS_PENDING_WRITE;
+        listDelNode(pending, ln);
+        if(!(c->flags & REDIS_CLOSE_ASAP) && sendClientReplies(c) == REDIS_OK) continue;
+        if(writeToClient(c) == REDIS_ERR) {
+            freeClient(c);
+            continue;
+        }
+        // the socket buffer is full, finish from the event loop
+        if(listLength(c->reply))
+            createClientFileEvent(c, AE_WRITABLE, sendReplyToClient);
+    }
+    return processed;
+}
+
+// ============================ query =====================
+
+// Takes what a read of the client socket returned, nread < 0 is -errno.
+static int appendClientQuery(redisClient *c, char *buf, int nread) {
+    if(nread < 0){
+        redisLog(REDIS_DEBUG, "Reading from client: %s", strerror(-nread));
+        c->flags |= REDIS_CLOSE_ASAP;
+        return REDIS_ERR;
+    }else if (nread == 0){
+        redisLog(REDIS_DEBUG, "Client closed connection");
+        c->flags |= REDIS_CLOSE_ASAP;
+        return REDIS_ERR;
+    }
+
+    c->querybuf = sdscatlen(c->querybuf, buf, nread);
+    c->lastinteraction = time(NULL);
+    c->read_reploff += nread;
+    return REDIS_OK;
+}
+
+// Append what is available on the socket to the query buffer. Called
+// from I/O threads too, see writeToClient() about errors.
+static int readClientQuery(redisClient *c) {
+    char buf[REDIS_QUERYBUF_LEN];
+    int nread;
+
+    nread = read(c->fd, buf, REDIS_QUERYBUF_LEN);
+    if(nread == -1){
+        if(errno == EAGAIN) return REDIS_OK;
+        nread = -errno;
+    }
+    return appendClientQuery(c, buf, nread);
+}
+
+// Split the first line of the query buffer into c->argv. Returns 1 when
+// a line was consumed, 0 if it is not complete yet and -1 on protocol
+// error. Only touches the client, so I/O threads parse with it too.
+static int processInlineBuffer(redisClient *c) {
+    char *p = strchr(c->querybuf, '\n');
+    size_t querylen;
+    sds query, *argv;
+    int argc;
+
+    if(!p) {
+        if(sdslen(c->querybuf) >= 1024){
+            redisLog(REDIS_DEBUG, "Client protocol error");
+            return -1;
+        }
+        return 0;
+    }
+
+    query = c->querybuf;
+    c->querybuf = sdsempty();
+    querylen = 1 + (p-query);
+    if(sdslen(query) > querylen){
+        c->querybuf = sdscatlen(c->querybuf, query+querylen, sdslen(query) - querylen);
+    }
+
+    *p = '\0';
+    if(p != query && *(p-1) == '\r') *(p-1) = '\0';
+    sdsupdatelen(query);
+    if(sdslen(query) == 0){
+        sdsfree(query);
+        return 1;
+    }
+
+    argv = sdssplitlen(query, sdslen(query), " ", 1, &argc);
+    sdsfree(query);
+    for(int i = 0; i < argc; i++) {
+        if(sdslen(argv[i]) && c->argc < REDIS_MAX_ARGS){
+            c->argv[c->argc] = createObject(REDIS_STRING, argv[i]);
+            c->argc++;
+        }else
+            sdsfree(argv[i]);
+    }
+    zfree(argv);
+    return 1;
+}
+
+static void processInputBuffer(redisClient *c) {
+    // a forwarded command is in flight, keep the pipeline in order
+    while(sdslen(c->querybuf) && !(c->flags & (REDIS_SHARD_WAIT|REDIS_CLOSE_ASAP))) {
+        if(c->bulklen == -1) {
+            int ret = processInlineBuffer(c);
+
+            if(ret == -1) {
+                freeClient(c);
+                return;
+            }
+            if(ret == 0) return;
+            if(c->argc == 0) continue;
+        } else {
+            // bulk read
+            int qbl = sdslen(c->querybuf);
+            if(c->bulklen > qbl) return;
+            c->argv[c->argc] = createStringObject(c->querybuf, c->bulklen-2);
+            c->argc++;
+            c->querybuf = sdsrange(c->querybuf, c->bulklen, -1);
+        }
+        if(!processCommand(c)) return;
+    }
+}
+
+// ============================ threaded I/O =====================
+// Reads plus parsing, and reply writes, of the clients that became ready
+// in one loop iteration are split across io_threads_num threads (id 0 is
+// the main thread). Commands still run on the main thread only, so the
+// keyspace needs no locks: while the threads work the main thread only
+// does its own share of I/O and then spins until all of them are done.
+
+static pthread_t io_threads[REDIS_IO_THREADS_MAX];
+static pthread_mutex_t io_threads_mutex[REDIS_IO_THREADS_MAX];
+static unsigned long io_threads_pending[REDIS_IO_THREADS_MAX];
+static list *io_threads_list[REDIS_IO_THREADS_MAX];
+
+static unsigned long getIOPendingCount(int i) {
+    return __atomic_load_n(&io_threads_pending[i], __ATOMIC_ACQUIRE);
+}
+
+static void setIOPendingCount(int i, unsigned long count) {
+    __atomic_store_n(&io_threads_pending[i], count, __ATOMIC_RELEASE);
+}
+
+static void processIOThreadList(int id) {
+    listNode *ln;
+
+    while((ln = listFirst(io_threads_list[id])) != NULL) {
+        redisClient *c = listNodeValue(ln);
+
+        if(io_threads_op == REDIS_IO_THREADS_OP_WRITE) {
+            writeToClient(c);
+        } else if(readClientQuery(c) == REDIS_OK && c->bulklen == -1) {
+            int ret = processInlineBuffer(c);
+
+            if(ret == -1) c->flags |= REDIS_CLOSE_ASAP;
+            else if(ret == 1 && c->argc) c->flags |= REDIS_PENDING_COMMAND;
+        }
+        listDelNode(io_threads_list[id], ln);
+    }
+}
+
+static void *IOThreadMain(void *myid) {
+    long id = (long) myid;
+
+    while(1) {
+        // spin for a while, then park on the mutex the main thread holds
+        // when there is not enough work for the threads
+        for(int j = 0; j < 1000000; j++) {
+            if(getIOPendingCount(id) != 0) break;
+        }
+        if(getIOPendingCount(id) == 0) {
+            pthread_mutex_lock(&io_threads_mutex[id]);
+            pthread_mutex_unlock(&io_threads_mutex[id]);
+            continue;
+        }
+
+        processIOThreadList(id);
+        setIOPendingCount(id, 0);
+    }
+    return NULL;
+}
+
+static void initThreadedIO(void) {
+    server.io_threads_active = 0;
+    io_threads_op = REDIS_IO_THREADS_OP_IDLE;
+    if(server.io_threads_num == 1) return;
+
+    zmalloc_enable_thread_safeness();
+    for(int i = 0; i < server.io_threads_num; i++) {
+        io_threads_list[i] = listCreate();
+        if(i == 0) continue;
+
+        pthread_mutex_init(&io_threads_mutex[i], NULL);
+        setIOPendingCount(i, 0);
+        pthread_mutex_lock(&io_threads_mutex[i]);
+        if(pthread_create(&io_threads[i], NULL, IOThreadMain, (void*)(long)i) != 0) {
+            redisLog(REDIS_WARNING, "Fatal: can't initialize I/O threads");
+            exit(1);
+        }
+    }
+}
+
+static void startThreadedIO(void) {
+    for(int j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_unlock(&io_threads_mutex[j]);
+    server.io_threads_active = 1;
+}
+
+static void stopThreadedIO(void) {
+    for(int j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_lock(&io_threads_mutex[j]);
+    server.io_threads_active = 0;
+}
+
+// with only a few clients to serve the hand-off costs more than it saves
+static int stopThreadedIOIfNeeded(void) {
+    int pending = listLength(server.clients_pending_write);
+
+    if(server.io_threads_num == 1) return 1;
+    if(pending < server.io_threads_num*2) {
+        if(server.io_threads_active) stopThreadedIO();
+        return 1;
+    }
+    return 0;
+}
+
+// hand 'clients' round robin to the I/O threads and wait for all of them
+static void runIOThreads(list *clients, int op) {
+    listIter *iter;
+    listNode *ln;
+    int item_id = 0;
+
+    iter = listGetIter(clients, ITER_FORWARD);
+    while((ln = listNextElement(iter)) != NULL) {
+        int target_id = item_id % server.io_threads_num;
+
+        // slaves share the stream objects, only the main thread may drop
+        // their references
+        if(((redisClient*)listNodeValue(ln))->flags & REDIS_SLAVE) target_id = 0;
+        listNodeAddTail(io_threads_list[target_id], listNodeValue(ln));
+        item_id++;
+    }
+    listReleaseIter(iter);
+
+    io_threads_op = op;
+    for(int j = 1; j < server.io_threads_num; j++)
+        setIOPendingCount(j, listLength(io_threads_list[j]));
+
+    processIOThreadList(0);
+    while(1) {
+        unsigned long pending = 0;
+        for(int j = 1; j < server.io_threads_num; j++)
+            pending += getIOPendingCount(j);
+        if(pending == 0) break;
+    }
+    io_threads_op = REDIS_IO_THREADS_OP_IDLE;
+}
+
+static int handleClientsWithPendingWritesUsingThreads(void) {
+    // shards have their own list and no I/O threads
+    int processed = listLength(currentPendingWrites());
+    listNode *ln;
+
+    if(processed == 0) return 0;
+    if(stopThreadedIOIfNeeded()) return handleClientsWithPendingWrites();
+    if(!server.io_threads_active) startThreadedIO();
+
+    runIOThreads(server.clients_pending_write, REDIS_IO_THREADS_OP_WRITE);
+
+    while((ln = listFirst(server.clients_pending_write)) != NULL) {
+        redisClient *c = listNodeValue(ln);
+
+        c->flags &= ~REDIS_PENDING_WRITE;
+        listDelNode(server.clients_pending_write, ln);
+        if(c->flags & REDIS_CLOSE_ASAP) {
+            freeClient(c);
+            continue;
+        }
+        if(listLength(c->reply))
+            createClientFileEvent(c, AE_WRITABLE, sendReplyToClient);
+    }
+    return processed;
+}
+
+static int postponeClientRead(redisClient *c) {
+    if(server.io_threads_active && server.io_threads_do_reads &&
+       !(c->flags & (REDIS_MASTER|REDIS_SLAVE|REDIS_PENDING_READ))) {
+        c->flags |= REDIS_PENDING_READ;
+        listNodeAddTail(server.clients_pending_read, c);
+        return 1;
+    }
+    return 0;
+}
+
+static int handleClientsWithPendingReadsUsingThreads(void) {
+    int processed = listLength(server.clients_pending_read);
+    listNode *ln;
+
+    if(!server.io_threads_active || !server.io_threads_do_reads || processed == 0)
+        return 0;
+
+    runIOThreads(server.clients_pending_read, REDIS_IO_THREADS_OP_READ);
+
+    // execute what the threads parsed, in arrival order
+    while((ln = listFirst(server.clients_pending_read)) != NULL) {
+        redisClient *c = listNodeValue(ln);
+
+        c->flags &= ~REDIS_PENDING_READ;
+        listDelNode(server.clients_pending_read, ln);
+        if(c->flags & REDIS_CLOSE_ASAP) {
+            freeClient(c);
+            continue;
+        }
+        if(c->flags & REDIS_PENDING_COMMAND) {
+            c->flags &= ~REDIS_PENDING_COMMAND;
+            if(!processCommand(c)) continue;
+        }
+        processInputBuffer(c);
+    }
+    return processed;
+}
+
+// ============================ shards =====================
+// With "shards N" the server runs N event loops, one per thread, each
+// accepting on its own SO_REUSEPORT socket and owning the keys that hash
+// to it. A command whose keys live on another shard is handed to the
+// owner over a lock free SPSC queue together with its argv; the owner
+// runs it on a proxy client and sends the reply objects back. Nothing in
+// the keyspace is ever touched by two threads.
+// Commands needing the keys of several shards, or the whole keyspace, run
+// on the shard that got them while every other shard is parked, see
+// shardsPause().
+
+static spscQueue *spscCreate(unsigned long size) {
+    spscQueue *q = zmalloc(sizeof(*q));
+
+    q->head = q->tail = 0;
+    q->mask = size-1;
+    q->slots = zmalloc(sizeof(void*)*size);
+    return q;
+}
+
+static int spscPush(spscQueue *q, void *item) {
+    unsigned long tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    unsigned long head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    if(tail - head > q->mask) return 0; // full
+    q->slots[tail & q->mask] = item;
+    __atomic_store_n(&q->tail, tail+1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void *spscPop(spscQueue *q) {
+    unsigned long head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    unsigned long tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    void *item;
+
+    if(head == tail) return NULL;
+    item = q->slots[head & q->mask];
+    __atomic_store_n(&q->head, head+1, __ATOMIC_RELEASE);
+    return item;
+}
+
+static int keyShard(sds key) {
+    return dictGenHashFunction((unsigned char*)key, sdslen(key)) % server.shards_num;
+}
+
+// Returns the shard owning every key of the command, -1 if the command
+// has no key and -2 if its keys live on different shards.
+static int getCommandShard(redisClient *c, struct redisCommand *cmd) {
+    int last, target = -1;
+
+    if(cmd->firstkey == 0) return -1;
+    last = (cmd->lastkey < 0) ? c->argc + cmd->lastkey : cmd->lastkey;
+    for(int j = cmd->firstkey; j <= last && j < c->argc; j += cmd->keystep) {
+        int id = keyShard(c->argv[j]->ptr);
+
+        if(target == -1) target = id;
+        else if(target != id) return -2;
+    }
+    return target;
+}
+
+// only write to the pipe if the owner was not already told to wake up
+static void shardNotify(redisShard *to) {
+    if(!__atomic_exchange_n(&to->notified, 1, __ATOMIC_SEQ_CST)) {
+        if(write(to->wakefd[1], "x", 1) == -1 && errno != EAGAIN)
+            redisLog(REDIS_WARNING, "Waking up shard %d: %s", to->id, strerror(errno));
+    }
+}
+
+static void shardSend(int target, shardMsg *m) {
+    redisShard *to = &shards[target];
+
+    // once something waits in the outbox everything after it waits too,
+    // so replies and calls keep their order
+    if(listLength(curshard->outbox[target]) ||
+       !spscPush(to->inbox[curshard->id], m)) {
+        listNodeAddTail(curshard->outbox[target], m);
+        return;
+    }
+    shardNotify(to);
+}
+
+static void flushShardOutboxes(void) {
+    for(int j = 0; j < server.shards_num; j++) {
+        list *l = curshard->outbox[j];
+        listNode *ln;
+        int sent = 0;
+
+        while((ln = listFirst(l)) != NULL) {
+            if(!spscPush(shards[j].inbox[curshard->id], listNodeValue(ln))) break;
+            listDelNode(l, ln);
+            sent = 1;
+        }
+        if(sent) shardNotify(&shards[j]);
+    }
+}
+
+// Stopping the world. Shards only park from beforeSleep() and their wakeup
+// handler, between two commands, so the dicts are consistent while the
+// shard that paused them reads or changes any of them.
+static pthread_mutex_t shards_pause_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shards_pause_cond = PTHREAD_COND_INITIALIZER;
+static int shards_running; // the shard threads were started
+static int shards_pauser = -1; // the shard running alone, -1 if none
+static int shards_pause_depth; // nested pauses of shards_pauser
+static int shards_parked; // shards waiting in shardParkLocked()
+static unsigned long shards_pause_gen; // bumped by shardsResume()
+
+static void shardParkLocked(void) {
+    unsigned long gen = shards_pause_gen;
+
+    shards_parked++;
+    pthread_cond_broadcast(&shards_pause_cond);
+    while(gen == shards_pause_gen)
+        pthread_cond_wait(&shards_pause_cond, &shards_pause_mutex);
+    shards_parked--;
+    pthread_cond_broadcast(&shards_pause_cond);
+}
+
+// waits while another shard runs alone
+static void shardPark(void) {
+    if(__atomic_load_n(&shards_pauser, __ATOMIC_ACQUIRE) == -1) return;
+    pthread_mutex_lock(&shards_pause_mutex);
+    if(shards_pauser != -1 && shards_pauser != curshard->id) shardParkLocked();
+    pthread_mutex_unlock(&shards_pause_mutex);
+}
+
+// Returns once every other shard is parked. Pauses nest. Two shards
+// pausing at the same time take turns: the loser parks for the winner.
+static void shardsPause(void) {
+    if(!shards_running) return;
+    if(__atomic_load_n(&shards_pauser, __ATOMIC_RELAXED) == curshard->id) {
+        shards_pause_depth++;
+        return;
+    }
+    pthread_mutex_lock(&shards_pause_mutex);
+    while(1) {
+        if(shards_pauser != -1) shardParkLocked();
+        // the shards parked by the last pause are still leaving
+        else if(shards_parked) pthread_cond_wait(&shards_pause_cond, &shards_pause_mutex);
+        else break;
+    }
+    __atomic_store_n(&shards_pauser, curshard->id, __ATOMIC_RELEASE);
+    shards_pause_depth = 1;
+    pthread_mutex_unlock(&shards_pause_mutex);
+
+    // not shardNotify(): a shard told before may be past its last park check
+    for(int j = 0; j < server.shards_num; j++) {
+        if(j != curshard->id && write(shards[j].wakefd[1], "x", 1) == -1 && errno != EAGAIN)
+            redisLog(REDIS_WARNING, "Waking up shard %d: %s", j, strerror(errno));
+    }
+    pthread_mutex_lock(&shards_pause_mutex);
+    while(shards_parked < server.shards_num-1)
+        pthread_cond_wait(&shards_pause_cond, &shards_pause_mutex);
+    pthread_mutex_unlock(&shards_pause_mutex);
+}
+
+static void shardsResume(void) {
+    if(!shards_running || --shards_pause_depth) return;
+    pthread_mutex_lock(&shards_pause_mutex);
+    __atomic_store_n(&shards_pauser, -1, __ATOMIC_RELEASE);
+    shards_pause_gen++;
+    pthread_cond_broadcast(&shards_pause_cond);
+    pthread_mutex_unlock(&shards_pause_mutex);
+}
+
+// Keys on several shards: the command runs on a scratch dict holding just
+// its keys, then each key is written back to its owner, deleted, replaced
+// or added. Commands only touch the keys they declare in cmdTable.
+static void shardCallMultiKey(redisClient *c, struct redisCommand *cmd) {
+    dict *scratch = dictCreate(&hashDictType, NULL), *saved = c->dict;
+    int last = (cmd->lastkey < 0) ? c->argc + cmd->lastkey : cmd->lastkey;
+
+    for(int j = cmd->firstkey; j <= last && j < c->argc; j += cmd->keystep) {
+        dictEntry *de = dictFind(shards[keyShard(c->argv[j]->ptr)].dict[c->dictid], c->argv[j]);
+
+        if(de && !dictFind(scratch, c->argv[j])) {
+            incrRefCount(dictGetEntryKey(de));
+            incrRefCount(dictGetEntryValue(de));
+            dictAdd(scratch, dictGetEntryKey(de), dictGetEntryValue(de));
+        }
+    }
+    c->dict = scratch;
+    cmd->proc(c);
+    c->dict = saved;
+    for(int j = cmd->firstkey; j <= last && j < c->argc; j += cmd->keystep) {
+        dict *owner = shards[keyShard(c->argv[j]->ptr)].dict[c->dictid];
+        dictEntry *de = dictFind(scratch, c->argv[j]), *ode = dictFind(owner, c->argv[j]);
+
+        if(de == NULL) {
+            if(ode) dictDelete(owner, c->argv[j]);
+        } else if(ode == NULL || dictGetEntryValue(ode) != dictGetEntryValue(de)) {
+            if(ode) dictDelete(owner, c->argv[j]);
+            incrRefCount(dictGetEntryKey(de));
+            incrRefCount(dictGetEntryValue(de));
+            dictAdd(owner, dictGetEntryKey(de), dictGetEntryValue(de));
+        }
+    }
+    dictRelease(scratch);
+}
+
+// Runs the command on the slice of every shard and merges the replies:
+// integers are added up, multi bulk replies joined, otherwise the first
+// error wins, then the first reply that is not nil. Starting at a random
+// shard makes that a random pick for RANDOMKEY.
+static void shardCallScatter(redisClient *c, struct redisCommand *cmd) {
+    redisClient *p = curshard->proxy;
+    int n = server.shards_num, start = random() % n;
+    long long sum = 0, count = 0;
+    sds items = sdsempty(), first = NULL, err = NULL, pick = NULL, out;
+    char type = 0;
+
+    for(int i = 0; i < n; i++) {
+        sds reply = sdsempty();
+        listNode *ln;
+
+        p->dict = shards[(start+i) % n].dict[c->dictid];
+        p->dictid = c->dictid;
+        memcpy(p->argv, c->argv, sizeof(robj*)*c->argc);
+        p->argc = c->argc;
+        cmd->proc(p);
+        p->argc = 0; // the argv still belongs to c
+        while((ln = listFirst(p->reply)) != NULL) {
+            robj *o = listNodeValue(ln);
+
+            reply = sdscatlen(reply, o->ptr, sdslen(o->ptr));
+            listDelNode(p->reply, ln);
+        }
+        p->reply_bytes = 0;
+
+        if(reply[0] == ':' || reply[0] == '*') {
+            char *body = strstr(reply, "\r\n");
+            long long v = strtoll(reply+1, NULL, 10);
+
+            type = reply[0];
+            if(type == ':') sum += v;
+            else if(v > 0) count += v;
+            if(type == '*' && body) items = sdscatlen(items, body+2, sdslen(reply)-(body+2-reply));
+        } else if(reply[0] == '-' && !err) {
+            err = sdsdup(reply);
+        } else if(reply[0] != '-' && !pick && strncmp(reply, "$-1", 3)) {
+            pick = sdsdup(reply);
+        }
+        if(!first) first = reply;
+        else sdsfree(reply);
+    }
+
+    if(err) out = sdsdup(err);
+    else if(type == ':') out = sdscatprintf(sdsempty(), ":%lld\r\n", sum);
+    else if(type == '*') out = sdscatlen(sdscatprintf(sdsempty(), "*%lld\r\n", count), items, sdslen(items));
+    else out = sdsdup(pick ? pick : first);
+    addReplySds(c, out);
+    sdsfree(items);
+    sdsfree(first);
+    if(err) sdsfree(err);
+    if(pick) sdsfree(pick);
+}
+
+// a command that needs the keys of more than one shard
+static void shardCallGlobal(redisClient *c, struct redisCommand *cmd) {
+    shardsPause();
+    if(cmd->flags & REDIS_CMD_SCATTER) shardCallScatter(c, cmd);
+    else if(cmd->flags & REDIS_CMD_KEYSPACE) cmd->proc(c);
+    else shardCallMultiKey(c, cmd);
+    shardsResume();
+}
+
+static void shardForwardCommand(redisClient *c, struct redisCommand *cmd, int target) {
+    shardMsg *m = zmalloc(sizeof(*m));
+
+    m->type = REDIS_SHARD_MSG_CALL;
+    m->from = curshard->id;
+    m->c = c;
+    m->cmd = cmd;
+    m->dictid = c->dictid;
+    m->argc = c->argc;
+    memcpy(m->argv, c->argv, sizeof(robj*)*c->argc);
+    m->reply = NULL;
+    // the argv references now belong to the message
+    c->argc = 0;
+    c->flags |= REDIS_SHARD_WAIT;
+    shardSend(target, m);
+}
+
+static void shardHandleCall(shardMsg *m) {
+    redisClient *p = curshard->proxy;
+
+    long long start, duration;
+
+    selectDb(p, m->dictid);
+    memcpy(p->argv, m->argv, sizeof(robj*)*m->argc);
+    p->argc = m->argc;
+    start = ustime();
+    m->cmd->proc(p);
+    duration = ustime()-start;
+    recordCommandStats(m->cmd, duration);
+    hotkeysTrackCommand(m->cmd, m->dictid, p->argv, p->argc);
+    slowlogPushEntryIfNeeded(m->c, p->argv, p->argc, duration);
+    latencyAddSampleIfNeeded((m->cmd->flags & REDIS_CMD_FAST) ? "fast-command" : "command", duration/1000);
+    __atomic_add_fetch(&server.stat_numcommands, 1, __ATOMIC_RELAXED);
+    freeClientArgv(p);
+
+    m->reply = p->reply;
+    p->reply = listCreate();
+    listSetFreeMethod(p->reply, decrRefCount);
+    p->reply_bytes = 0;
+    m->type = REDIS_SHARD_MSG_REPLY;
+    shardSend(m->from, m);
+}
+
+static void shardHandleReply(shardMsg *m) {
+    redisClient *c = m->c;
+    listNode *ln;
+
+    c->flags &= ~REDIS_SHARD_WAIT;
+    if(c->flags & REDIS_CLOSE_ASAP) {
+        freeClient(c);
+    } else {
+        while((ln = listFirst(m->reply)) != NULL) {
+            addReply(c, listNodeValue(ln));
+            listDelNode(m->reply, ln);
+        }
+        resetClient(c);
+        // go on with the commands pipelined behind the forwarded one
+        processInputBuffer(c);
+    }
+    listRelease(m->reply);
+    zfree(m);
+}
+
+static void processShardInbox(void) {
+    // reset before draining: a push racing with us then writes the pipe
+    __atomic_store_n(&curshard->notified, 0, __ATOMIC_SEQ_CST);
+    for(int j = 0; j < server.shards_num; j++) {
+        spscQueue *q = curshard->inbox[j];
+        shardMsg *m;
+        int wasfull;
+
+        if(q == NULL) continue;
+        wasfull = (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) - q->head) > q->mask;
+        while((m = spscPop(q)) != NULL) {
+            if(m->type == REDIS_SHARD_MSG_CALL)
+                shardHandleCall(m);
+            else
+                shardHandleReply(m);
+        }
+        // the sender may have parked messages in its outbox
+        if(wasfull) shardNotify(&shards[j]);
+    }
+}
+
+static void shardWakeupHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[64];
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(privdata);
+    REDIS_NOTUSED(mask);
+
+    while(read(fd, buf, sizeof(buf)) > 0);
+    shardPark();
+    processShardInbox();
+}
+
+// a client without a connection, its replies are only queued
+static redisClient *createFakeClient(int flags) {
+    redisClient *p = zmalloc(sizeof(*p));
+
+    p->fd = -1;
+    p->dict = NULL;
+    p->dictid = 0;
+    p->querybuf = sdsempty();
+    p->argc = 0;
+    p->bulklen = -1;
+    p->reply = listCreate();
+    listSetFreeMethod(p->reply, decrRefCount);
+    p->sentlen = 0;
+    p->reply_bytes = 0;
+    p->obuf_soft_limit_reached_time = 0;
+    p->lastinteraction = time(NULL);
+    p->flags = flags;
+    p->replstate = REDIS_REPL_NONE;
+    p->repldbfd = -1;
+    p->replpreamble = NULL;
+    p->lastcmd = NULL;
+    p->zcpinned = NULL;
+    p->zcseq = 0;
+    return p;
+}
+
+static void beforeSleep(struct aeEventLoop *eventLoop);
+static void afterSleep(struct aeEventLoop *eventLoop);
+
+static void *shardMain(void *arg) {
+    redisShard *sh = arg;
+
+    curshard = sh;
+    aeSetBeforeSleepProc(sh->el, beforeSleep);
+    aeSetAfterSleepProc(sh->el, afterSleep);
+    aeMain(sh->el);
+    return NULL;
+}
+
+static void initShards(void) {
+    int n = server.shards_num;
+
+    if(n == 1) return;
+    zmalloc_enable_thread_safeness();
+    shards = zmalloc(sizeof(redisShard)*n);
+    for(int i = 0; i < n; i++) {
+        redisShard *sh = &shards[i];
+
+        sh->id = i;
+        if(i == 0) {
+            sh->el = server.el;
+            sh->fd = server.fd;
+            sh->dict = server.dict;
+            sh->clients = server.clients;
+            sh->clients_pending_write = server.clients_pending_write;
+            sh->zcclosing = server.zcclosing;
+        } else {
+            sh->el = aeCreateEventLoop();
+            sh->fd = anetTcpServerReusePort(server.neterr, server.port, server.bindaddr, server.tcp_backlog);
+            if(sh->fd == ANET_ERR) {
+                redisLog(REDIS_WARNING, "Opening listener of shard %d: %s", i, server.neterr);
+                exit(1);
+            }
+            anetNonBlock(NULL, sh->fd);
+            sh->dict = zmalloc(sizeof(dict*)*server.dbnum);
+            for(int j = 0; j < server.dbnum; j++)
+                sh->dict[j] = dictCreate(&hashDictType, NULL);
+            sh->clients = listCreate();
+            sh->clients_pending_write = listCreate();
+            sh->zcclosing = listCreate();
+            createFileEvent(sh->el, sh->fd, AE_READABLE, acceptHandler, NULL);
+        }
+        sh->proxy = createFakeClient(REDIS_SHARD_PROXY);
+        sh->inbox = zmalloc(sizeof(spscQueue*)*n);
+        sh->outbox = zmalloc(sizeof(list*)*n);
+        for(int j = 0; j < n; j++) {
+            sh->inbox[j] = (j == i) ? NULL : spscCreate(REDIS_SHARD_QUEUE_LEN);
+            sh->outbox[j] = listCreate();
+        }
+        if(pipe(sh->wakefd) == -1) {
+            redisLog(REDIS_WARNING, "Creating shard %d wakeup pipe: %s", i, strerror(errno));
+            exit(1);
+        }
+        anetNonBlock(NULL, sh->wakefd[0]);
+        anetNonBlock(NULL, sh->wakefd[1]);
+        sh->notified = 0;
+        createFileEvent(sh->el, sh->wakefd[0], AE_READABLE, shardWakeupHandler, sh);
+    }
+
+    curshard = &shards[0];
+}
+
+// after the dataset is loaded, the shard threads own their slices
+static void startShards(void) {
+    for(int i = 1; i < server.shards_num; i++) {
+        if(pthread_create(&shards[i].thread, NULL, shardMain, &shards[i]) != 0) {
+            redisLog(REDIS_WARNING, "Fatal: can't start shard threads");
+            exit(1);
+        }
+    }
+    if(server.shards_num > 1) shards_running = 1;
+}
+
+// when this thread's event loop returned from its last wait
+static __thread long long loop_woke_us;
+
+static void beforeSleep(struct aeEventLoop *eventLoop) {
+    REDIS_NOTUSED(eventLoop);
+
+    if(curshard) {
+        shardPark();
+        flushShardOutboxes();
+        processShardInbox();
+    }
+    closeParkedZerocopyClients();
+    handleClientsWithPendingReadsUsingThreads();
+    // the log is written before the replies of its commands
+    if(server.appendonly) flushAppendOnlyFile();
+    if(server.aofrewritechildpid != -1) aofRewriteSendDiff();
+    handleClientsWithPendingWritesUsingThreads();
+    // the iteration ends here, the loop goes to sleep
+    if(loop_woke_us) latencyAddSampleIfNeeded("eventloop", (ustime()-loop_woke_us)/1000);
+}
+
+static void afterSleep(struct aeEventLoop *eventLoop) {
+    REDIS_NOTUSED(eventLoop);
+    if(server.latency_monitor_threshold) loop_woke_us = ustime();
+}
+
+// ============================ persistence =====================
+// Dump file layout:
+//   "REDIS0003"                REDIS_RDB_VERSION, zero padded
+//   SELECTDB <dbid>            once per non empty db
+//   RESIZEDB <keys>            keys in that db, to presize it on load
+//   <type> <key> <value>       one per key
+//   EOF
+//   crc64 of all of the above, 8 bytes little endian
+// Lengths are varints (7 bits per byte, high bit set while more follow),
+// lists and sets are an element count followed by that many strings.
+// A string starts with a varint header, len << 2 | encoding:
+//   RAW  len bytes follow
+//   INT  a zigzag varint follows (len is 0)
+//   LZF  the uncompressed length follows, then len compressed bytes
+// Version 1 files have no header, just the length of raw bytes, and
+// version 2 files have no RESIZEDB; both still load.
+
+typedef struct rdbFile {
+    FILE *fp;
+    const unsigned char *map; // the whole file when it is mmapped
+    size_t maplen;
+    int version;
+    uint64_t cksum;
+    long long processed;
+    long long size; // of the whole dump, 0 when unknown
+    // diskless, fp is NULL: a BGSAVE child writes to the slave sockets in
+    // fds, a slave reads from the master socket in fd
+    int *fds;
+    int *fderr; // errno of the failed write, 0 while the slave is fine
+    int numfds;
+    int fd;
+    sds iobuf;
+    size_t iopos; // bytes of iobuf already consumed by the reader
+} rdbFile;
+
+// Sends the buffered bytes to every slave still fine. The sockets are
+// non blocking, they are shared with the parent, so wait with poll().
+// Returns -1 once no slave is left.
+static int rdbFlushFds(rdbFile *rdb) {
+    size_t len = sdslen(rdb->iobuf);
+    int alive = 0;
+
+    for(int j = 0; j < rdb->numfds; j++) {
+        size_t nwritten = 0;
+
+        while(!rdb->fderr[j] && nwritten < len) {
+            ssize_t n = write(rdb->fds[j], rdb->iobuf+nwritten, len-nwritten);
+
+            if(n == -1 && errno == EAGAIN) {
+                struct pollfd pfd = {rdb->fds[j], POLLOUT, 0};
+
+                if(poll(&pfd, 1, REDIS_REPL_TIMEOUT*1000) != 1)
+                    rdb->fderr[j] = ETIMEDOUT;
+                continue;
+            }
+            if(n <= 0) rdb->fderr[j] = (n == -1) ? errno : EPIPE;
+            else nwritten += n;
+        }
+        if(!rdb->fderr[j]) alive++;
+    }
+    rdb->iobuf = sdsrange(rdb->iobuf, len, -1);
+    return alive ? 0 : -1;
+}
+
+static int rdbWriteBytes(rdbFile *rdb, void *p, size_t len) {
+    if(rdb->fp) {
+        if(len && fwrite(p, len, 1, rdb->fp) == 0) return -1;
+        return 0;
+    }
+    if(rdb->numfds == 0) return 0; // only counted, see debugCommand()
+    rdb->iobuf = sdscatlen(rdb->iobuf, p, len);
+    if(sdslen(rdb->iobuf) >= REDIS_IOBUF_LEN) return rdbFlushFds(rdb);
+    return 0;
+}
+
+static int rdbWriteRaw(rdbFile *rdb, void *p, size_t len) {
+    if(rdbWriteBytes(rdb, p, len) == -1) return -1;
+    rdb->cksum = crc64(rdb->cksum, p, len);
+    rdb->processed += len;
+    return 0;
+}
+
+static int rdbReadFd(rdbFile *rdb, void *p, size_t len) {
+    while(len) {
+        size_t avail = sdslen(rdb->iobuf)-rdb->iopos, thislen;
+
+        if(avail == 0) {
+            char buf[REDIS_IOBUF_LEN];
+            ssize_t nread = read(rdb->fd, buf, sizeof(buf));
+
+            if(nread <= 0) return -1;
+            rdb->iobuf = sdsrange(rdb->iobuf, rdb->iopos, -1);
+            rdb->iobuf = sdscatlen(rdb->iobuf, buf, nread);
+            rdb->iopos = 0;
+            continue;
+        }
+        thislen = avail < len ? avail : len;
+        memcpy(p, rdb->iobuf+rdb->iopos, thislen);
+        rdb->iopos += thislen;
+        p = (char*)p+thislen;
+        len -= thislen;
+    }
+    return 0;
+}
+
+static int rdbReadRaw(rdbFile *rdb, void *p, size_t len) {
+    if(rdb->map) {
+        if(rdb->processed + len > rdb->maplen) return -1;
+        memcpy(p, rdb->map + rdb->processed, len);
+    } else if(rdb->fp) {
+        if(len && fread(p, len, 1, rdb->fp) == 0) return -1;
+    } else if(rdbReadFd(rdb, p, len) == -1) {
+        return -1;
+    }
+    rdb->cksum = crc64(rdb->cksum, p, len);
+    rdb->processed += len;
+    return 0;
+}
+
+// mmap only: the next len bytes of the file without copying them
+static const void *rdbReadPtr(rdbFile *rdb, size_t len) {
+    const void *p = rdb->map + rdb->processed;
+
+    if(rdb->processed + len > rdb->maplen) return NULL;
+    rdb->cksum = crc64(rdb->cksum, p, len);
+    rdb->processed += len;
+    return p;
+}
+
+// Lengths come from the file and are only checked against the footer at
+// the end, so nothing read may be larger than what is left of the dump.
+static uint64_t rdbBytesLeft(rdbFile *rdb) {
+    long long size = rdb->map ? (long long)rdb->maplen : rdb->size;
+
+    if(size == 0) return REDIS_RDB_MAX_STRING; // diskless, up to an EOF mark
+    return size > rdb->processed ? size - rdb->processed : 0;
+}
+
+static int rdbSaveType(rdbFile *rdb, unsigned char type) {
+    return rdbWriteRaw(rdb, &type, 1);
+}
+
+static int rdbSaveLen(rdbFile *rdb, uint64_t len) {
+    unsigned char buf[10];
+    int n = 0;
+
+    do {
+        buf[n] = len & 0x7f;
+        len >>= 7;
+        if(len) buf[n] |= 0x80;
+        n++;
+    } while(len);
+    return rdbWriteRaw(rdb, buf, n);
+}
+
+// the string must read back byte for byte: no sign, spaces or zero padding
+static int isStringRepresentableAsLongLong(sds s, long long *value) {
+    char buf[32], *eptr;
+    long long v;
+
+    if(sdslen(s) == 0 || sdslen(s) > 20) return 0;
+    errno = 0;
+    v = strtoll(s, &eptr, 10);
+    if(errno || *eptr != '\0') return 0;
+    snprintf(buf, sizeof(buf), "%lld", v);
+    if(strlen(buf) != sdslen(s) || memcmp(buf, s, sdslen(s)) != 0) return 0;
+    *value = v;
+    return 1;
+}
+
+static int rdbSaveLzfString(rdbFile *rdb, sds s) {
+    size_t len = sdslen(s), comprlen;
+    void *out;
+    int retval = -1;
+
+    // only worth it if it saves at least 4 bytes
+    out = zmalloc(len);
+    comprlen = lzf_compress(s, len, out, len-4);
+    if(comprlen == 0) {
+        zfree(out);
+        return 0;
+    }
+    if(rdbSaveLen(rdb, (comprlen << 2) | REDIS_RDB_ENC_LZF) != -1 &&
+       rdbSaveLen(rdb, len) != -1 &&
+       rdbWriteRaw(rdb, out, comprlen) != -1)
+        retval = 1;
+    zfree(out);
+    return retval;
+}
+
+static int rdbSaveString(rdbFile *rdb, sds s) {
+    size_t len = sdslen(s);
+    long long value;
+
+    if(isStringRepresentableAsLongLong(s, &value)) {
+        uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+
+        if(rdbSaveLen(rdb, REDIS_RDB_ENC_INT) == -1) return -1;
+        return rdbSaveLen(rdb, zigzag);
+    }
+    if(server.rdbcompression && len > REDIS_RDB_COMPRESS_MIN_LEN) {
+        int retval = rdbSaveLzfString(rdb, s);
+
+        if(retval != 0) return (retval == -1) ? -1 : 0;
+    }
+    if(rdbSaveLen(rdb, (len << 2) | REDIS_RDB_ENC_RAW) == -1) return -1;
+    return rdbWriteRaw(rdb, s, len);
+}
+
+static int rdbSaveObject(rdbFile *rdb, robj *o) {
+    if(o->type == REDIS_STRING) {
+        return rdbSaveString(rdb, o->ptr);
+    } else if(o->type == REDIS_LIST) {
+        list *l = o->ptr;
+        listIter *li;
+        listNode *ln;
+
+        if(rdbSaveLen(rdb, listLength(l)) == -1) return -1;
+        li = listGetIter(l, ITER_FORWARD);
+        while((ln = listNextElement(li)) != NULL) {
+            robj *ele = listNodeValue(ln);
+
+            if(rdbSaveString(rdb, ele->ptr) == -1) {
+                listReleaseIter(li);
+                return -1;
+            }
+        }
+        listReleaseIter(li);
+    } else if(o->type == REDIS_SET) {
+        dict *set = o->ptr;
+        dictIterator *di;
+        dictEntry *de;
+
+        if(rdbSaveLen(rdb, set->used) == -1) return -1;
+        di = dictGetIterator(set);
+        while((de = dictNext(di)) != NULL) {
+            robj *ele = dictGetEntryKey(de);
+
+            if(rdbSaveString(rdb, ele->ptr) == -1) {
+                dictReleaseIterator(di);
+                return -1;
+            }
+        }
+        dictReleaseIterator(di);
+    }
+    return 0;
+}
+
+static int rdbLoadType(rdbFile *rdb) {
+    unsigned char type;
+
+    if(rdbReadRaw(rdb, &type, 1) == -1) return -1;
+    return type;
+}
+
+static int rdbLoadLen(rdbFile *rdb, uint64_t *lenp) {
+    uint64_t len = 0;
+    unsigned char byte;
+    int shift = 0;
+
+    do {
+        if(shift > 63 || rdbReadRaw(rdb, &byte, 1) == -1) return -1;
+        len |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while(byte & 0x80);
+    *lenp = len;
+    return 0;
+}
+
+static robj *rdbLoadLzfStringObject(rdbFile *rdb, uint64_t comprlen) {
+    uint64_t len;
+    sds val;
+
+    const void *src;
+    void *in = NULL;
+
+    if(rdbLoadLen(rdb, &len) == -1) return NULL;
+    if(comprlen > rdbBytesLeft(rdb) || len > REDIS_RDB_MAX_STRING) return NULL;
+    if(rdb->map) {
+        if((src = rdbReadPtr(rdb, comprlen)) == NULL) return NULL;
+    } else {
+        in = zmalloc(comprlen);
+        if(rdbReadRaw(rdb, in, comprlen) == -1) {
+            zfree(in);
+            return NULL;
+        }
+        src = in;
+    }
+    val = sdsnewlen(NULL, len);
+    if(lzf_decompress(src, comprlen, val, len) != len) {
+        zfree(in);
+        sdsfree(val);
+        return NULL;
+    }
+    zfree(in);
+    return createObject(REDIS_STRING, val);
+}
+
+static robj *rdbLoadStringObject(rdbFile *rdb) {
+    uint64_t len;
+    sds val;
+
+    if(rdbLoadLen(rdb, &len) == -1) return NULL;
+    if(rdb->version >= 2) {
+        int enctype = len & 3;
+
+        len >>= 2;
+        if(enctype == REDIS_RDB_ENC_INT) {
+            uint64_t zigzag;
+            long long value;
+
+            if(rdbLoadLen(rdb, &zigzag) == -1) return NULL;
+            value = (long long)(zigzag >> 1) ^ -(long long)(zigzag & 1);
+            return createObject(REDIS_STRING, sdscatprintf(sdsempty(), "%lld", value));
+        } else if(enctype == REDIS_RDB_ENC_LZF) {
+            return rdbLoadLzfStringObject(rdb, len);
+        } else if(enctype != REDIS_RDB_ENC_RAW) {
+            return NULL;
+        }
+    }
+    if(len > rdbBytesLeft(rdb)) return NULL;
+    val = sdsnewlen(NULL, len);
+    if(rdbReadRaw(rdb, val, len) == -1) {
+        sdsfree(val);
+        return NULL;
+    }
+    return createObject(REDIS_STRING, val);
+}
+
+static robj *rdbLoadObject(rdbFile *rdb, int type) {
+    robj *o, *ele;
+    uint64_t len;
+
+    if(type == REDIS_STRING)
+        return rdbLoadStringObject(rdb);
+    if(type != REDIS_LIST && type != REDIS_SET) return NULL;
+    if(rdbLoadLen(rdb, &len) == -1) return NULL;
+
+    o = (type == REDIS_LIST) ? createListObject() : createSetObject();
+    while(len--) {
+        if((ele = rdbLoadStringObject(rdb)) == NULL) {
+            decrRefCount(o);
+            return NULL;
+        }
+        if(type == REDIS_LIST) {
+            listNodeAddTail((list*)o->ptr, ele);
+        } else if(dictAdd((dict*)o->ptr, ele, NULL) == DICT_ERR) {
+            decrRefCount(ele);
+        }
+    }
+    return o;
+}
+
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+static long long mstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000 + tv.tv_usec/1000;
+}
+
+static void emptyDb(void) {
+    for(int j = 0; j < server.dbnum; j++) {
+        for(int i = 0; i < server.shards_num; i++)
+            dictEmpty(shardDb(i)[j]);
+    }
+}
+
+// Writes the whole dump, magic to footer, at the current position of fp,
+// or to the slave sockets of a diskless sync. The AOF rewrite child uses
+// it for the preamble and keeps reading the diff from the parent meanwhile.
+static int rdbSaveToFile(rdbFile *rdb, int aofchild) {
+    dictIterator *di;
+    dictEntry *de;
+    char magic[10];
+    unsigned char footer[8];
+    long long keys = 0;
+
+    rdb->map = NULL;
+    rdb->maplen = 0;
+    rdb->version = REDIS_RDB_VERSION;
+    rdb->cksum = 0;
+    rdb->processed = 0;
+
+    snprintf(magic, sizeof(magic), "REDIS%04d", REDIS_RDB_VERSION);
+    if(rdbWriteRaw(rdb, magic, 9) == -1) return REDIS_ERR;
+    for(int j = 0; j < server.dbnum; j++) {
+        unsigned long used = 0;
+
+        // in shard mode a db is the union of the slices of every shard
+        for(int i = 0; i < server.shards_num; i++)
+            used += shardDb(i)[j]->used;
+        if(used == 0) continue;
+        if(rdbSaveType(rdb, REDIS_SELECTDB) == -1) return REDIS_ERR;
+        if(rdbSaveLen(rdb, j) == -1) return REDIS_ERR;
+        if(rdbSaveType(rdb, REDIS_RESIZEDB) == -1) return REDIS_ERR;
+        if(rdbSaveLen(rdb, used) == -1) return REDIS_ERR;
+
+        for(int i = 0; i < server.shards_num; i++) {
+            di = dictGetIterator(shardDb(i)[j]);
+            while((de = dictNext(di)) != NULL) {
+                robj *key = dictGetEntryKey(de);
+                robj *o = dictGetEntryValue(de);
+
+                if(rdbSaveType(rdb, o->type) == -1 ||
+                   rdbSaveString(rdb, key->ptr) == -1 ||
+                   rdbSaveObject(rdb, o) == -1) {
+                    dictReleaseIterator(di);
+                    return REDIS_ERR;
+                }
+                if(aofchild && ++keys % 1024 == 0) aofReadDiffFromParent();
+            }
+            dictReleaseIterator(di);
+        }
+    }
+    if(rdbSaveType(rdb, REDIS_EOF) == -1) return REDIS_ERR;
+
+    for(int j = 0; j < 8; j++)
+        footer[j] = (rdb->cksum >> (j*8)) & 0xff;
+    if(rdbWriteBytes(rdb, footer, 8) == -1) return REDIS_ERR;
+    rdb->processed += 8;
+    return REDIS_OK;
+}
+
+static int saveDb(char *filename) {
+    rdbFile rdb;
+    char tmpfile[256];
+    long long start = mstime(), elapsed;
+
+    snprintf(tmpfile, 256, "temp-%d.rdb", (int) getpid());
+    rdb.fp = fopen(tmpfile, "w");
+    if(!rdb.fp) {
+        redisLog(REDIS_WARNING, "Failed saving the DB: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+    if(rdbSaveToFile(&rdb, 0) == REDIS_ERR) goto werr;
+    if(fflush(rdb.fp) == EOF || fsync(fileno(rdb.fp)) == -1) goto werr;
+    fclose(rdb.fp);
+    rdb.fp = NULL;
+
+    // the rename is atomic, a crash never leaves a half written dump
+    if(rename(tmpfile, filename) == -1) {
+        redisLog(REDIS_WARNING, "Error moving temp DB file on the final destination: %s", strerror(errno));
+        unlink(tmpfile);
+        return REDIS_ERR;
+    }
+    elapsed = mstime() - start;
+    redisLog(REDIS_NOTICE, "DB saved on disk: %lld bytes in %lld ms (%.2f MB/s)",
+        rdb.processed, elapsed,
+        elapsed ? (rdb.processed / (1024.0*1024.0)) / (elapsed / 1000.0) : 0);
+    server.dirty = 0;
+    server.lastsave = time(NULL);
+    return REDIS_OK;
+
+werr:
+    redisLog(REDIS_WARNING, "Write error saving DB on disk: %s", strerror(errno));
+    if(rdb.fp) fclose(rdb.fp);
+    unlink(tmpfile);
+    return REDIS_ERR;
+}
+
+// Fork and save from the child: it sees a frozen copy of the dataset
+// while the kernel shares the pages copy on write with the parent, which
+// keeps serving clients.
+static int saveDbBackground(char *filename) {
+    pid_t childpid;
+    long long start;
+
+    if(server.bgsaveinprogress || server.aofrewritechildpid != -1) return REDIS_ERR;
+    start = ustime();
+    // no shard may be halfway through changing its dicts when they are copied
+    shardsPause();
+    if((childpid = fork()) == 0) {
+        closeListeningSockets();
+        exit(saveDb(filename) == REDIS_OK ? 0 : 1);
+    }
+    shardsResume();
+    latencyAddSampleIfNeeded("fork", (ustime()-start)/1000);
+    if(childpid == -1) {
+        redisLog(REDIS_WARNING, "Can't save in background: fork: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+    redisLog(REDIS_NOTICE, "Background saving started by pid %d", childpid);
+    server.bgsaveinprogress = 1;
+    server.bgsavechildpid = childpid;
+    server.rdb_child_type = REDIS_RDB_CHILD_TYPE_DISK;
+    server.dirty_before_bgsave = server.dirty;
+    return REDIS_OK;
+}
+
+// Loading decodes the file into objects and inserts them in the dicts.
+// With "loading-decode-thread yes" a second thread does the decoding
+// (varints, LZF, building lists and sets) and hands batches of objects
+// to the main thread over a SPSC queue, so both stages run in parallel.
+
+typedef struct rdbLoadBatch {
+    int count;
+    int last; // decoding stopped, 'error' tells why
+    int error;
+    struct {
+        int dbid;
+        robj *key; // NULL: size the db for 'keys' entries
+        robj *val;
+        uint64_t keys;
+    } entries[REDIS_LOAD_BATCH_LEN];
+} rdbLoadBatch;
+
+typedef struct rdbLoader {
+    rdbFile *rdb;
+    spscQueue *q; // NULL when decoding on the main thread
+    rdbLoadBatch *batch;
+    long long decoded; // bytes decoded so far, published by the decoder
+} rdbLoader;
+
+static void loadInsert(int dbid, robj *key, robj *val) {
+    dict *d;
+
+    if(server.shards_num > 1)
+        d = shards[keyShard(key->ptr)].dict[dbid];
+    else
+        d = server.dict[dbid];
+    if(dictAdd(d, key, val) == DICT_ERR) {
+        redisLog(REDIS_WARNING, "Loading DB, duplicated key found! Unrecoverable error, exiting now.");
+        exit(1);
+    }
+    server.loading_loaded_keys++;
+}
+
+// size the tables upfront so that no rehashing happens while loading
+static void loadResizeDb(int dbid, uint64_t keys) {
+    for(int j = 0; j < server.shards_num; j++) {
+        dict *d = (server.shards_num > 1) ? shards[j].dict[dbid] : server.dict[dbid];
+
+        if(d->used == 0 && keys)
+            dictExpand(d, keys/server.shards_num + 1);
+    }
+}
+
+// Every few MB let clients in: INFO answers with the loading progress,
+// everything else gets a -LOADING error.
+static void loadingProgress(long long processed) {
+    server.loading_loaded_bytes = processed;
+    if(processed - server.loading_events_bytes < REDIS_LOADING_EVENTS_BYTES) return;
+    server.loading_events_bytes = processed;
+    aeEventLoopProcess(server.el, AE_FILEEVENT|AE_DONT_WAIT);
+    handleClientsWithPendingWrites();
+}
+
+static void rdbLoadFlushBatch(rdbLoader *l) {
+    __atomic_store_n(&l->decoded, l->rdb->processed, __ATOMIC_RELAXED);
+    while(!spscPush(l->q, l->batch)) sched_yield();
+    l->batch = NULL;
+}
+
+static void rdbLoadEmit(rdbLoader *l, int dbid, robj *key, robj *val, uint64_t keys) {
+    rdbLoadBatch *b;
+
+    if(l->q == NULL) {
+        if(key) loadInsert(dbid, key, val);
+        else loadResizeDb(dbid, keys);
+        loadingProgress(l->rdb->processed);
+        return;
+    }
+    if(l->batch == NULL) {
+        l->batch = zmalloc(sizeof(rdbLoadBatch));
+        l->batch->count = 0;
+        l->batch->last = 0;
+        l->batch->error = 0;
+    }
+    b = l->batch;
+    b->entries[b->count].dbid = dbid;
+    b->entries[b->count].key = key;
+    b->entries[b->count].val = val;
+    b->entries[b->count].keys = keys;
+    if(++b->count == REDIS_LOAD_BATCH_LEN) rdbLoadFlushBatch(l);
+}
+
+// decode everything up to the EOF opcode, then check the footer
+static int rdbLoadEntries(rdbLoader *l) {
+    rdbFile *rdb = l->rdb;
+    uint64_t dbid = 0, keys, expected = 0, cksum;
+    unsigned char footer[8];
+    int type;
+
+    while(1) {
+        robj *key, *o;
+
+        if((type = rdbLoadType(rdb)) == -1) return REDIS_ERR;
+        if(type == REDIS_EOF) break;
+        if(type == REDIS_SELECTDB) {
+            if(rdbLoadLen(rdb, &dbid) == -1) return REDIS_ERR;
+            if(dbid >= (unsigned)server.dbnum) {
+                redisLog(REDIS_WARNING, "FATAL: Data file was created with a Redis server compiled to handle more than %d databases. Exiting\n", server.dbnum);
+                return REDIS_ERR;
+            }
+            continue;
+        }
+        if(type == REDIS_RESIZEDB) {
+            if(rdbLoadLen(rdb, &keys) == -1) return REDIS_ERR;
+            // only a hint, never presize beyond what the rest could hold
+            if(keys > rdbBytesLeft(rdb)/REDIS_RDB_MIN_ENTRY)
+                keys = rdbBytesLeft(rdb)/REDIS_RDB_MIN_ENTRY;
+            rdbLoadEmit(l, dbid, NULL, NULL, keys);
+            continue;
+        }
+        if((key = rdbLoadStringObject(rdb)) == NULL) return REDIS_ERR;
+        if((o = rdbLoadObject(rdb, type)) == NULL) {
+            decrRefCount(key);
+            return REDIS_ERR;
+        }
+        rdbLoadEmit(l, dbid, key, o, 0);
+    }
+
+    // the footer is not part of the checksum
+    cksum = rdb->cksum;
+    if(rdbReadRaw(rdb, footer, 8) == -1) return REDIS_ERR;
+    for(int j = 0; j < 8; j++)
+        expected |= ((uint64_t)footer[j]) << (j*8);
+    if(expected != cksum) {
+        redisLog(REDIS_WARNING, "Wrong DB checksum");
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+static void *rdbDecodeThreadMain(void *arg) {
+    rdbLoader *l = arg;
+    int retval = rdbLoadEntries(l);
+
+    if(l->batch == NULL) {
+        l->batch = zmalloc(sizeof(rdbLoadBatch));
+        l->batch->count = 0;
+    }
+    l->batch->last = 1;
+    l->batch->error = (retval == REDIS_ERR);
+    rdbLoadFlushBatch(l);
+    return NULL;
+}
+
+static int rdbLoadThreaded(rdbLoader *l) {
+    pthread_t tid;
+    int last = 0, error = 0;
+
+    zmalloc_enable_thread_safeness();
+    l->q = spscCreate(REDIS_LOAD_QUEUE_LEN);
+    server.loading_threaded = 1;
+    if(pthread_create(&tid, NULL, rdbDecodeThreadMain, l) != 0) {
+        redisLog(REDIS_WARNING, "Can't start the decode thread, loading on the main thread");
+        server.loading_threaded = 0;
+        zfree(l->q->slots);
+        zfree(l->q);
+        l->q = NULL;
+        return rdbLoadEntries(l);
+    }
+
+    while(!last) {
+        rdbLoadBatch *b = spscPop(l->q);
+
+        if(b == NULL) {
+            loadingProgress(__atomic_load_n(&l->decoded, __ATOMIC_RELAXED));
+            sched_yield();
+            continue;
+        }
+        for(int j = 0; j < b->count; j++) {
+            if(b->entries[j].key)
+                loadInsert(b->entries[j].dbid, b->entries[j].key, b->entries[j].val);
+            else
+                loadResizeDb(b->entries[j].dbid, b->entries[j].keys);
+        }
+        last = b->last;
+        error = b->error;
+        zfree(b);
+        loadingProgress(__atomic_load_n(&l->decoded, __ATOMIC_RELAXED));
+    }
+    pthread_join(tid, NULL);
+    server.loading_threaded = 0;
+    zfree(l->q->slots);
+    zfree(l->q);
+    return error ? REDIS_ERR : REDIS_OK;
+}
+
+// The file is mapped and read front to back with readahead, falling back
+// to stdio with a large buffer when it can't be mapped.
+// checks the signature at the start of rdb and sets its version
+static int rdbLoadMagic(rdbFile *rdb) {
+    char buf[10];
+
+    if(rdbReadRaw(rdb, buf, 9) == -1) return REDIS_ERR;
+    buf[9] = '\0';
+    if(memcmp(buf, "REDIS", 5) != 0) {
+        redisLog(REDIS_WARNING, "Wrong signature trying to load DB from file");
+        return REDIS_ERR;
+    }
+    rdb->version = atoi(buf+5);
+    if(rdb->version < 1 || rdb->version > REDIS_RDB_VERSION) {
+        redisLog(REDIS_WARNING, "Can't handle DB format version %d", rdb->version);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+static void startLoading(long long total_bytes) {
+    server.loading = 1;
+    server.loading_start_time = time(NULL);
+    server.loading_total_bytes = total_bytes;
+    server.loading_loaded_bytes = 0;
+    server.loading_loaded_keys = 0;
+    server.loading_events_bytes = 0;
+}
+
+// everything after the magic, up to and including the footer
+static int rdbLoadPayload(rdbFile *rdb) {
+    rdbLoader l;
+
+    l.rdb = rdb;
+    l.q = NULL;
+    l.batch = NULL;
+    l.decoded = 0;
+    if(server.loading_decode_thread)
+        return rdbLoadThreaded(&l);
+    return rdbLoadEntries(&l);
+}
+
+static int loadDb(char *filename) {
+    rdbFile rdb;
+    struct stat st;
+    void *map = NULL;
+    long long start = mstime(), elapsed;
+    int fd, retval;
+
+    if((fd = open(filename, O_RDONLY)) == -1) return REDIS_ERR;
+    if(fstat(fd, &st) == -1) {
+        close(fd);
+        return REDIS_ERR;
+    }
+    rdb.fp = NULL;
+    rdb.map = NULL;
+    rdb.maplen = 0;
+    rdb.cksum = 0;
+    rdb.processed = 0;
+    rdb.size = st.st_size;
+    if(st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map != NULL && map != MAP_FAILED) {
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        madvise(map, st.st_size, MADV_WILLNEED);
+        rdb.map = map;
+        rdb.maplen = st.st_size;
+        close(fd);
+    } else {
+        map = NULL;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if((rdb.fp = fdopen(fd, "r")) == NULL) {
+            close(fd);
+            return REDIS_ERR;
+        }
+        setvbuf(rdb.fp, NULL, _IOFBF, REDIS_LOADING_BUFLEN);
+    }
+
+    if((retval = rdbLoadMagic(&rdb)) == REDIS_ERR) goto cleanup;
+    startLoading(st.st_size);
+    retval = rdbLoadPayload(&rdb);
+    server.loading = 0;
+    if(retval == REDIS_ERR) {
+        redisLog(REDIS_WARNING, "Short read, corrupted file or OOM loading DB");
+        goto cleanup;
+    }
+
+    elapsed = mstime() - start;
+    redisLog(REDIS_NOTICE, "DB loaded from disk: %lld keys, %lld bytes in %lld ms (%.2f MB/s)",
+        server.loading_loaded_keys, rdb.processed, elapsed,
+        elapsed ? (rdb.processed / (1024.0*1024.0)) / (elapsed / 1000.0) : 0);
+
+cleanup:
+    if(map) munmap(map, st.st_size);
+    if(rdb.fp) fclose(rdb.fp);
+    // the caller tells a missing file (ENOENT) from a bad one
+    if(retval == REDIS_ERR) errno = EINVAL;
+    return retval;
+}
+
+// called by serverCron
+static void checkSaveConditions(void) {
+    time_t now = time(NULL);
+
+    if(server.bgsaveinprogress) {
+        int statloc;
+
+        if(waitpid(server.bgsavechildpid, &statloc, WNOHANG) == 0) return;
+        if(server.rdb_child_type == REDIS_RDB_CHILD_TYPE_SOCKET) {
+            // nothing reached the disk, the save points still apply
+            redisLog(REDIS_NOTICE, "Background transfer of the DB to slaves done");
+        } else if(WIFEXITED(statloc) && WEXITSTATUS(statloc) == 0) {
+            redisLog(REDIS_NOTICE, "Background saving terminated with success");
+            server.dirty = server.dirty - server.dirty_before_bgsave;
+            server.lastsave = now;
+        } else {
+            redisLog(REDIS_WARNING, "Background saving error");
+        }
+        server.bgsaveinprogress = 0;
+        server.bgsavechildpid = -1;
+        updateSlavesWaitingBgsave(WIFEXITED(statloc) && WEXITSTATUS(statloc) == 0);
+        return;
+    }
+    if(server.aofrewritechildpid != -1) {
+        int statloc;
+
+        if(waitpid(server.aofrewritechildpid, &statloc, WNOHANG) != 0)
+            backgroundRewriteDoneHandler(statloc);
+        return;
+    }
+
+    if(server.loading) return;
+    startBgsaveForReplication();
+    if(server.bgsaveinprogress) return;
+    if(server.aof_rewrite_scheduled) {
+        rewriteAppendOnlyFileBackground();
+        return;
+    }
+    if(server.appendonly && server.aof_rewrite_perc &&
+       server.aof_current_size > server.aof_rewrite_min_size) {
+        long long base = server.aof_rewrite_base_size ? server.aof_rewrite_base_size : 1;
+        long long growth = (server.aof_current_size*100/base) - 100;
+
+        if(growth >= server.aof_rewrite_perc) {
+            redisLog(REDIS_NOTICE, "Starting automatic rewriting of the append only file on %lld%% growth", growth);
+            rewriteAppendOnlyFileBackground();
+            return;
+        }
+    }
+    for(int j = 0; j < server.saveparamslen; j++) {
+        struct saveparam *sp = server.saveparams+j;
+
+        if(server.dirty >= sp->changes && now-server.lastsave > sp->seconds) {
+            redisLog(REDIS_NOTICE, "%d changes in %d seconds. Saving...",
+                sp->changes, (int)sp->seconds);
+            saveDbBackground(server.dbfilename);
+            break;
+        }
+    }
+}
+
+static void saveCommand(redisClient *c) {
+    if(server.bgsaveinprogress) {
+        addReplySds(c, sdsnew("-ERR background save in progress\r\n"));
+        return;
+    }
+    if(saveDb(server.dbfilename) == REDIS_OK)
+        addReplySds(c, sdsnew("+OK\r\n"));
+    else
+        addReplySds(c, sdsnew("-ERR\r\n"));
+}
+
+static void bgsaveCommand(redisClient *c) {
+    if(server.bgsaveinprogress) {
+        addReplySds(c, sdsnew("-ERR background save already in progress\r\n"));
+        return;
+    }
+    if(saveDbBackground(server.dbfilename) == REDIS_OK)
+        addReplySds(c, sdsnew("+OK\r\n"));
+    else
+        addReplySds(c, sdsnew("-ERR\r\n"));
+}
+
+static void lastsaveCommand(redisClient *c) {
+    addReplySds(c, sdscatprintf(sdsempty(), "%lu\r\n", (unsigned long)server.lastsave));
+}
+
+static void infoCommand(redisClient *c) {
+    sds info;
+    time_t uptime = time(NULL)-server.stat_starttime;
+    unsigned long lol = 0, totreply = 0;
+    size_t bib = 0, used = zused_memory(), rss = zmalloc_get_rss();
+    listIter *li;
+    listNode *ln;
+
+    if(c->argc == 2 && !strcasecmp(c->argv[1]->ptr, "commandstats")) {
+        info = catCommandStats(sdsempty());
+        addReplySds(c, sdscatprintf(sdsempty(), "$%zu\r\n%s\r\n", sdslen(info), info));
+        sdsfree(info);
+        return;
+    }
+
+    // pending replies, of the clients of this event loop
+    li = listGetIter(currentClients(), ITER_FORWARD);
+    while((ln = listNextElement(li)) != NULL) {
+        redisClient *cl = listNodeValue(ln);
+
+        if((unsigned long)listLength(cl->reply) > lol) lol = listLength(cl->reply);
+        if(cl->reply_bytes > bib) bib = cl->reply_bytes;
+        totreply += cl->reply_bytes;
+    }
+    listReleaseIter(li);
+
+    info = sdscatprintf(sdsempty(),
+        "redis_version:%s\r\n"
+        "multiplexing_api:%s\r\n"
+        "connected_clients:%d\r\n"
+        "role:%s\r\n"
+        "connected_slaves:%d\r\n"
+        "used_memory:%zu\r\n"
+        "used_memory_rss:%zu\r\n"
+        "used_memory_peak:%zu\r\n"
+        "mem_fragmentation_ratio:%.2f\r\n"
+        "active_defrag_running:%d\r\n"
+        "active_defrag_hits:%lld\r\n"
+        "active_defrag_misses:%lld\r\n"
+        "active_defrag_scanned_keys:%lld\r\n"
+        "active_defrag_skipped_keys:%lld\r\n"
+        "changes_since_last_save:%lld\r\n"
+        "bgsave_in_progress:%d\r\n"
+        "last_save_time:%lu\r\n"
+        "total_connections_received:%lld\r\n"
+        "total_commands_processed:%lld\r\n"
+        "uptime_in_seconds:%lu\r\n"
+        "uptime_in_days:%lu\r\n"
+        "loading:%d\r\n"
+        "aof_enabled:%d\r\n"
+        "aof_current_size:%lld\r\n"
+        "aof_buffer_length:%zu\r\n"
+        "aof_pending_fsync:%d\r\n"
+        "aof_rewrite_in_progress:%d\r\n"
+        "aof_rewrite_scheduled:%d\r\n"
+        "aof_base_size:%lld\r\n"
+        "aof_rewrite_buffer_length:%zu\r\n",
+        REDIS_VERSION,
+        aeGetApiName(server.el),
+        listLength(server.clients)-listLength(server.slaves),
+        server.masterhost ? "slave" : "master",
+        listLength(server.slaves),
+        used,
+        rss,
+        server.stat_peak_memory > used ? server.stat_peak_memory : used,
+        used ? (double)rss/used : 0,
+        server.active_defrag_running,
+        server.stat_active_defrag_hits,
+        server.stat_active_defrag_misses,
+        server.stat_active_defrag_scanned,
+        server.stat_active_defrag_skipped,
+        server.dirty,
+        server.bgsaveinprogress,
+        (unsigned long)server.lastsave,
+        server.stat_numconnections,
+        server.stat_numcommands,
+        (unsigned long)uptime,
+        (unsigned long)uptime/(3600*24),
+        server.loading,
+        server.appendonly,
+        server.aof_current_size,
+        sdslen(server.aofbuf),
+        __atomic_load_n(&server.aof_fsync_in_progress, __ATOMIC_RELAXED),
+        server.aofrewritechildpid != -1,
+        server.aof_rewrite_scheduled,
+        server.aof_rewrite_base_size,
+        sdslen(server.aof_rewrite_buf));
+    info = sdscatprintf(info,
+        "master_replid:%s\r\n"
+        "master_repl_offset:%lld\r\n"
+        "repl_backlog_active:%d\r\n"
+        "repl_backlog_size:%lld\r\n"
+        "repl_backlog_first_byte_offset:%lld\r\n"
+        "repl_backlog_histlen:%lld\r\n"
+        "sync_full:%lld\r\n"
+        "sync_partial_ok:%lld\r\n"
+        "zerocopy_sends:%lld\r\n"
+        "zerocopy_copied:%lld\r\n"
+        "client_longest_output_list:%lu\r\n"
+        "client_biggest_output_buffer:%zu\r\n"
+        "mem_clients_output:%lu\r\n"
+        "client_outbuf_limit_disconnections:%lld\r\n",
+        server.replid,
+        server.master_repl_offset,
+        server.repl_backlog != NULL,
+        server.repl_backlog_size,
+        server.repl_backlog ? server.repl_backlog_off : 0,
+        server.repl_backlog_histlen,
+        server.stat_sync_full,
+        server.stat_sync_partial_ok,
+        __atomic_load_n(&server.stat_zerocopy_sends, __ATOMIC_RELAXED),
+        server.stat_zerocopy_copied,
+        lol,
+        bib,
+        totreply,
+        server.stat_client_outbuf_limit_disconnections);
+    if(server.masterhost) {
+        info = sdscatprintf(info,
+            "master_host:%s\r\n"
+            "master_port:%d\r\n"
+            "master_link_status:%s\r\n",
+            server.masterhost,
+            server.masterport,
+            server.replstate == REDIS_REPL_CONNECTED ? "up" : "down");
+    }
+    if(server.loading) {
+        double perc = 0;
+        long long eta = -1;
+        time_t elapsed = time(NULL)-server.loading_start_time;
+
+        if(server.loading_total_bytes)
+            perc = (double)server.loading_loaded_bytes*100/server.loading_total_bytes;
+        // estimated from the average speed so far
+        if(server.loading_loaded_bytes)
+            eta = (long long)elapsed*(server.loading_total_bytes-server.loading_loaded_bytes)/
+                server.loading_loaded_bytes;
+        info = sdscatprintf(info,
+            "loading_start_time:%lu\r\n"
+            "loading_total_bytes:%lld\r\n"
+            "loading_loaded_bytes:%lld\r\n"
+            "loading_loaded_perc:%.2f\r\n"
+            "loading_loaded_keys:%lld\r\n"
+            "loading_eta_seconds:%lld\r\n",
+            (unsigned long)server.loading_start_time,
+            server.loading_total_bytes,
+            server.loading_loaded_bytes,
+            perc,
+            server.loading_loaded_keys,
+            eta);
+    }
+    if(c->argc == 2 && !strcasecmp(c->argv[1]->ptr, "all"))
+        info = catCommandStats(info);
+    addReplySds(c, sdscatprintf(sdsempty(), "$%zu\r\n%s\r\n", sdslen(info), info));
+    sdsfree(info);
+}
+
+// only CONFIG RESETSTAT for now, the config is read from the file
+static void configCommand(redisClient *c) {
+    if(c->argc == 2 && !strcasecmp(c->argv[1]->ptr, "resetstat")) {
+        __atomic_store_n(&server.stat_numcommands, 0, __ATOMIC_RELAXED);
+        server.stat_numconnections = 0;
+        server.stat_sync_full = 0;
+        server.stat_sync_partial_ok = 0;
+        __atomic_store_n(&server.stat_zerocopy_sends, 0, __ATOMIC_RELAXED);
+        server.stat_zerocopy_copied = 0;
+        server.stat_client_outbuf_limit_disconnections = 0;
+        server.stat_active_defrag_hits = 0;
+        server.stat_active_defrag_misses = 0;
+        server.stat_active_defrag_scanned = 0;
+        server.stat_active_defrag_skipped = 0;
+        resetCommandStats();
+        addReplySds(c, sdsnew("+OK\r\n"));
+        return;
+    }
+    addReplySds(c, sdsnew("-ERR CONFIG subcommand must be RESETSTAT\r\n"));
+}
+
+// ============================ append only file =====================
+// Every write command is appended to server.aofbuf in the inline protocol
+// clients use, so the file can be replayed through the command table.
+// beforeSleep writes the buffer once per loop iteration, before any reply
+// goes out. With "appendfsync always" that iteration also shares a single
+// fdatasync, so replies are only sent for commands that are on disk.
+// With "everysec" the fsync runs on a background thread at most once per
+// second, so the loop never blocks on the disk.
+
+static pthread_t aof_fsync_thread;
+static pthread_mutex_t aof_fsync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aof_fsync_cond = PTHREAD_COND_INITIALIZER;
+static int aof_fsync_job = -1; // fd to sync, -1 when there is nothing to do
+static int aof_close_job = -1; // log replaced by a rewrite, closed after the sync
+
+static void *aofFsyncThreadMain(void *arg) {
+    REDIS_NOTUSED(arg);
+
+    while(1) {
+        long long start;
+        int fd, closefd, err = 0;
+
+        pthread_mutex_lock(&aof_fsync_mutex);
+        while(aof_fsync_job == -1 && aof_close_job == -1)
+            pthread_cond_wait(&aof_fsync_cond, &aof_fsync_mutex);
+        fd = aof_fsync_job;
+        closefd = aof_close_job;
+        aof_fsync_job = aof_close_job = -1;
+        pthread_cond_broadcast(&aof_fsync_cond);
+        pthread_mutex_unlock(&aof_fsync_mutex);
+
+        if(fd != -1) {
+            start = ustime();
+            if(fdatasync(fd) == -1) err = errno;
+            latencyAddSampleIfNeeded("aof-fsync-bg", (ustime()-start)/1000);
+            __atomic_store_n(&server.aof_fsync_errno, err, __ATOMIC_RELAXED);
+            __atomic_store_n(&server.aof_fsync_in_progress, 0, __ATOMIC_RELEASE);
+        }
+        // no sync of it can be queued or running any more
+        if(closefd != -1) close(closefd);
+    }
+    return NULL;
+}
+
+static void aofBackgroundFsync(int fd) {
+    __atomic_store_n(&server.aof_fsync_in_progress, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&aof_fsync_mutex);
+    aof_fsync_job = fd;
+    pthread_cond_signal(&aof_fsync_cond);
+    pthread_mutex_unlock(&aof_fsync_mutex);
+}
+
+// the fd may still have a sync queued or running, so the thread closes
+// it once that is done; closing it here could also let the number be
+// reused for another file before fdatasync() gets to it
+static void aofBackgroundClose(int fd) {
+    pthread_mutex_lock(&aof_fsync_mutex);
+    // only when a previous rewrite's close was not picked up yet
+    while(aof_close_job != -1)
+        pthread_cond_wait(&aof_fsync_cond, &aof_fsync_mutex);
+    aof_close_job = fd;
+    pthread_cond_signal(&aof_fsync_cond);
+    pthread_mutex_unlock(&aof_fsync_mutex);
+}
+
+static sds catAppendOnlyCommand(sds buf, struct redisCommand *cmd, robj **argv, int argc) {
+    // the payload of a bulk command is the last argument
+    int inline_argc = (cmd->flags & REDIS_CMD_BULK) ? argc-1 : argc;
+
+    for(int j = 0; j < inline_argc; j++) {
+        if(j) buf = sdscatlen(buf, " ", 1);
+        buf = sdscatlen(buf, argv[j]->ptr, sdslen(argv[j]->ptr));
+    }
+    if(cmd->flags & REDIS_CMD_BULK) {
+        sds payload = argv[argc-1]->ptr;
+        char lenbuf[32];
+        int len = snprintf(lenbuf, sizeof(lenbuf), " %zu\r\n", sdslen(payload));
+
+        buf = sdscatlen(buf, lenbuf, len);
+        buf = sdscatlen(buf, payload, sdslen(payload));
+    }
+    return sdscatlen(buf, "\r\n", 2);
+}
+
+// cmdobj is the command as encoded once by propagate()
+static void feedAppendOnlyFile(int dictid, robj *cmdobj) {
+    robj *objs[2] = {NULL, cmdobj};
+
+    if(dictid != server.appendseldb) {
+        objs[0] = server.selectcmds[dictid];
+        server.appendseldb = dictid;
+    }
+    for(int j = 0; j < 2; j++) {
+        sds buf;
+
+        if(objs[j] == NULL) continue;
+        buf = objs[j]->ptr;
+        server.aofbuf = sdscatlen(server.aofbuf, buf, sdslen(buf));
+        if(server.aofrewritechildpid != -1)
+            server.aof_rewrite_buf = sdscatlen(server.aof_rewrite_buf, buf, sdslen(buf));
+    }
+}
+
+// called from beforeSleep, before replies are written
+static void flushAppendOnlyFile(void) {
+    size_t len = sdslen(server.aofbuf);
+    ssize_t nwritten = 0;
+    time_t now;
+
+    while(len && (size_t)nwritten < len) {
+        ssize_t n = write(server.appendfd, server.aofbuf+nwritten, len-nwritten);
+
+        if(n == -1) {
+            if(errno == EINTR) continue;
+            // the replies about to go out would claim the writes are on disk
+            if(server.appendfsync == REDIS_AOF_FSYNC_ALWAYS) {
+                redisLog(REDIS_WARNING, "Can't write to the append only file with appendfsync always, exiting: %s", strerror(errno));
+                exit(1);
+            }
+            // keep what is left for the next iteration
+            redisLog(REDIS_WARNING, "Error writing to the append only file: %s", strerror(errno));
+            break;
+        }
+        nwritten += n;
+    }
+    if(nwritten) {
+        server.aofbuf = sdsrange(server.aofbuf, nwritten, -1);
+        server.aof_current_size += nwritten;
+    }
+
+    // a background fsync only counts once it returned without error
+    if(server.aof_fsync_pending_size != -1 &&
+       !__atomic_load_n(&server.aof_fsync_in_progress, __ATOMIC_ACQUIRE)) {
+        int err = __atomic_load_n(&server.aof_fsync_errno, __ATOMIC_RELAXED);
+
+        if(err == 0)
+            server.aof_fsynced_size = server.aof_fsync_pending_size;
+        else
+            redisLog(REDIS_WARNING, "Background fsync of the append only file failed: %s", strerror(err));
+        server.aof_fsync_pending_size = -1;
+    }
+
+    if(server.aof_current_size == server.aof_fsynced_size) return;
+    now = time(NULL);
+    if(server.appendfsync == REDIS_AOF_FSYNC_ALWAYS) {
+        // one fsync for every command of this iteration
+        long long start = ustime();
+
+        if(fdatasync(server.appendfd) == -1) {
+            redisLog(REDIS_WARNING, "Can't fsync the append only file with appendfsync always, exiting: %s", strerror(errno));
+            exit(1);
+        }
+        latencyAddSampleIfNeeded("aof-fsync-always", (ustime()-start)/1000);
+        server.aof_fsynced_size = server.aof_current_size;
+        server.aof_last_fsync = now;
+    } else if(server.appendfsync == REDIS_AOF_FSYNC_EVERYSEC &&
+              now > server.aof_last_fsync &&
+              !__atomic_load_n(&server.aof_fsync_in_progress, __ATOMIC_ACQUIRE)) {
+        // a failed one is retried a second later
+        aofBackgroundFsync(server.appendfd);
+        server.aof_fsync_pending_size = server.aof_current_size;
+        server.aof_last_fsync = now;
+    }
+}
+
+static void startAppendOnly(void) {
+    struct stat st;
+
+    server.appendfd = open(server.appendfilename, O_WRONLY|O_APPEND|O_CREAT, 0644);
+    if(server.appendfd == -1) {
+        redisLog(REDIS_WARNING, "Can't open the append only file: %s", strerror(errno));
+        exit(1);
+    }
+    if(fstat(server.appendfd, &st) == 0)
+        server.aof_current_size = st.st_size;
+    server.aof_fsynced_size = server.aof_current_size;
+    server.aof_rewrite_base_size = server.aof_current_size;
+    if(pthread_create(&aof_fsync_thread, NULL, aofFsyncThreadMain, NULL) != 0) {
+        redisLog(REDIS_WARNING, "Can't create the fsync thread");
+        exit(1);
+    }
+}
+
+// BGREWRITEAOF: a child writes the commands that rebuild the keyspace as
+// of the fork into a temp file. Writes done meanwhile are kept in
+// aof_rewrite_buf too, and beforeSleep sends them to the child over a
+// pipe a chunk at a time so it can append them while it runs. When the
+// snapshot is written the child asks the parent to stop sending (ack
+// pipes in both directions), drains the data pipe and exits. The parent
+// then only appends what was never sent, which is little, and renames
+// the file over the old log. With aof-use-rdb-preamble the snapshot part
+// is a dump rather than commands, so a restart loads it at dump speed
+// and only replays the tail.
+
+static int aofCreatePipes(void) {
+    int fds[6] = {-1, -1, -1, -1, -1, -1};
+
+    if(pipe(fds) == -1 || pipe(fds+2) == -1 || pipe(fds+4) == -1) goto err;
+    // the parent must never block on a slow child, nor the child on data
+    if(fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1 ||
+       fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1) goto err;
+    server.aof_pipe_read_data_from_parent = fds[0];
+    server.aof_pipe_write_data_to_child = fds[1];
+    server.aof_pipe_read_ack_from_child = fds[2];
+    server.aof_pipe_write_ack_to_parent = fds[3];
+    server.aof_pipe_read_ack_from_parent = fds[4];
+    server.aof_pipe_write_ack_to_child = fds[5];
+    server.aof_stop_sending_diff = 0;
+    return REDIS_OK;
+
+err:
+    redisLog(REDIS_WARNING, "Error creating the rewrite pipes: %s", strerror(errno));
+    for(int j = 0; j < 6; j++) if(fds[j] != -1) close(fds[j]);
+    return REDIS_ERR;
+}
+
+static void aofClosePipes(void) {
+    aeDeleteFileEvent(server.el, server.aof_pipe_read_ack_from_child, AE_READABLE);
+    close(server.aof_pipe_read_data_from_parent);
+    close(server.aof_pipe_write_data_to_child);
+    close(server.aof_pipe_read_ack_from_child);
+    close(server.aof_pipe_write_ack_to_parent);
+    close(server.aof_pipe_read_ack_from_parent);
+    close(server.aof_pipe_write_ack_to_child);
+}
+
+// the child is done with the snapshot, stop feeding it
+static void aofChildAckHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char byte;
+    REDIS_NOTUSED(privdata);
+    REDIS_NOTUSED(mask);
+
+    if(read(fd, &byte, 1) == 1 && byte == '!') {
+        server.aof_stop_sending_diff = 1;
+        if(write(server.aof_pipe_write_ack_to_child, "!", 1) != 1)
+            redisLog(REDIS_WARNING, "Can't send the ack to the rewrite child");
+    }
+    aeDeleteFileEvent(el, fd, AE_READABLE);
+}
+
+// called from beforeSleep while a rewrite child runs
+static void aofRewriteSendDiff(void) {
+    size_t len = sdslen(server.aof_rewrite_buf);
+    ssize_t n;
+
+    if(server.aof_stop_sending_diff || len == 0) return;
+    if(len > REDIS_AOF_DIFF_CHUNK) len = REDIS_AOF_DIFF_CHUNK;
+    n = write(server.aof_pipe_write_data_to_child, server.aof_rewrite_buf, len);
+    // on EAGAIN the pipe is full, the rest stays buffered until the swap
+    if(n > 0) server.aof_rewrite_buf = sdsrange(server.aof_rewrite_buf, n, -1);
+}
+
+// child side, never blocks
+static void aofReadDiffFromParent(void) {
+    char buf[REDIS_AOF_DIFF_CHUNK];
+    ssize_t n;
+
+    while((n = read(server.aof_pipe_read_data_from_parent, buf, sizeof(buf))) > 0)
+        server.aof_child_diff = sdscatlen(server.aof_child_diff, buf, n);
+}
+
+static int fwriteBulkCommand(FILE *fp, char *name, robj *key, sds payload) {
+    if(fprintf(fp, "%s ", name) < 0 ||
+       fwrite(key->ptr, sdslen(key->ptr), 1, fp) == 0 ||
+       fprintf(fp, " %zu\r\n", sdslen(payload)) < 0 ||
+       (sdslen(payload) && fwrite(payload, sdslen(payload), 1, fp) == 0) ||
+       fwrite("\r\n", 2, 1, fp) == 0) return REDIS_ERR;
+    return REDIS_OK;
+}
+
+// Runs in the child. Lists and sets become one rpush/sadd per element,
+// commands here take a single value.
+static int rewriteAppendOnlyFile(char *filename) {
+    char tmpfile[256];
+    FILE *fp;
+    long long keys = 0, start;
+    char byte;
+    struct pollfd pfd;
+
+    snprintf(tmpfile, sizeof(tmpfile), "temp-rewriteaof-%d.aof", (int)getpid());
+    if((fp = fopen(tmpfile, "w")) == NULL) {
+        redisLog(REDIS_WARNING, "Failed rewriting the append only file: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+    setvbuf(fp, NULL, _IOFBF, REDIS_LOADING_BUFLEN);
+    server.aof_child_diff = sdsempty();
+
+    if(server.aof_use_rdb_preamble) {
+        rdbFile rdb;
+
+        rdb.fp = fp;
+        if(rdbSaveToFile(&rdb, 1) == REDIS_ERR) goto werr;
+        goto snapshotdone;
+    }
+    for(int j = 0; j < server.dbnum; j++) {
+        dict *d = server.dict[j];
+        dictIterator *di;
+        dictEntry *de;
+
+        if(d->used == 0) continue;
+        if(fprintf(fp, "select %d\r\n", j) < 0) goto werr;
+        di = dictGetIterator(d);
+        while((de = dictNext(di)) != NULL) {
+            robj *key = dictGetEntryKey(de);
+            robj *o = dictGetEntryValue(de);
+            int retval = REDIS_OK;
+
+            if(o->type == REDIS_STRING) {
+                retval = fwriteBulkCommand(fp, "set", key, o->ptr);
+            } else if(o->type == REDIS_LIST) {
+                listIter *li = listGetIter(o->ptr, ITER_FORWARD);
+                listNode *ln;
+
+                while(retval == REDIS_OK && (ln = listNextElement(li)) != NULL)
+                    retval = fwriteBulkCommand(fp, "rpush", key, ((robj*)listNodeValue(ln))->ptr);
+                listReleaseIter(li);
+            } else if(o->type == REDIS_SET) {
+                dictIterator *si = dictGetIterator(o->ptr);
+                dictEntry *se;
+
+                while(retval == REDIS_OK && (se = dictNext(si)) != NULL)
+                    retval = fwriteBulkCommand(fp, "sadd", key, ((robj*)dictGetEntryKey(se))->ptr);
+                dictReleaseIterator(si);
+            }
+            if(retval == REDIS_ERR) {
+                dictReleaseIterator(di);
+                goto werr;
+            }
+            // keep the pipe from filling up while the snapshot is written
+            if(++keys % 1024 == 0) aofReadDiffFromParent();
+        }
+        dictReleaseIterator(di);
+    }
+snapshotdone:
+    if(fflush(fp) == EOF) goto werr;
+
+    // take what keeps coming for up to a second, stopping early once
+    // the parent has had nothing to send for a while
+    start = mstime();
+    pfd.fd = server.aof_pipe_read_data_from_parent;
+    pfd.events = POLLIN;
+    for(int idle = 0; idle < 20 && mstime()-start < 1000; ) {
+        if(poll(&pfd, 1, 1) == 1) {
+            aofReadDiffFromParent();
+            idle = 0;
+        } else {
+            idle++;
+        }
+    }
+    // ask the parent to stop, after its ack everything sent is in the pipe
+    if(write(server.aof_pipe_write_ack_to_parent, "!", 1) != 1) goto werr;
+    pfd.fd = server.aof_pipe_read_ack_from_parent;
+    if(poll(&pfd, 1, 5000) != 1 ||
+       read(server.aof_pipe_read_ack_from_parent, &byte, 1) != 1 || byte != '!') {
+        redisLog(REDIS_WARNING, "Parent did not ack the end of the rewrite");
+        goto werr2;
+    }
+    aofReadDiffFromParent();
+    redisLog(REDIS_NOTICE, "Rewrite child appends %zu bytes written during the rewrite", sdslen(server.aof_child_diff));
+    if(sdslen(server.aof_child_diff) &&
+       fwrite(server.aof_child_diff, sdslen(server.aof_child_diff), 1, fp) == 0) goto werr;
+
+    if(fflush(fp) == EOF || fsync(fileno(fp)) == -1) goto werr;
+    fclose(fp);
+    fp = NULL;
+    // the parent picks the file up under the name it knows
+    if(rename(tmpfile, filename) == -1) goto werr;
+    return REDIS_OK;
+
+werr:
+    redisLog(REDIS_WARNING, "Write error writing the rewritten append only file: %s", strerror(errno));
+werr2:
+    if(fp) fclose(fp);
+    unlink(tmpfile);
+    return REDIS_ERR;
+}
+
+static int rewriteAppendOnlyFileBackground(void) {
+    pid_t childpid;
+    long long start;
+
+    if(server.aofrewritechildpid != -1 || server.bgsaveinprogress) return REDIS_ERR;
+    if(aofCreatePipes() == REDIS_ERR) return REDIS_ERR;
+    start = ustime();
+    if((childpid = fork()) == 0) {
+        char tmpfile[256];
+
+        closeListeningSockets();
+        snprintf(tmpfile, sizeof(tmpfile), "temp-rewriteaof-bg-%d.aof", (int)getppid());
+        exit(rewriteAppendOnlyFile(tmpfile) == REDIS_OK ? 0 : 1);
+    }
+    latencyAddSampleIfNeeded("fork", (ustime()-start)/1000);
+    if(childpid == -1) {
+        redisLog(REDIS_WARNING, "Can't rewrite the append only file in background: fork: %s", strerror(errno));
+        aofClosePipes();
+        return REDIS_ERR;
+    }
+    redisLog(REDIS_NOTICE, "Background append only file rewriting started by pid %d", childpid);
+    createFileEvent(server.el, server.aof_pipe_read_ack_from_child, AE_READABLE, aofChildAckHandler, NULL);
+    server.aofrewritechildpid = childpid;
+    server.aof_rewrite_scheduled = 0;
+    // from here on the log and the diff both start with a SELECT
+    server.appendseldb = -1;
+    return REDIS_OK;
+}
+
+// called by serverCron once the rewrite child exited
+static void backgroundRewriteDoneHandler(int statloc) {
+    char tmpfile[256];
+    struct stat st;
+    int newfd = -1;
+    size_t len, nwritten = 0;
+
+    snprintf(tmpfile, sizeof(tmpfile), "temp-rewriteaof-bg-%d.aof", (int)getpid());
+    if(!WIFEXITED(statloc) || WEXITSTATUS(statloc) != 0) {
+        redisLog(REDIS_WARNING, "Background append only file rewriting error");
+        goto cleanup;
+    }
+    if((newfd = open(tmpfile, O_WRONLY|O_APPEND)) == -1) {
+        redisLog(REDIS_WARNING, "Can't open the rewritten append only file: %s", strerror(errno));
+        goto cleanup;
+    }
+    // what the child never got, usually nothing or a few commands
+    len = sdslen(server.aof_rewrite_buf);
+    while(nwritten < len) {
+        ssize_t n = write(newfd, server.aof_rewrite_buf+nwritten, len-nwritten);
+
+        if(n == -1) {
+            if(errno == EINTR) continue;
+            redisLog(REDIS_WARNING, "Error finishing the rewritten append only file: %s", strerror(errno));
+            goto cleanup;
+        }
+        nwritten += n;
+    }
+    // the old file stays the log unless the new one is on disk
+    if(server.appendfsync != REDIS_AOF_FSYNC_NO && fdatasync(newfd) == -1) {
+        redisLog(REDIS_WARNING, "Can't fsync the rewritten append only file: %s", strerror(errno));
+        goto cleanup;
+    }
+    if(rename(tmpfile, server.appendfilename) == -1) {
+        redisLog(REDIS_WARNING, "Can't rename the rewritten append only file: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    if(server.appendonly) {
+        int oldfd = server.appendfd;
+
+        server.appendfd = newfd;
+        newfd = -1;
+        if(fstat(server.appendfd, &st) == 0)
+            server.aof_current_size = st.st_size;
+        server.aof_fsynced_size = server.aof_current_size;
+        server.aof_fsync_pending_size = -1;
+        server.aof_rewrite_base_size = server.aof_current_size;
+        // its commands went to the new file through the rewrite buffer
+        server.aofbuf = sdsrange(server.aofbuf, sdslen(server.aofbuf), -1);
+        aofBackgroundClose(oldfd);
+    }
+    redisLog(REDIS_NOTICE, "Background append only file rewriting terminated with success (%zu bytes appended by the parent)", len);
+
+cleanup:
+    if(newfd != -1) close(newfd);
+    unlink(tmpfile);
+    aofClosePipes();
+    server.aof_rewrite_buf = sdsrange(server.aof_rewrite_buf, sdslen(server.aof_rewrite_buf), -1);
+    server.aofrewritechildpid = -1;
+}
+
+static void bgrewriteaofCommand(redisClient *c) {
+    if(server.aofrewritechildpid != -1) {
+        addReplySds(c, sdsnew("-ERR background append only file rewriting already in progress\r\n"));
+        return;
+    }
+    if(server.bgsaveinprogress) {
+        // started by the cron once the save is done
+        server.aof_rewrite_scheduled = 1;
+        addReplySds(c, sdsnew("+Background append only file rewriting scheduled\r\n"));
+        return;
+    }
+    if(rewriteAppendOnlyFileBackground() == REDIS_OK)
+        addReplySds(c, sdsnew("+Background append only file rewriting started\r\n"));
+    else
+        addReplySds(c, sdsnew("-ERR\r\n"));
+}
+
+// Replays the log through a client that has no connection. Returns
+// REDIS_ERR only when the file does not exist.
+static int loadAppendOnlyFile(char *filename) {
+    redisClient *fake;
+    FILE *fp = fopen(filename, "r");
+    char buf[REDIS_AOF_LINE_MAX+1];
+    struct stat st;
+    long long start = mstime(), elapsed, processed = 0, commands = 0;
+    listNode *ln;
+
+    if(fp == NULL) return REDIS_ERR;
+    if(fstat(fileno(fp), &st) == -1) st.st_size = 0;
+    setvbuf(fp, NULL, _IOFBF, REDIS_LOADING_BUFLEN);
+    fake = createFakeClient(REDIS_AOF_CLIENT);
+    selectDb(fake, 0);
+    startLoading(st.st_size);
+
+    // a rewritten log may start with a dump, the commands follow it
+    if(fread(buf, 5, 1, fp) == 1 && memcmp(buf, "REDIS", 5) == 0) {
+        rdbFile rdb;
+
+        rewind(fp);
+        rdb.fp = fp;
+        rdb.map = NULL;
+        rdb.maplen = 0;
+        rdb.cksum = 0;
+        rdb.processed = 0;
+        rdb.size = st.st_size;
+        if(rdbLoadMagic(&rdb) == REDIS_ERR || rdbLoadPayload(&rdb) == REDIS_ERR) {
+            redisLog(REDIS_WARNING, "Bad dump preamble in the append only file. Unrecoverable error, exiting now.");
+            exit(1);
+        }
+        processed = rdb.processed;
+        redisLog(REDIS_NOTICE, "Loaded a %lld keys preamble from the append only file in %lld ms",
+            server.loading_loaded_keys, mstime()-start);
+    } else {
+        rewind(fp);
+    }
+    while(fgets(buf, sizeof(buf), fp) != NULL) {
+        struct redisCommand *cmd;
+        size_t len = strlen(buf);
+        sds *argv;
+        int argc;
+
+        processed += len;
+        if(len == 0 || buf[len-1] != '\n') goto readerr;
+        while(len && (buf[len-1] == '\n' || buf[len-1] == '\r')) buf[--len] = '\0';
+        if(len == 0) continue;
+
+        argv = sdssplitlen(buf, len, " ", 1, &argc);
+        for(int j = 0; j < argc; j++) {
+            if(sdslen(argv[j]) && fake->argc < REDIS_MAX_ARGS)
+                fake->argv[fake->argc++] = createObject(REDIS_STRING, argv[j]);
+            else
+                sdsfree(argv[j]);
+        }
+        zfree(argv);
+        if(fake->argc == 0) continue;
+
+        cmd = lookupCommand(fake->argv[0]->ptr);
+        if(!cmd) {
+            redisLog(REDIS_WARNING, "Unknown command '%s' reading the append only file", (char*)fake->argv[0]->ptr);
+            exit(1);
+        }
+        if(cmd->flags & REDIS_CMD_BULK) {
+            int bulklen = atoi(fake->argv[fake->argc-1]->ptr);
+            sds payload;
+
+            if(bulklen < 0) goto readerr;
+            payload = sdsnewlen(NULL, bulklen);
+            if((bulklen && fread(payload, bulklen, 1, fp) == 0) ||
+               fread(buf, 2, 1, fp) == 0) {
+                sdsfree(payload);
+                goto readerr;
+            }
+            processed += bulklen+2;
+            decrRefCount(fake->argv[fake->argc-1]);
+            fake->argv[fake->argc-1] = createObject(REDIS_STRING, payload);
+        }
+
+        cmd->proc(fake);
+        while((ln = listFirst(fake->reply)) != NULL)
+            listDelNode(fake->reply, ln);
+        fake->reply_bytes = 0;
+        freeClientArgv(fake);
+        commands++;
+        loadingProgress(processed);
+    }
+    if(ferror(fp)) goto readerr;
+    server.loading = 0;
+
+    fclose(fp);
+    freeClientArgv(fake);
+    listRelease(fake->reply);
+    sdsfree(fake->querybuf);
+    zfree(fake);
+    elapsed = mstime() - start;
+    redisLog(REDIS_NOTICE, "DB loaded from append only file: %lld keys from the preamble, %lld commands, %lld bytes in %lld ms",
+        server.loading_loaded_keys, commands, processed, elapsed);
+    return REDIS_OK;
+
+readerr:
+    redisLog(REDIS_WARNING, "Unexpected end of the append only file at byte %lld, the last command was truncated. Unrecoverable error, exiting now.", processed);
+    exit(1);
+}
+
+// ============================ replication =====================
+// Write commands are encoded into one replication stream. The stream goes
+// to the online slaves and into the backlog, a fixed size ring. A random
+// replication ID names the stream, and master_repl_offset counts its
+// bytes; the first byte is offset 1. A slave that lost its link sends
+// "psync <replid> <offset>", where offset is the first byte it is missing.
+// If the ID matches and that byte is still in the backlog, the slave gets
+// +CONTINUE followed by the missing range. Otherwise it gets
+// "+FULLRESYNC <replid> <offset>", then a dump taken at that offset, then
+// the stream from there on.
+
+static void createReplicationBacklog(void) {
+    server.repl_backlog = zmalloc(server.repl_backlog_size);
+    server.repl_backlog_histlen = 0;
+    server.repl_backlog_idx = 0;
+    // the next byte fed is the first one in the backlog
+    server.repl_backlog_off = server.master_repl_offset+1;
+}
+
+static void feedReplicationBacklog(char *p, size_t len) {
+    server.master_repl_offset += len;
+    while(len) {
+        size_t thislen = server.repl_backlog_size - server.repl_backlog_idx;
+
+        if(thislen > len) thislen = len;
+        memcpy(server.repl_backlog+server.repl_backlog_idx, p, thislen);
+        server.repl_backlog_idx += thislen;
+        if(server.repl_backlog_idx == server.repl_backlog_size)
+            server.repl_backlog_idx = 0;
+        server.repl_backlog_histlen += thislen;
+        len -= thislen;
+        p += thislen;
+    }
+    if(server.repl_backlog_histlen > server.repl_backlog_size)
+        server.repl_backlog_histlen = server.repl_backlog_size;
+    server.repl_backlog_off = server.master_repl_offset-server.repl_backlog_histlen+1;
+}
+
+// queue the backlog from offset to its end
+static void addReplyReplicationBacklog(redisClient *c, long long offset) {
+    long long size = server.repl_backlog_size;
+    long long skip = offset-server.repl_backlog_off;
+    long long len = server.repl_backlog_histlen-skip;
+    long long j;
+
+    // index of the oldest byte, then of the first one to send
+    j = (server.repl_backlog_idx+size-server.repl_backlog_histlen) % size;
+    j = (j+skip) % size;
+    while(len > 0) {
+        long long thislen = size-j;
+
+        if(thislen > len) thislen = len;
+        addReplySds(c, sdsnewlen(server.repl_backlog+j, thislen));
+        len -= thislen;
+        j = 0;
+    }
+}
+
+// The command is encoded once by propagate() and every slave gets a
+// reference to the same object, SELECT included, so the fan out is a list
+// append per slave. The backlog keeps its own copy of the bytes.
+static void replicationFeedSlaves(int dictid, robj *cmdobj) {
+    listIter *li;
+    listNode *ln;
+    robj *selectcmd = NULL;
+
+    if(dictid != server.slaveseldb) {
+        selectcmd = server.selectcmds[dictid];
+        server.slaveseldb = dictid;
+        if(server.repl_backlog)
+            feedReplicationBacklog(selectcmd->ptr, sdslen(selectcmd->ptr));
+    }
+    if(server.repl_backlog) feedReplicationBacklog(cmdobj->ptr, sdslen(cmdobj->ptr));
+
+    li = listGetIter(server.slaves, ITER_FORWARD);
+    while((ln = listNextElement(li)) != NULL) {
+        redisClient *slave = listNodeValue(ln);
+
+        // its stream starts at the fork that has not happened yet
+        if(slave->replstate == REDIS_REPL_WAIT_BGSAVE_START) continue;
+        if(selectcmd) addReply(slave, selectcmd);
+        addReply(slave, cmdobj);
+    }
+    listReleaseIter(li);
+}
+
+static int sendFullResync(redisClient *slave) {
+    char buf[128];
+    int len;
+
+    // written directly, the output list is held until the dump is sent
+    len = snprintf(buf, sizeof(buf), "+FULLRESYNC %s %lld\r\n", server.replid, server.master_repl_offset);
+    if(write(slave->fd, buf, len) != len) {
+        redisLog(REDIS_WARNING, "Can't send +FULLRESYNC to a slave");
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+// Diskless: fork a child that writes the dump straight to the sockets of
+// the waiting slaves. The size is not known upfront, so the dump is
+// framed as "$EOF:<mark>\r\n" <dump> <mark> with a random 40 bytes mark.
+// The child tells the parent over a pipe which slaves got all of it.
+static int rdbSaveToSlavesSockets(void) {
+    int pipefds[2], numfds = 0, *fds;
+    char mark[REDIS_RDB_EOF_MARK_SIZE];
+    listIter *li;
+    listNode *ln;
+    pid_t childpid;
+    long long start;
+
+    if(pipe(pipefds) == -1) {
+        redisLog(REDIS_WARNING, "Can't create the pipe for a diskless sync: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+    getRandomHexChars(mark, sizeof(mark));
+    fds = zmalloc(sizeof(int)*listLength(server.slaves));
+    li = listGetIter(server.slaves, ITER_FORWARD);
+    while((ln = listNextElement(li)) != NULL) {
+        redisClient *slave = listNodeValue(ln);
+
+        if(slave->replstate != REDIS_REPL_WAIT_BGSAVE_START) continue;
+        // before the fork, the child writes right after it
+        if(sendFullResync(slave) == REDIS_ERR) {
+            freeClient(slave);
+            continue;
+        }
+        fds[numfds++] = slave->fd;
+    }
+    listReleaseIter(li);
+
+    start = ustime();
+    if((childpid = fork()) == 0) {
+        rdbFile rdb;
+        int *results, ok;
+
+        closeListeningSockets();
+        close(pipefds[0]);
+        memset(&rdb, 0, sizeof(rdb));
+        rdb.fds = fds;
+        rdb.numfds = numfds;
+        rdb.fderr = zmalloc(sizeof(int)*numfds);
+        memset(rdb.fderr, 0, sizeof(int)*numfds);
+        rdb.fd = -1;
+        rdb.iobuf = sdscatprintf(sdsempty(), "$EOF:%.*s\r\n", REDIS_RDB_EOF_MARK_SIZE, mark);
+        ok = rdbSaveToFile(&rdb, 0) == REDIS_OK &&
+             rdbWriteBytes(&rdb, mark, sizeof(mark)) != -1 &&
+             rdbFlushFds(&rdb) != -1;
+
+        // fd and errno of every slave, 0 when it got the whole dump
+        results = zmalloc(sizeof(int)*2*numfds);
+        for(int j = 0; j < numfds; j++) {
+            results[j*2] = fds[j];
+            results[j*2+1] = rdb.fderr[j] ? rdb.fderr[j] : (ok ? 0 : EIO);
+        }
+        if(anetWrite(pipefds[1], (char*)results, sizeof(int)*2*numfds) != (int)(sizeof(int)*2*numfds))
+            ok = 0;
+        exit(ok ? 0 : 1);
+    }
+    latencyAddSampleIfNeeded("fork", (ustime()-start)/1000);
+    zfree(fds);
+    close(pipefds[1]);
+    if(childpid == -1) {
+        redisLog(REDIS_WARNING, "Can't start the diskless sync: fork: %s", strerror(errno));
+        close(pipefds[0]);
+        return REDIS_ERR;
+    }
+    redisLog(REDIS_NOTICE, "Starting BGSAVE for SYNC with target: %d slaves sockets, pid %d", numfds, childpid);
+    server.bgsaveinprogress = 1;
+    server.bgsavechildpid = childpid;
+    server.rdb_child_type = REDIS_RDB_CHILD_TYPE_SOCKET;
+    server.rdb_pipe_read_result = pipefds[0];
+    return REDIS_OK;
+}
+
+// Fork a save for the slaves waiting for one. The dump covers the stream
+// up to master_repl_offset and everything after it goes to their output
+// lists, which are held back until the dump is sent. A diskless sync waits
+// repl-diskless-sync-delay seconds after the first slave so that the ones
+// arriving meanwhile share the same child.
+static void startBgsaveForReplication(void) {
+    listIter *li;
+    listNode *ln;
+    time_t now = time(NULL);
+    int waiting = 0, maxidle = 0, diskless = server.repl_diskless_sync, retval;
+
+    if(server.bgsaveinprogress || server.aofrewritechildpid != -1) return;
+    li = listGetIter(server.slaves, ITER_FORWARD);
+    while((ln = listNextElement(li)) != NULL) {
+        redisClient *slave = listNodeValue(ln);
+
+        if(slave->replstate != REDIS_REPL_WAIT_BGSAVE_START) continue;
+        waiting++;
+        if(now-slave->lastinteraction > maxidle) maxidle = now-slave->lastinteraction;
+        // SYNC only understands a dump with its length upfront
+        if(slave->flags & REDIS_PRE_PSYNC) diskless = 0;
+    }
+    listReleaseIter(li);
+    if(waiting == 0) return;
+    if(diskless && maxidle < server.repl_diskless_sync_delay) return;
+
+    if(diskless)
+        retval = rdbSaveToSlavesSockets();
+    else
+        retval = saveDbBackground(server.dbfilename);
+    if(retval == REDIS_ERR) {
+        li = listGetIter(server.slaves, ITER_FORWARD);
+        while((ln = listNextElement(li)) != NULL) {
+            redisClient *slave = listNodeValue(ln);
+
+            if(slave->replstate != REDIS_REPL_WAIT_BGSAVE_START) continue;
+            redisLog(REDIS_WARNING, "Can't start the BGSAVE for a slave, dropping it");
+            freeClient(slave);
+        }
+        listReleaseIter(li);
+        return;
+    }
+    // the stream after the dump must say which db it works on
+    server.slaveseldb = -1;
+    li = listGetIter(server.slaves, ITER_FORWARD);
+    while((ln = listNextElement(li)) != NULL) {
+        redisClient *slave = listNodeValue(ln);
+
+        if(slave->replstate != REDIS_REPL_WAIT_BGSAVE_START) continue;
+        slave->replstate = REDIS_REPL_WAIT_BGSAVE_END;
+        if(diskless || (slave->flags & REDIS_PRE_PSYNC)) continue;
+        if(sendFullResync(slave) == REDIS_ERR) freeClient(slave);
+    }
+    listReleaseIter(li);
+}
+
+// the dump is there, release what the stream queued meanwhile
+static void putSlaveOnline(redisClient *slave) {
+    slave->replstate = REDIS_REPL_ONLINE;
+    if(listLength(slave->reply) && !(slave->flags & REDIS_PENDING_WRITE)) {
+        slave->flags |= REDIS_PENDING_WRITE;
+        listNodeAddTail(server.clients_pending_write, slave);
+    }
+    redisLog(REDIS_NOTICE, "Synchronization with slave succeeded");
+}
+
+// The dump goes from the page cache to the socket with sendfile(), no
+// copy through user space.
+static void sendBulkToSlave(aeEventLoop *el, int fd, void *privdata, int mask) {
+    redisClient *slave = privdata;
+    ssize_t nread = 1, nwritten;
+    REDIS_NOTUSED(mask);
+
+    if(slave->replpreamble) {
+        nwritten = write(fd, slave->replpreamble, sdslen(slave->replpreamble));
+        if(nwritten == -1) {
+            if(errno == EAGAIN) return;
+            goto err;
+        }
+        slave->replpreamble = sdsrange(slave->replpreamble, nwritten, -1);
+        if(sdslen(slave->replpreamble) == 0) {
+            sdsfree(slave->replpreamble);
+            slave->replpreamble = NULL;
+        }
+        return;
+    }
+
+# ifdef __linux__
+    off_t off = slave->repldboff;
+
+    nwritten = sendfile(fd, slave->repldbfd, &off, slave->repldbsize-slave->repldboff);
+    if(nwritten == -1) {
+        if(errno == EAGAIN) return;
+        goto err;
+    }
+    // the file shrank under us
+    if(nwritten == 0) {
+        nread = 0;
+        goto err;
+    }
+# else
+    char buf[REDIS_IOBUF_LEN];
+
+    nread = pread(slave->repldbfd, buf, sizeof(buf), slave->repldboff);
+    if(nread <= 0) goto err;
+    nwritten = write(fd, buf, nread);
+    if(nwritten == -1) {
+        if(errno == EAGAIN) return;
+        goto err;
+    }
+# endif
+    slave->repldboff += nwritten;
+    if(slave->repldboff < slave->repldbsize) return;
+
+    close(slave->repldbfd);
+    slave->repldbfd = -1;
+    aeDeleteFileEvent(el, fd, AE_WRITABLE);
+    putSlaveOnline(slave);
+    return;
+
+err:
+    redisLog(REDIS_WARNING, "Sending the DB to a slave: %s", nread <= 0 ? "read error" : strerror(errno));
+    freeClient(slave);
+}
+
+// called once the BGSAVE the waiting slaves need is done
+static void updateSlavesWaitingBgsave(int ok) {
+    listIter *li;
+    listNode *ln;
+    int *results = NULL, nresults = 0;
+
+    if(server.rdb_child_type == REDIS_RDB_CHILD_TYPE_SOCKET) {
+        size_t size = sizeof(int)*2*listLength(server.slaves);
+
+        results = zmalloc(size ? size : 1);
+        nresults = anetRead(server.rdb_pipe_read_result, (char*)results, size);
+        nresults = (nresults > 0) ? nresults/(sizeof(int)*2) : 0;
+        close(server.rdb_pipe_read_result);
+        server.rdb_pipe_read_result = -1;
+    }
+    li = listGetIter(server.slaves, ITER_FORWARD);
+    while((ln = listNextElement(li)) != NULL) {
+        redisClient *slave = listNodeValue(ln);
+        struct stat st;
+
+        if(slave->replstate != REDIS_REPL_WAIT_BGSAVE_END) continue;
+        if(results) {
+            int err = EIO;
+
+            for(int j = 0; j < nresults; j++)
+                if(results[j*2] == slave->fd) err = results[j*2+1];
+            if(err) {
+                redisLog(REDIS_WARNING, "Diskless sync with a slave failed: %s", strerror(err));
+                freeClient(slave);
+            } else {
+                putSlaveOnline(slave);
+            }
+            continue;
+        }
+        if(!ok) {
+            redisLog(REDIS_WARNING, "SYNC failed. BGSAVE child returned an error");
+            freeClient(slave);
+            continue;
+        }
+        if((slave->repldbfd = open(server.dbfilename, O_RDONLY)) == -1 ||
+           fstat(slave->repldbfd, &st) == -1) {
+            redisLog(REDIS_WARNING, "SYNC failed. Can't open/stat DB after BGSAVE: %s", strerror(errno));
+            freeClient(slave);
+            continue;
+        }
+        slave->repldboff = 0;
+        slave->repldbsize = st.st_size;
+        slave->replpreamble = sdscatprintf(sdsempty(), "$%lld\r\n", (long long)st.st_size);
+        slave->replstate = REDIS_REPL_SEND_BULK;
+        createFileEvent(server.el, slave->fd, AE_WRITABLE, sendBulkToSlave, slave);
+    }
+    listReleaseIter(li);
+    zfree(results);
+}
+
+// Returns REDIS_OK when the slave can continue from the backlog.
+static int tryPartialResync(redisClient *c) {
+    long long offset;
+
+    if(strcasecmp(c->argv[1]->ptr, server.replid) != 0) return REDIS_ERR;
+    offset = strtoll(c->argv[2]->ptr, NULL, 10);
+    if(server.repl_backlog == NULL || offset < server.repl_backlog_off ||
+       offset > server.repl_backlog_off+server.repl_backlog_histlen) {
+        redisLog(REDIS_NOTICE, "Unable to partial resync with a slave for lack of backlog (offset %lld)", offset);
+        return REDIS_ERR;
+    }
+    c->flags |= REDIS_SLAVE;
+    c->replstate = REDIS_REPL_ONLINE;
+    listNodeAddTail(server.slaves, c);
+    addReplySds(c, sdsnew("+CONTINUE\r\n"));
+    addReplyReplicationBacklog(c, offset);
+    redisLog(REDIS_NOTICE, "Partial resynchronization accepted, sending %lld bytes of backlog",
+        server.master_repl_offset-offset+1);
+    return REDIS_OK;
+}
+
+// SYNC, and PSYNC <replid> <offset>
+static void syncCommand(redisClient *c) {
+    int psync = !strcasecmp(c->argv[0]->ptr, "psync");
+
+    if(c->flags & REDIS_SLAVE) return;
+    // no chained slaves, their offsets would not match ours
+    if(server.masterhost) {
+        addReplySds(c, sdsnew("-ERR can't SYNC with a slave\r\n"));
+        return;
+    }
+    if(listLength(c->reply)) {
+        addReplySds(c, sdsnew("-ERR SYNC is invalid with pending input\r\n"));
+        return;
+    }
+    if(psync && tryPartialResync(c) == REDIS_OK) {
+        server.stat_sync_partial_ok++;
+        return;
+    }
+
+    redisLog(REDIS_NOTICE, "Slave asks for a full synchronization");
+    server.stat_sync_full++;
+    if(server.repl_backlog == NULL) createReplicationBacklog();
+    c->flags |= REDIS_SLAVE;
+    if(!psync) c->flags |= REDIS_PRE_PSYNC;
+    c->replstate = REDIS_REPL_WAIT_BGSAVE_START;
+    listNodeAddTail(server.slaves, c);
+    startBgsaveForReplication();
+}
+
+// slave side: read a line with a timeout, without the CRLF
+static int syncReadLine(int fd, char *buf, int size) {
+    int len = 0;
+
+    while(len < size-1) {
+        if(read(fd, buf+len, 1) != 1) return -1;
+        if(buf[len] == '\n') {
+            if(len && buf[len-1] == '\r') len--;
+            buf[len] = '\0';
+            return len;
+        }
+        len++;
+    }
+    return -1;
+}
+
+// Reads the dump of a full resync to a temp file, renames it over the DB
+// file and loads it. With an EOF mark, what follows the mark in the last
+// read is the start of the stream and is returned in leftover.
+static int readSyncBulkToDisk(int fd, long long dumpsize, char *eofmark, sds *leftover) {
+    char tmpfile[256], iobuf[REDIS_IOBUF_LEN];
+    sds tail = sdsempty();
+    long long left = dumpsize;
+    int dfd, done = 0;
+
+    snprintf(tmpfile, sizeof(tmpfile), "temp-%d.%ld.rdb", (int)getpid(), (long)time(NULL));
+    if((dfd = open(tmpfile, O_CREAT|O_WRONLY|O_TRUNC, 0644)) == -1) {
+        redisLog(REDIS_WARNING, "Opening the temp file needed for MASTER <-> SLAVE synchronization: %s", strerror(errno));
+        sdsfree(tail);
+        return REDIS_ERR;
+    }
+    while(!done) {
+        size_t readlen = sizeof(iobuf), wlen;
+        int nread;
+
+        if(!eofmark && left < (long long)readlen) readlen = left;
+        nread = read(fd, iobuf, readlen);
+        if(nread <= 0) {
+            redisLog(REDIS_WARNING, "I/O error trying to sync with MASTER: %s",
+                nread == 0 ? "connection lost" : strerror(errno));
+            goto err;
+        }
+        if(eofmark) {
+            // the mark may be split across reads, keep its possible start
+            size_t taillen, keep;
+
+            tail = sdscatlen(tail, iobuf, nread);
+            taillen = sdslen(tail);
+            for(wlen = 0; wlen+REDIS_RDB_EOF_MARK_SIZE <= taillen; wlen++)
+                if(!memcmp(tail+wlen, eofmark, REDIS_RDB_EOF_MARK_SIZE)) break;
+            if(wlen+REDIS_RDB_EOF_MARK_SIZE <= taillen) {
+                *leftover = sdsnewlen(tail+wlen+REDIS_RDB_EOF_MARK_SIZE, taillen-wlen-REDIS_RDB_EOF_MARK_SIZE);
+                done = 1;
+            }
+            if(write(dfd, tail, wlen) != (ssize_t)wlen) goto werr;
+            keep = done ? 0 : taillen-wlen;
+            tail = sdsrange(tail, taillen-keep, -1);
+            continue;
+        }
+        if(write(dfd, iobuf, nread) != nread) goto werr;
+        left -= nread;
+        done = (left == 0);
+    }
+    sdsfree(tail);
+    close(dfd);
+    // load the temp file, checksum included, so a bad transfer never
+    // replaces the dump we could restart from
+    emptyDb();
+    if(loadDb(tmpfile) != REDIS_OK) {
+        redisLog(REDIS_WARNING, "Failed trying to load the MASTER synchronization DB from disk");
+        // what was loaded is neither the old data nor the master's
+        emptyDb();
+        server.repl_can_psync = 0;
+        unlink(tmpfile);
+        return REDIS_ERR;
+    }
+    // the dataset in memory is the master's either way, only the next
+    // save will bring dump.rdb up to date
+    if(rename(tmpfile, server.dbfilename) == -1) {
+        redisLog(REDIS_WARNING, "Failed trying to rename the temp DB into dump.rdb in MASTER <-> SLAVE synchronization: %s", strerror(errno));
+        unlink(tmpfile);
+    }
+    return REDIS_OK;
+
+werr:
+    redisLog(REDIS_WARNING, "Writing the DB from MASTER to disk: %s", strerror(errno));
+err:
+    sdsfree(tail);
+    close(dfd);
+    unlink(tmpfile);
+    return REDIS_ERR;
+}
+
+// repl-diskless-load swapdb: decode the dump straight from the socket
+// into new dicts, swapped in only once all of it is loaded. A failed
+// transfer leaves the old dataset in place.
+static int readSyncBulkToTempDb(int fd, long long dumpsize, char *eofmark, sds *leftover) {
+    dict **olddict = server.dict;
+    char mark[REDIS_RDB_EOF_MARK_SIZE];
+    rdbFile rdb;
+    listIter *li;
+    listNode *ln;
+    long long start = mstime();
+    int retval;
+
+    server.dict = zmalloc(sizeof(dict*)*server.dbnum);
+    for(int j = 0; j < server.dbnum; j++)
+        server.dict[j] = dictCreate(&hashDictType, NULL);
+    memset(&rdb, 0, sizeof(rdb));
+    rdb.fd = fd;
+    rdb.size = eofmark ? 0 : dumpsize;
+    rdb.iobuf = sdsempty();
+
+    retval = rdbLoadMagic(&rdb);
+    if(retval == REDIS_OK) {
+        startLoading(dumpsize);
+        retval = rdbLoadPayload(&rdb);
+        server.loading = 0;
+    }
+    if(retval == REDIS_OK && eofmark &&
+       (rdbReadFd(&rdb, mark, sizeof(mark)) == -1 || memcmp(mark, eofmark, sizeof(mark)) != 0)) {
+        redisLog(REDIS_WARNING, "Bad EOF mark after the DB sent by MASTER");
+        retval = REDIS_ERR;
+    }
+    if(retval == REDIS_ERR) {
+        redisLog(REDIS_WARNING, "Failed loading the DB from the MASTER socket, keeping the old dataset");
+        for(int j = 0; j < server.dbnum; j++) dictRelease(server.dict[j]);
+        zfree(server.dict);
+        server.dict = olddict;
+        sdsfree(rdb.iobuf);
+        return REDIS_ERR;
+    }
+    *leftover = sdsnewlen(rdb.iobuf+rdb.iopos, sdslen(rdb.iobuf)-rdb.iopos);
+    sdsfree(rdb.iobuf);
+
+    for(int j = 0; j < server.dbnum; j++) dictRelease(olddict[j]);
+    zfree(olddict);
+    li = listGetIter(server.clients, ITER_FORWARD);
+    while((ln = listNextElement(li)) != NULL) {
+        redisClient *c = listNodeValue(ln);
+
+        c->dict = server.dict[c->dictid];
+    }
+    listReleaseIter(li);
+    redisLog(REDIS_NOTICE, "DB loaded from the MASTER socket: %lld keys, %lld bytes in %lld ms",
+        server.loading_loaded_keys, rdb.processed, mstime()-start);
+    return REDIS_OK;
+}
+
+// Connects to the master and asks to continue our copy of its stream. On
+// a full resync the dump is loaded in place of the current dataset, see
+// repl-diskless-load. This blocks for the whole transfer.
+static int syncWithMaster(void) {
+    char buf[1024], eofmark[REDIS_RDB_EOF_MARK_SIZE];
+    struct timeval tv = {REDIS_REPL_TIMEOUT, 0};
+    long long offset = 0, dumpsize;
+    int fd, len, usemark = 0, retval;
+    sds leftover = NULL;
+
+    fd = anetTcpConnect(server.neterr, server.masterhost, server.masterport);
+    if(fd == ANET_ERR) {
+        redisLog(REDIS_WARNING, "Unable to connect to MASTER: %s", server.neterr);
+        return REDIS_ERR;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    server.replstate = REDIS_REPL_TRANSFER;
+
+    if(server.repl_can_psync)
+        len = snprintf(buf, sizeof(buf), "psync %s %lld\r\n", server.replid, server.master_repl_offset+1);
+    else
+        len = snprintf(buf, sizeof(buf), "psync ? -1\r\n");
+    if(anetWrite(fd, buf, len) != len) {
+        redisLog(REDIS_WARNING, "I/O error writing to MASTER: %s", strerror(errno));
+        goto err;
+    }
+    if(syncReadLine(fd, buf, sizeof(buf)) == -1) {
+        redisLog(REDIS_WARNING, "I/O error reading PSYNC reply from MASTER: %s", strerror(errno));
+        goto err;
+    }
+
+    if(!strcmp(buf, "+CONTINUE")) {
+        redisLog(REDIS_NOTICE, "Partial resynchronization with MASTER at offset %lld", server.master_repl_offset+1);
+    } else if(!strncmp(buf, "+FULLRESYNC ", 12)) {
+        char replid[REDIS_RUN_ID_SIZE+1], *p = buf+12;
+
+        if(strlen(p) < REDIS_RUN_ID_SIZE+2 || p[REDIS_RUN_ID_SIZE] != ' ') {
+            redisLog(REDIS_WARNING, "Bad +FULLRESYNC reply from MASTER: %s", buf);
+            goto err;
+        }
+        memcpy(replid, p, REDIS_RUN_ID_SIZE);
+        replid[REDIS_RUN_ID_SIZE] = '\0';
+        offset = strtoll(p+REDIS_RUN_ID_SIZE+1, NULL, 10);
+
+        if(syncReadLine(fd, buf, sizeof(buf)) == -1 || buf[0] != '$') {
+            redisLog(REDIS_WARNING, "Bad bulk length reading the DB from MASTER");
+            goto err;
+        }
+        if(!strncmp(buf+1, "EOF:", 4) && strlen(buf+5) >= REDIS_RDB_EOF_MARK_SIZE) {
+            memcpy(eofmark, buf+5, REDIS_RDB_EOF_MARK_SIZE);
+            usemark = 1;
+            dumpsize = 0;
+            redisLog(REDIS_NOTICE, "Receiving the data dump from MASTER up to its EOF mark");
+        } else {
+            dumpsize = strtoll(buf+1, NULL, 10);
+            redisLog(REDIS_NOTICE, "Receiving %lld bytes data dump from MASTER", dumpsize);
+        }
+        if(server.repl_diskless_load == REDIS_REPL_DISKLESS_LOAD_SWAPDB)
+            retval = readSyncBulkToTempDb(fd, dumpsize, usemark ? eofmark : NULL, &leftover);
+        else
+            retval = readSyncBulkToDisk(fd, dumpsize, usemark ? eofmark : NULL, &leftover);
+        if(retval == REDIS_ERR) goto err;
+        memcpy(server.replid, replid, sizeof(replid));
+        server.master_repl_offset = offset;
+        // the stream after a dump starts with a SELECT
+        server.repl_master_dictid = 0;
+    } else {
+        redisLog(REDIS_WARNING, "Unexpected reply to PSYNC from MASTER: %s", buf);
+        goto err;
+    }
+
+    anetNonBlock(NULL, fd);
+    server.master = createClient(fd);
+    server.master->flags |= REDIS_MASTER;
+    selectDb(server.master, server.repl_master_dictid);
+    server.master->read_reploff = server.master_repl_offset;
+    server.master->reploff = server.master_repl_offset;
+    server.replstate = REDIS_REPL_CONNECTED;
+    server.repl_can_psync = 1;
+    redisLog(REDIS_NOTICE, "MASTER <-> SLAVE sync succeeded");
+    // the stream that followed the dump in the same reads
+    if(leftover && sdslen(leftover)) {
+        server.master->querybuf = sdscatlen(server.master->querybuf, leftover, sdslen(leftover));
+        server.master->read_reploff += sdslen(leftover);
+        processInputBuffer(server.master);
+    }
+    sdsfree(leftover);
+    return REDIS_OK;
+
+err:
+    sdsfree(leftover);
+    close(fd);
+    server.replstate = REDIS_REPL_CONNECT;
+    return REDIS_ERR;
+}
+
+// called by serverCron
+static void replicationCron(void) {
+    if(server.replstate == REDIS_REPL_CONNECT) {
+        redisLog(REDIS_NOTICE, "Connecting to MASTER...");
+        syncWithMaster();
+    }
+}
+
+// ============================ cron =====================
+
+static void createTimeEvent(aeEventLoop *el, long long ms, aeTimeEventProc *proc, void *data) {
+    aeTimeEvent *te = zmalloc(sizeof(*te));
+    long long when = mstime() + ms;
+
+    te->when_sec = when/1000;
+    te->when_msec = when%1000;
+    te->timeProc = proc;
+    te->finalizerProc = NULL;
+    te->clientData = data;
+    aeCreateTimeEvent(el, te);
+}
+
+// time events fire once, so the cron schedules its next run every time
+static void serverCron(aeEventLoop *eventLoop, long long id, void *clientData) {
+    long long start = ustime();
+    REDIS_NOTUSED(id);
+    REDIS_NOTUSED(clientData);
+
+    server.cronloops++;
+    if(zused_memory() > server.stat_peak_memory) server.stat_peak_memory = zused_memory();
+    checkSaveConditions();
+    replicationCron();
+    hotkeysCron();
+    activeDefragCron();
+    createTimeEvent(eventLoop, 1000, serverCron, NULL);
+    latencyAddSampleIfNeeded("cron", (ustime()-start)/1000);
+}
+
+// ============================ slowlog =====================
+// Commands slower than slowlog-log-slower-than usec go to a ring of
+// slowlog-max-len entries, the oldest is overwritten. Shards log
+// concurrently, but only slow commands ever take the lock.
+
+static pthread_mutex_t slowlog_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void slowlogInit(void) {
+    server.slowlog = zmalloc(sizeof(slowlogEntry)*server.slowlog_max_len);
+    server.slowlog_len = 0;
+    server.slowlog_idx = 0;
+    server.slowlog_entry_id = 0;
+}
+
+static void slowlogFreeEntry(slowlogEntry *se) {
+    for(int j = 0; j < se->argc; j++)
+        sdsfree(se->argv[j]);
+    se->argc = 0;
+}
+
+static void slowlogPushEntryIfNeeded(redisClient *c, robj **argv, int argc, long long duration) {
+    slowlogEntry *se;
+
+    if(server.slowlog_log_slower_than < 0 || duration < server.slowlog_log_slower_than) return;
+    pthread_mutex_lock(&slowlog_mutex);
+    se = &server.slowlog[server.slowlog_idx];
+    if(server.slowlog_len == server.slowlog_max_len)
+        slowlogFreeEntry(se);
+    else
+        server.slowlog_len++;
+    server.slowlog_idx = (server.slowlog_idx+1) % server.slowlog_max_len;
+    se->id = server.slowlog_entry_id++;
+    se->time = time(NULL);
+    se->duration = duration;
+    se->argc = argc;
+    for(int j = 0; j < argc; j++) {
+        size_t len = sdslen(argv[j]->ptr);
+
+        if(len > REDIS_SLOWLOG_ENTRY_MAX_STRING) {
+            se->argv[j] = sdsnewlen(argv[j]->ptr, REDIS_SLOWLOG_ENTRY_MAX_STRING);
+            se->argv[j] = sdscatprintf(se->argv[j], "... (%zu more bytes)", len-REDIS_SLOWLOG_ENTRY_MAX_STRING);
+        } else {
+            se->argv[j] = sdsnewlen(argv[j]->ptr, len);
+        }
+    }
+    // fake clients replaying the AOF have no peer
+    if(c->fd == -1)
+        snprintf(se->peer, sizeof(se->peer), "internal");
+    else
+        anetPeerToString(c->fd, se->peer, sizeof(se->peer));
+    pthread_mutex_unlock(&slowlog_mutex);
+}
+
+// SLOWLOG GET [count] | LEN | RESET
+static void slowlogCommand(redisClient *c) {
+    sds reply;
+
+    if(c->argc == 2 && !strcasecmp(c->argv[1]->ptr, "reset")) {
+        pthread_mutex_lock(&slowlog_mutex);
+        for(int j = 0; j < server.slowlog_len; j++)
+            slowlogFreeEntry(&server.slowlog[j]);
+        server.slowlog_len = 0;
+        server.slowlog_idx = 0;
+        pthread_mutex_unlock(&slowlog_mutex);
+        addReplySds(c, sdsnew("+OK\r\n"));
+    } else if(c->argc == 2 && !strcasecmp(c->argv[1]->ptr, "len")) {
+        addReplySds(c, sdscatprintf(sdsempty(), ":%d\r\n", __atomic_load_n(&server.slowlog_len, __ATOMIC_RELAXED)));
+    } else if((c->argc == 2 || c->argc == 3) && !strcasecmp(c->argv[1]->ptr, "get")) {
+        int count = c->argc == 3 ? atoi(c->argv[2]->ptr) : 10;
+
+        pthread_mutex_lock(&slowlog_mutex);
+        if(count < 0 || count > server.slowlog_len) count = server.slowlog_len;
+        reply = sdscatprintf(sdsempty(), "*%d\r\n", count);
+        // newest first
+        for(int j = 0; j < count; j++) {
+            int idx = (server.slowlog_idx-1-j+server.slowlog_max_len) % server.slowlog_max_len;
+            slowlogEntry *se = &server.slowlog[idx];
+
+            reply = sdscatprintf(reply, "*5\r\n:%lld\r\n:%ld\r\n:%lld\r\n*%d\r\n",
+                se->id, (long)se->time, se->duration, se->argc);
+            for(int k = 0; k < se->argc; k++) {
+                reply = sdscatprintf(reply, "$%zu\r\n", sdslen(se->argv[k]));
+                reply = sdscatlen(reply, se->argv[k], sdslen(se->argv[k]));
+                reply = sdscatlen(reply, "\r\n", 2);
+            }
+            reply = sdscatprintf(reply, "$%zu\r\n%s\r\n", strlen(se->peer), se->peer);
+        }
+        pthread_mutex_unlock(&slowlog_mutex);
+        addReplySds(c, reply);
+    } else {
+        addReplySds(c, sdsnew("-ERR SLOWLOG subcommand must be GET, LEN or RESET\r\n"));
+    }
+}
+
+// ============================ latency monitor =====================
+// Named events that took at least latency-monitor-threshold ms are kept
+// as time series, one sample per second holding the worst latency of
+// that second, REDIS_LATENCY_TS_LEN samples per event. Events:
+//   command, fast-command  a command, split by REDIS_CMD_FAST
+//   eventloop              one loop iteration, from wake up to sleep
+//   cron                   serverCron()
+//   fork                   fork() for BGSAVE, AOF rewrite or diskless sync
+//   aof-fsync-always       fdatasync() in the loop, appendfsync always
+//   aof-fsync-bg           fdatasync() in the background thread
+
+static pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void latencyMonitorInit(void) {
+    server.latency_events = dictCreate(&latencyEventsDictType, NULL);
+}
+
+static void latencyAddSample(char *event, long long latency) {
+    latencyTimeSeries *ts;
+    dictEntry *de;
+    int32_t now = time(NULL);
+    int prev;
+
+    pthread_mutex_lock(&latency_mutex);
+    if((de = dictFind(server.latency_events, event)) == NULL) {
+        ts = zmalloc(sizeof(*ts));
+        memset(ts, 0, sizeof(*ts));
+        dictAdd(server.latency_events, event, ts);
+    } else {
+        ts = dictGetEntryValue(de);
+    }
+    if(latency > ts->max) ts->max = latency;
+    // merge with a sample of the same second
+    prev = (ts->idx+REDIS_LATENCY_TS_LEN-1) % REDIS_LATENCY_TS_LEN;
+    if(ts->samples[prev].time == now) {
+        if(latency > ts->samples[prev].latency) ts->samples[prev].latency = latency;
+    } else {
+        ts->samples[ts->idx].time = now;
+        ts->samples[ts->idx].latency = latency;
+        ts->idx = (ts->idx+1) % REDIS_LATENCY_TS_LEN;
+    }
+    pthread_mutex_unlock(&latency_mutex);
+}
+
+// LATENCY LATEST: name, time, latency and all time max of every event
+static sds latencyLatestReply(void) {
+    dictIterator *di = dictGetIterator(server.latency_events);
+    dictEntry *de;
+    sds reply = sdscatprintf(sdsempty(), "*%u\r\n", server.latency_events->used);
+
+    while((de = dictNext(di)) != NULL) {
+        char *event = dictGetEntryKey(de);
+        latencyTimeSeries *ts = dictGetEntryValue(de);
+        int last = (ts->idx+REDIS_LATENCY_TS_LEN-1) % REDIS_LATENCY_TS_LEN;
+
+        reply = sdscatprintf(reply, "*4\r\n$%zu\r\n%s\r\n:%d\r\n:%u\r\n:%u\r\n",
+            strlen(event), event, ts->samples[last].time, ts->samples[last].latency, ts->max);
+    }
+    dictReleaseIterator(di);
+    return reply;
+}
+
+// LATENCY HISTORY <event>: time and latency pairs, oldest first
+static sds latencyHistoryReply(latencyTimeSeries *ts) {
+    sds reply = sdsempty(), header;
+    int samples = 0;
+
+    for(int j = 0; j < REDIS_LATENCY_TS_LEN; j++) {
+        latencySample *ls = &ts->samples[(ts->idx+j) % REDIS_LATENCY_TS_LEN];
+
+        if(ls->time == 0) continue;
+        reply = sdscatprintf(reply, "*2\r\n:%d\r\n:%u\r\n", ls->time, ls->latency);
+        samples++;
+    }
+    header = sdscatprintf(sdsempty(), "*%d\r\n", samples);
+    header = sdscatlen(header, reply, sdslen(reply));
+    sdsfree(reply);
+    return header;
+}
+
+// LATENCY DOCTOR: a human readable summary of every event
+static sds latencyReport(void) {
+    dictIterator *di = dictGetIterator(server.latency_events);
+    dictEntry *de;
+    sds report = sdsempty();
+
+    if(server.latency_events->used == 0) {
+        report = sdscatprintf(report, "No latency spike was observed (threshold %lld ms)%s.\n",
+            server.latency_monitor_threshold,
+            server.latency_monitor_threshold ? "" : ", the monitor is disabled");
+    }
+    while((de = dictNext(di)) != NULL) {
+        char *event = dictGetEntryKey(de);
+        latencyTimeSeries *ts = dictGetEntryValue(de);
+        long long sum = 0, samples = 0;
+        int32_t first = 0, last = 0;
+
+        for(int j = 0; j < REDIS_LATENCY_TS_LEN; j++) {
+            latencySample *ls = &ts->samples[(ts->idx+j) % REDIS_LATENCY_TS_LEN];
+
+            if(ls->time == 0) continue;
+            if(first == 0) first = ls->time;
+            last = ls->time;
+            sum += ls->latency;
+            samples++;
+        }
+        report = sdscatprintf(report,
+            "%s: %lld latency spikes (average %lldms, mean period %llds). Worst all time event %ums.\n",
+            event, samples, samples ? sum/samples : 0,
+            samples > 1 ? (long long)(last-first)/(samples-1) : 0, ts->max);
+        if(!strcmp(event, "fork"))
+            report = sdscatprintf(report, "  fork copies the page tables, it grows with the dataset: save less often or use a smaller instance.\n");
+        else if(!strcmp(event, "command"))
+            report = sdscatprintf(report, "  slow commands, see SLOWLOG GET and INFO commandstats.\n");
+        else if(!strcmp(event, "fast-command"))
+            report = sdscatprintf(report, "  O(1) commands this slow mean the process is not getting the CPU, or a dict is expanding.\n");
+        else if(!strncmp(event, "aof-fsync", 9))
+            report = sdscatprintf(report, "  the disk is slow to sync, consider appendfsync everysec or a faster device.\n");
+        else if(!strcmp(event, "eventloop"))
+            report = sdscatprintf(report, "  whole loop iterations, compare with the command and fork events to find the cause.\n");
+    }
+    dictReleaseIterator(di);
+    return report;
+}
+
+static void latencyCommand(redisClient *c) {
+    sds reply;
+    dictEntry *de;
+
+    pthread_mutex_lock(&latency_mutex);
+    if(c->argc == 2 && !strcasecmp(c->argv[1]->ptr, "latest")) {
+        reply = latencyLatestReply();
+    } else if(c->argc == 3 && !strcasecmp(c->argv[1]->ptr, "history")) {
+        if((de = dictFind(server.latency_events, c->argv[2]->ptr)) != NULL)
+            reply = latencyHistoryReply(dictGetEntryValue(de));
+        else
+            reply = sdsnew("*0\r\n");
+    } else if(c->argc >= 2 && !strcasecmp(c->argv[1]->ptr, "reset")) {
+        int resets = 0;
+
+        if(c->argc == 2) {
+            resets = server.latency_events->used;
+            dictEmpty(server.latency_events);
+        } else {
+            for(int j = 2; j < c->argc; j++)
+                if(dictDelete(server.latency_events, c->argv[j]->ptr) == DICT_OK) resets++;
+        }
+        reply = sdscatprintf(sdsempty(), ":%d\r\n", resets);
+    } else if(c->argc == 2 && !strcasecmp(c->argv[1]->ptr, "doctor")) {
+        sds report = latencyReport();
+
+        reply = sdscatprintf(sdsempty(), "$%zu\r\n", sdslen(report));
+        reply = sdscatlen(reply, report, sdslen(report));
+        reply = sdscatlen(reply, "\r\n", 2);
+        sdsfree(report);
+    } else {
+        reply = sdsnew("-ERR LATENCY subcommand must be LATEST, HISTORY, RESET or DOCTOR\r\n");
+    }
+    pthread_mutex_unlock(&latency_mutex);
+    addReplySds(c, reply);
+}
+
+// ============================ memory =====================
+// Sizes are what the allocator holds, see zmalloc_size(): the zmalloc
+// header and the malloc rounding are part of them.
+
+static size_t sdsAllocSize(sds s) {
+    return zmalloc_size(s-sizeof(struct sdshdr));
+}
+
+static size_t dictOverheadSize(dict *d) {
+    return zmalloc_size(d) + (d->table ? zmalloc_size(d->table) : 0) +
+        (size_t)d->used*(sizeof(dictEntry)+sizeof(size_t));
+}
+
+static size_t stringObjectSize(robj *o) {
+    return zmalloc_size(o) + sdsAllocSize(o->ptr);
+}
+
+// An object and everything it points to. Aggregates are estimated from
+// their first samples elements, 0 walks all of them.
+static size_t objectComputeSize(robj *o, long samples) {
+    size_t size, elesize = 0;
+    long seen = 0;
+
+    if(o->type == REDIS_STRING) return stringObjectSize(o);
+    size = zmalloc_size(o);
+    if(o->type == REDIS_LIST) {
+        list *l = o->ptr;
+
+        size += zmalloc_size(l);
+        for(listNode *ln = listFirst(l); ln && (samples == 0 || seen < samples); ln = ln->next) {
+            elesize += zmalloc_size(ln) + stringObjectSize(listNodeValue(ln));
+            seen++;
+        }
+        if(seen) size += (double)elesize/seen*listLength(l);
+    } else if(o->type == REDIS_SET) {
+        dict *d = o->ptr;
+        dictIterator *di = dictGetIterator(d);
+        dictEntry *de;
+
+        size += zmalloc_size(d) + (d->table ? zmalloc_size(d->table) : 0);
+        while((samples == 0 || seen < samples) && (de = dictNext(di)) != NULL) {
+            elesize += zmalloc_size(de) + stringObjectSize(dictGetEntryKey(de));
+            seen++;
+        }
+        dictReleaseIterator(di);
+        if(seen) size += (double)elesize/seen*d->used;
+    }
+    return size;
+}
+
+// the dump encoding of the value, without writing it anywhere
+static long long objectSerializedLength(robj *o) {
+    rdbFile rdb;
+
+    memset(&rdb, 0, sizeof(rdb));
+    rdbSaveObject(&rdb, o);
+    return rdb.processed;
+}
+
+static sds catStatsInt(sds s, char *name, long long value) {
+    return sdscatprintf(s, "$%zu\r\n%s\r\n:%lld\r\n", strlen(name), name, value);
+}
+
+static sds catStatsDouble(sds s, char *name, double value) {
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%.4f", value);
+
+    return sdscatprintf(s, "$%zu\r\n%s\r\n$%d\r\n%s\r\n", strlen(name), name, len, buf);
+}
+
+// This event loop's view: with shards, its slice of the dbs and its
+// clients.
+static void memoryStatsReply(redisClient *c) {
+    size_t total = zused_memory(), rss = zmalloc_get_rss(), peak = server.stat_peak_memory;
+    size_t normal = 0, slaves = 0, aof, backlog, freelist, dbs = 0, overhead;
+    long long keys = 0;
+    int fields = 0, nonempty = 0;
+    sds body = sdsempty(), dbstats = sdsempty();
+    listIter *li;
+    listNode *ln;
+
+    if(total > peak) peak = total;
+    // reply lists are not walked, a node and an object are counted per entry
+    li = listGetIter(currentClients(), ITER_FORWARD);
+    while((ln = listNextElement(li)) != NULL) {
+        redisClient *cl = listNodeValue(ln);
+        size_t size = zmalloc_size(cl) + sdsAllocSize(cl->querybuf) + cl->reply_bytes +
+            listLength(cl->reply)*(sizeof(listNode)+sizeof(robj)+2*sizeof(size_t));
+
+        if(cl->flags & REDIS_SLAVE) slaves += size;
+        else normal += size;
+    }
+    listReleaseIter(li);
+    aof = sdsAllocSize(server.aofbuf) + sdsAllocSize(server.aof_rewrite_buf);
+    backlog = server.repl_backlog ? zmalloc_size(server.repl_backlog) : 0;
+    freelist = listLength(server.objfreelist)*(sizeof(listNode)+sizeof(robj)+2*sizeof(size_t));
+    for(int j = 0; j < server.dbnum; j++) {
+        dict *d = currentDb()[j];
+        size_t size = dictOverheadSize(d);
+
+        dbs += size;
+        keys += d->used;
+        if(d->used == 0) continue;
+        dbstats = sdscatprintf(dbstats, "$%d\r\ndb.%d\r\n*4\r\n", (int)snprintf(NULL, 0, "db.%d", j), j);
+        dbstats = catStatsInt(dbstats, "overhead.hashtable.main", size);
+        dbstats = catStatsInt(dbstats, "keys", d->used);
+        nonempty++;
+    }
+    overhead = server.initial_memory_usage + normal + slaves + aof + backlog + freelist + dbs;
+
+    body = catStatsInt(body, "peak.allocated", peak); fields++;
+    body = catStatsInt(body, "total.allocated", total); fields++;
+    body = catStatsInt(body, "startup.allocated", server.initial_memory_usage); fields++;
+    body = catStatsInt(body, "replication.backlog", backlog); fields++;
+    body = catStatsInt(body, "clients.slaves", slaves); fields++;
+    body = catStatsInt(body, "clients.normal", normal); fields++;
+    body = catStatsInt(body, "aof.buffer", aof); fields++;
+    body = catStatsInt(body, "objfreelist", freelist); fields++;
+    body = sdscatlen(body, dbstats, sdslen(dbstats)); fields += nonempty;
+    body = catStatsInt(body, "overhead.hashtable.main", dbs); fields++;
+    body = catStatsInt(body, "overhead.total", overhead); fields++;
+    body = catStatsInt(body, "keys.count", keys); fields++;
+    body = catStatsInt(body, "keys.bytes-per-key", keys ? (long long)((total-server.initial_memory_usage)/keys) : 0); fields++;
+    body = catStatsInt(body, "dataset.bytes", total > overhead ? total-overhead : 0); fields++;
+    body = catStatsDouble(body, "dataset.percentage", total > overhead && total > server.initial_memory_usage ?
+        (double)(total-overhead)*100/(total-server.initial_memory_usage) : 0); fields++;
+    body = catStatsDouble(body, "peak.percentage", (double)total*100/peak); fields++;
+    body = catStatsInt(body, "rss.bytes", rss); fields++;
+    body = catStatsDouble(body, "fragmentation", (double)rss/total); fields++;
+    body = catStatsInt(body, "fragmentation.bytes", (long long)rss-(long long)total); fields++;
+
+    addReplySds(c, sdscatprintf(sdsempty(), "*%d\r\n", fields*2));
+    addReplySds(c, body);
+    sdsfree(dbstats);
+}
+
+static void memoryCommand(redisClient *c) {
+    if(!strcasecmp(c->argv[1]->ptr, "usage") && (c->argc == 3 || c->argc == 5)) {
+        long samples = REDIS_MEMORY_SAMPLES;
+        dictEntry *de;
+        robj *key;
+
+        if(c->argc == 5) {
+            char *eptr;
+
+            samples = strtol(c->argv[4]->ptr, &eptr, 10);
+            if(strcasecmp(c->argv[3]->ptr, "samples") || *eptr != '\0' || samples < 0) {
+                addReplySds(c, sdsnew("-ERR syntax error\r\n"));
+                return;
+            }
+        }
+        if((de = dictFind(c->dict, c->argv[2])) == NULL) {
+            addReplySds(c, sdsnew("$-1\r\n"));
+            return;
+        }
+        key = dictGetEntryKey(de);
+        addReplySds(c, sdscatprintf(sdsempty(), ":%zu\r\n", sizeof(dictEntry)+sizeof(size_t) +
+            stringObjectSize(key) + objectComputeSize(dictGetEntryValue(de), samples)));
+        return;
+    }
+    if(!strcasecmp(c->argv[1]->ptr, "stats") && c->argc == 2) {
+        memoryStatsReply(c);
+        return;
+    }
+    addReplySds(c, sdsnew("-ERR MEMORY subcommand must be USAGE <key> [SAMPLES <count>] or STATS\r\n"));
+}
+
+// only DEBUG OBJECT <key>
+static void debugCommand(redisClient *c) {
+    static char *types[] = {"string", "list", "set"};
+    static char *encodings[] = {"raw", "linkedlist", "hashtable"};
+    dictEntry *de;
+    robj *o;
+
+    if(strcasecmp(c->argv[1]->ptr, "object") || c->argc != 3) {
+        addReplySds(c, sdsnew("-ERR DEBUG subcommand must be OBJECT <key>\r\n"));
+        return;
+    }
+    if((de = dictFind(c->dict, c->argv[2])) == NULL) {
+        addReplySds(c, sdsnew("-ERR no such key\r\n"));
+        return;
+    }
+    o = dictGetEntryValue(de);
+    addReplySds(c, sdscatprintf(sdsempty(),
+        "+Value at:%p refcount:%d type:%s encoding:%s serializedlength:%lld\r\n",
+        (void*)o, o->refcount, types[o->type], encodings[o->type], objectSerializedLength(o)));
+}
+
+// ============================ hot and big keys =====================
+// Hot keys: every key a command names bumps a count-min sketch, whose
+// estimate never undercounts, and the REDIS_HOTKEYS_TOP keys with the
+// highest estimates are kept in a min-heap. The counters are halved every
+// REDIS_HOTKEYS_DECAY_SECS so the top follows the current traffic.
+// Shards track concurrently, under a lock only taken while tracking in
+// shard mode; otherwise only the main thread runs commands.
+//
+// Big keys: BIGKEYS START walks the dbs with dictScan() a time slice at a
+// time from a timer of the main loop, keeping the largest keys per type.
+
+static pthread_mutex_t hotkeys_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void hotkeysLock(void) {
+    if(server.shards_num > 1) pthread_mutex_lock(&hotkeys_mutex);
+}
+
+static void hotkeysUnlock(void) {
+    if(server.shards_num > 1) pthread_mutex_unlock(&hotkeys_mutex);
+}
+
+static void hotkeysClearSketch(void) {
+    memset(server.hotkeys_sketch, 0, sizeof(uint32_t)*REDIS_HOTKEYS_DEPTH*REDIS_HOTKEYS_WIDTH);
+}
+
+static void hotkeysInit(void) {
+    server.hotkeys_sketch = NULL;
+    server.hotkeys_len = 0;
+    server.hotkeys_last_decay = time(NULL);
+    if(server.hotkeys_tracking) {
+        server.hotkeys_sketch = zmalloc(sizeof(uint32_t)*REDIS_HOTKEYS_DEPTH*REDIS_HOTKEYS_WIDTH);
+        hotkeysClearSketch();
+    }
+    server.bigkeys_active = 0;
+    server.bigkeys_gen = 0;
+    server.bigkeys_scanned = 0;
+    server.bigkeys_start_time = 0;
+    server.bigkeys_end_time = 0;
+    memset(server.bigkeys_len, 0, sizeof(server.bigkeys_len));
+}
+
+// 64 bit FNV-1a of db and key, its two halves seed the sketch rows
+static uint64_t hotkeysHash(int dictid, sds key) {
+    uint64_t h = 14695981039346656037ULL ^ (uint64_t)dictid;
+    size_t len = sdslen(key);
+
+    for(size_t j = 0; j < len; j++) {
+        h ^= (unsigned char)key[j];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void hotkeysSwap(int a, int b) {
+    hotKey tmp = server.hotkeys[a];
+
+    server.hotkeys[a] = server.hotkeys[b];
+    server.hotkeys[b] = tmp;
+}
+
+static void hotkeysSiftDown(int j) {
+    while(1) {
+        int min = j, l = 2*j+1, r = 2*j+2;
+
+        if(l < server.hotkeys_len && server.hotkeys[l].count < server.hotkeys[min].count) min = l;
+        if(r < server.hotkeys_len && server.hotkeys[r].count < server.hotkeys[min].count) min = r;
+        if(min == j) return;
+        hotkeysSwap(j, min);
+        j = min;
+    }
+}
+
+static void hotkeysSiftUp(int j) {
+    while(j > 0 && server.hotkeys[(j-1)/2].count > server.hotkeys[j].count) {
+        hotkeysSwap(j, (j-1)/2);
+        j = (j-1)/2;
+    }
+}
+
+static void hotkeysTouch(int dictid, sds key) {
+    uint64_t hash = hotkeysHash(dictid, key);
+    uint32_t h1 = hash, h2 = (hash >> 32) | 1, est = UINT32_MAX;
+    hotKey *hk;
+
+    hotkeysLock();
+    for(int j = 0; j < REDIS_HOTKEYS_DEPTH; j++) {
+        uint32_t *counter = &server.hotkeys_sketch[j*REDIS_HOTKEYS_WIDTH + ((h1+j*h2) & (REDIS_HOTKEYS_WIDTH-1))];
+
+        if(*counter != UINT32_MAX) (*counter)++;
+        if(*counter < est) est = *counter;
+    }
+    // a key in the heap never counts more than its estimate, so at or
+    // below the minimum of a full heap there is nothing to update
+    if(server.hotkeys_len == REDIS_HOTKEYS_TOP && est <= server.hotkeys[0].count) {
+        hotkeysUnlock();
+        return;
+    }
+    for(int j = 0; j < server.hotkeys_len; j++) {
+        hk = &server.hotkeys[j];
+        if(hk->hash == hash && hk->dictid == dictid && sdslen(hk->key) == sdslen(key) &&
+           memcmp(hk->key, key, sdslen(key)) == 0) {
+            hk->count = est;
+            hotkeysSiftDown(j);
+            hotkeysUnlock();
+            return;
+        }
+    }
+    if(server.hotkeys_len < REDIS_HOTKEYS_TOP) {
+        hk = &server.hotkeys[server.hotkeys_len++];
+        hk->key = sdsnewlen(key, sdslen(key));
+    } else if(est > server.hotkeys[0].count) {
+        hk = &server.hotkeys[0];
+        hk->key = sdscpylen(hk->key, key, sdslen(key));
+    } else {
+        hotkeysUnlock();
+        return;
+    }
+    hk->dictid = dictid;
+    hk->hash = hash;
+    hk->count = est;
+    if(hk == &server.hotkeys[0]) hotkeysSiftDown(0);
+    else hotkeysSiftUp(server.hotkeys_len-1);
+    hotkeysUnlock();
+}
+
+static void hotkeysTrackCommand(struct redisCommand *cmd, int dictid, robj **argv, int argc) {
+    int last;
+
+    if(!__atomic_load_n(&server.hotkeys_tracking, __ATOMIC_RELAXED) || cmd->firstkey == 0) return;
+    last = (cmd->lastkey < 0) ? argc + cmd->lastkey : cmd->lastkey;
+    for(int j = cmd->firstkey; j <= last && j < argc; j += cmd->keystep)
+        hotkeysTouch(dictid, argv[j]->ptr);
+}
+
+// halving keeps the heap ordered
+static void hotkeysCron(void) {
+    time_t now = time(NULL);
+
+    if(!server.hotkeys_sketch || now-server.hotkeys_last_decay < REDIS_HOTKEYS_DECAY_SECS) return;
+    server.hotkeys_last_decay = now;
+    hotkeysLock();
+    for(int j = 0; j < REDIS_HOTKEYS_DEPTH*REDIS_HOTKEYS_WIDTH; j++)
+        server.hotkeys_sketch[j] >>= 1;
+    for(int j = 0; j < server.hotkeys_len; j++)
+        server.hotkeys[j].count >>= 1;
+    hotkeysUnlock();
+}
+
+static int compareHotKeys(const void *a, const void *b) {
+    const hotKey *ha = a, *hb = b;
+
+    return (ha->count < hb->count) - (ha->count > hb->count);
+}
+
+// HOTKEYS START | STOP | RESET | GET [count]
+static void hotkeysCommand(redisClient *c) {
+    char *sub = c->argv[1]->ptr;
+
+    if(c->argc == 2 && !strcasecmp(sub, "start")) {
+        hotkeysLock();
+        if(!server.hotkeys_sketch) {
+            server.hotkeys_sketch = zmalloc(sizeof(uint32_t)*REDIS_HOTKEYS_DEPTH*REDIS_HOTKEYS_WIDTH);
+            hotkeysClearSketch();
+        }
+        hotkeysUnlock();
+        __atomic_store_n(&server.hotkeys_tracking, 1, __ATOMIC_RELAXED);
+        addReplySds(c, sdsnew("+OK\r\n"));
+    } else if(c->argc == 2 && !strcasecmp(sub, "stop")) {
+        __atomic_store_n(&server.hotkeys_tracking, 0, __ATOMIC_RELAXED);
+        addReplySds(c, sdsnew("+OK\r\n"));
+    } else if(c->argc == 2 && !strcasecmp(sub, "reset")) {
+        hotkeysLock();
+        if(server.hotkeys_sketch) hotkeysClearSketch();
+        for(int j = 0; j < server.hotkeys_len; j++)
+            sdsfree(server.hotkeys[j].key);
+        server.hotkeys_len = 0;
+        hotkeysUnlock();
+        addReplySds(c, sdsnew("+OK\r\n"));
+    } else if((c->argc == 2 || c->argc == 3) && !strcasecmp(sub, "get")) {
+        hotKey top[REDIS_HOTKEYS_TOP];
+        int count = REDIS_HOTKEYS_TOP, len;
+        sds reply;
+
+        if(c->argc == 3) count = atoi(c->argv[2]->ptr);
+        hotkeysLock();
+        len = server.hotkeys_len;
+        for(int j = 0; j < len; j++) {
+            top[j] = server.hotkeys[j];
+            top[j].key = sdsnewlen(top[j].key, sdslen(top[j].key));
+        }
+        hotkeysUnlock();
+        qsort(top, len, sizeof(hotKey), compareHotKeys);
+        if(count < 0 || count > len) count = len;
+        reply = sdscatprintf(sdsempty(), "*%d\r\n", count);
+        for(int j = 0; j < count; j++) {
+            reply = sdscatprintf(reply, "*3\r\n$%zu\r\n", sdslen(top[j].key));
+            reply = sdscatlen(reply, top[j].key, sdslen(top[j].key));
+            reply = sdscatprintf(reply, "\r\n:%d\r\n:%u\r\n", top[j].dictid, top[j].count);
+        }
+        for(int j = 0; j < len; j++) sdsfree(top[j].key);
+        addReplySds(c, reply);
+    } else {
+        addReplySds(c, sdsnew("-ERR HOTKEYS subcommand must be START, STOP, RESET or GET [count]\r\n"));
+    }
+}
+
+static void bigkeysReset(void) {
+    for(int t = 0; t < 3; t++) {
+        for(int j = 0; j < server.bigkeys_len[t]; j++)
+            sdsfree(server.bigkeys[t][j].key);
+        server.bigkeys_len[t] = 0;
+    }
+    server.bigkeys_scanned = 0;
+}
+
+// keeps the list of the type sorted, largest first
+static void bigkeysScanCallback(void *privdata, const dictEntry *de) {
+    robj *key = dictGetEntryKey(de), *val = dictGetEntryValue(de);
+    int dictid = *(int*)privdata, type = val->type, pos;
+    bigKey *top = server.bigkeys[type];
+    long long size;
+
+    server.bigkeys_scanned++;
+    if(type == REDIS_STRING) size = sdslen(val->ptr);
+    else if(type == REDIS_LIST) size = listLength((list*)val->ptr);
+    else size = ((dict*)val->ptr)->used;
+    if(server.bigkeys_len[type] == REDIS_BIGKEYS_TOP && size <= top[REDIS_BIGKEYS_TOP-1].size) return;
+    // the scan may return a key twice
+    for(int j = 0; j < server.bigkeys_len[type]; j++) {
+        if(top[j].dictid == dictid && sdslen(top[j].key) == sdslen(key->ptr) &&
+           memcmp(top[j].key, key->ptr, sdslen(key->ptr)) == 0) return;
+    }
+
+    if(server.bigkeys_len[type] == REDIS_BIGKEYS_TOP)
+        sdsfree(top[REDIS_BIGKEYS_TOP-1].key);
+    else
+        server.bigkeys_len[type]++;
+    for(pos = server.bigkeys_len[type]-1; pos > 0 && top[pos-1].size < size; pos--)
+        top[pos] = top[pos-1];
+    top[pos].key = sdsnewlen(key->ptr, sdslen(key->ptr));
+    top[pos].dictid = dictid;
+    top[pos].size = size;
+    top[pos].memory = sizeof(dictEntry)+sizeof(size_t) + stringObjectSize(key) +
+        objectComputeSize(val, REDIS_MEMORY_SAMPLES);
+}
+
+static void bigkeysTimer(aeEventLoop *el, long long id, void *clientData) {
+    long long start = ustime();
+    REDIS_NOTUSED(id);
+
+    if(!server.bigkeys_active || (long)clientData != server.bigkeys_gen) return;
+    // a load decodes objects in another thread
+    while(!server.loading && ustime()-start < REDIS_BIGKEYS_SLICE_US) {
+        dict *d = server.dict[server.bigkeys_db];
+
+        server.bigkeys_cursor = dictScan(d, server.bigkeys_cursor, bigkeysScanCallback, &server.bigkeys_db);
+        if(server.bigkeys_cursor == 0 && ++server.bigkeys_db == server.dbnum) {
+            server.bigkeys_active = 0;
+            server.bigkeys_end_time = time(NULL);
+            redisLog(REDIS_NOTICE, "Big keys scan done, %lld keys in %ld seconds", server.bigkeys_scanned,
+                (long)(server.bigkeys_end_time-server.bigkeys_start_time));
+            return;
+        }
+    }
+    createTimeEvent(el, REDIS_BIGKEYS_PERIOD_MS, bigkeysTimer, clientData);
+}
+
+// BIGKEYS START | STOP | STATUS | GET
+static void bigkeysCommand(redisClient *c) {
+    static char *types[] = {"string", "list", "set"};
+    char *sub = c->argv[1]->ptr;
+
+    if(!strcasecmp(sub, "start")) {
+        if(server.bigkeys_active) {
+            addReplySds(c, sdsnew("-ERR big keys scan already in progress\r\n"));
+            return;
+        }
+        bigkeysReset();
+        server.bigkeys_active = 1;
+        server.bigkeys_gen++;
+        server.bigkeys_db = 0;
+        server.bigkeys_cursor = 0;
+        server.bigkeys_start_time = time(NULL);
+        server.bigkeys_end_time = 0;
+        createTimeEvent(server.el, 0, bigkeysTimer, (void*)(long)server.bigkeys_gen);
+        addReplySds(c, sdsnew("+OK\r\n"));
+    } else if(!strcasecmp(sub, "stop")) {
+        server.bigkeys_active = 0;
+        addReplySds(c, sdsnew("+OK\r\n"));
+    } else if(!strcasecmp(sub, "status")) {
+        sds status = sdscatprintf(sdsempty(),
+            "scan_in_progress:%d\r\n"
+            "scan_db:%d\r\n"
+            "scanned_keys:%lld\r\n"
+            "start_time:%ld\r\n"
+            "end_time:%ld\r\n",
+            server.bigkeys_active,
+            server.bigkeys_active ? server.bigkeys_db : -1,
+            server.bigkeys_scanned,
+            (long)server.bigkeys_start_time,
+            (long)server.bigkeys_end_time);
+
+        addReplySds(c, sdscatprintf(sdsempty(), "$%zu\r\n%s\r\n", sdslen(status), status));
+        sdsfree(status);
+    } else if(!strcasecmp(sub, "get")) {
+        // type, key, db, size, memory for each key, by type then size
+        sds reply = sdscatprintf(sdsempty(), "*%d\r\n",
+            server.bigkeys_len[0]+server.bigkeys_len[1]+server.bigkeys_len[2]);
+
+        for(int t = 0; t < 3; t++) {
+            for(int j = 0; j < server.bigkeys_len[t]; j++) {
+                bigKey *bk = &server.bigkeys[t][j];
+
+                reply = sdscatprintf(reply, "*5\r\n$%zu\r\n%s\r\n$%zu\r\n",
+                    strlen(types[t]), types[t], sdslen(bk->key));
+                reply = sdscatlen(reply, bk->key, sdslen(bk->key));
+                reply = sdscatprintf(reply, "\r\n:%d\r\n:%lld\r\n:%zu\r\n", bk->dictid, bk->size, bk->memory);
+            }
+        }
+        addReplySds(c, reply);
+    } else {
+        addReplySds(c, sdsnew("-ERR BIGKEYS subcommand must be START, STOP, STATUS or GET\r\n"));
+    }
+}
+
+// ============================ active defrag =====================
+// Long lived objects end up spread over pages the churn around them left
+// mostly empty. A pass walks the keyspace with dictDefragScan() and moves
+// every dictEntry, robj, sds, list node and set entry that malloc can
+// place lower in the heap, see zdefrag(), fixing the pointers to it; the
+// emptied pages go back to the kernel with zmalloc_trim() at the end.
+// The cron starts a pass once fragmentation, RSS over used memory, is over
+// both active-defrag-threshold-lower % and active-defrag-ignore-bytes.
+// It runs from a timer in slices of REDIS_DEFRAG_PERIOD_MS taking
+// active-defrag-cycle-min to -max % of the CPU, more as the fragmentation
+// nears active-defrag-threshold-upper. Objects with other references,
+// like pending replies, stay where they are.
+
+static void *activeDefragAlloc(void *ptr) {
+    void *newptr = zdefrag(ptr);
+
+    if(newptr) server.stat_active_defrag_hits++;
+    else server.stat_active_defrag_misses++;
+    return newptr;
+}
+
+static sds activeDefragSds(sds s) {
+    struct sdshdr *sh = activeDefragAlloc(s-sizeof(struct sdshdr));
+
+    return sh ? sh->buf : s;
+}
+
+// returns where o is now
+static robj *activeDefragStringObject(robj *o) {
+    robj *moved;
+
+    if(o->refcount != 1) return o;
+    o->ptr = activeDefragSds(o->ptr);
+    if((moved = activeDefragAlloc(o))) o = moved;
+    return o;
+}
+
+static void activeDefragList(list *l) {
+    for(listNode *ln = listFirst(l); ln; ln = ln->next) {
+        listNode *moved = activeDefragAlloc(ln);
+
+        if(moved) {
+            ln = moved;
+            if(ln->prev) ln->prev->next = ln;
+            else l->head = ln;
+            if(ln->next) ln->next->prev = ln;
+            else l->tail = ln;
+        }
+        ln->value = activeDefragStringObject(ln->value);
+    }
+}
+
+static dictEntry *activeDefragSetEntry(void *privdata, dictEntry *de) {
+    dictEntry *moved = activeDefragAlloc(de);
+    REDIS_NOTUSED(privdata);
+
+    if(moved) de = moved;
+    de->key = activeDefragStringObject(de->key);
+    return de;
+}
+
+// returns where o is now
+static robj *activeDefragObject(robj *o) {
+    robj *moved;
+    void *ptr;
+
+    if(o->refcount != 1) return o;
+    if(o->type == REDIS_STRING) {
+        o->ptr = activeDefragSds(o->ptr);
+    } else if(o->type == REDIS_LIST) {
+        if((ptr = activeDefragAlloc(o->ptr))) o->ptr = ptr;
+        if(listLength((list*)o->ptr) <= REDIS_DEFRAG_MAX_ELEMENTS) activeDefragList(o->ptr);
+        else server.stat_active_defrag_skipped++;
+    } else if(o->type == REDIS_SET) {
+        dict *d;
+        unsigned long cursor = 0;
+
+        if((ptr = activeDefragAlloc(o->ptr))) o->ptr = ptr;
+        d = o->ptr;
+        if(d->table && (ptr = activeDefragAlloc(d->table))) d->table = ptr;
+        if(d->used <= REDIS_DEFRAG_MAX_ELEMENTS) {
+            do {
+                cursor = dictDefragScan(d, cursor, activeDefragSetEntry, NULL);
+            } while(cursor);
+        } else {
+            server.stat_active_defrag_skipped++;
+        }
+    }
+    if((moved = activeDefragAlloc(o))) o = moved;
+    return o;
+}
+
+static dictEntry *activeDefragDbEntry(void *privdata, dictEntry *de) {
+    dictEntry *moved = activeDefragAlloc(de);
+    REDIS_NOTUSED(privdata);
+
+    if(moved) de = moved;
+    de->key = activeDefragStringObject(de->key);
+    de->value = activeDefragObject(de->value);
+    server.stat_active_defrag_scanned++;
+    return de;
+}
+
+static double activeDefragFragmentation(void) {
+    size_t used = zused_memory();
+
+    return used ? (double)zmalloc_get_rss()/used : 1;
+}
+
+static void activeDefragEnd(int completed) {
+    double frag;
+
+    zmalloc_trim();
+    frag = activeDefragFragmentation();
+    server.active_defrag_running = 0;
+    server.active_defrag_last_end = time(NULL);
+    server.active_defrag_last_gain = server.active_defrag_start_frag-frag;
+    server.active_defrag_last_frag = frag;
+    redisLog(REDIS_NOTICE, "Active defrag pass %s after %lld ms: %lld allocations moved, fragmentation %.2f -> %.2f",
+        completed ? "done" : "stopped", (ustime()-server.active_defrag_start)/1000,
+        server.stat_active_defrag_hits-server.active_defrag_start_hits, server.active_defrag_start_frag, frag);
+}
+
+// moving memory under a fork child would unshare its copy on write pages
+static int activeDefragPaused(void) {
+    return server.loading || server.bgsaveinprogress || server.aofrewritechildpid != -1;
+}
+
+static void activeDefragTimer(aeEventLoop *el, long long id, void *clientData) {
+    long long start = ustime(), slice = server.active_defrag_running*REDIS_DEFRAG_PERIOD_MS*10;
+    REDIS_NOTUSED(id);
+
+    if(!server.active_defrag_running || (long)clientData != server.active_defrag_gen) return;
+    while(!activeDefragPaused() && ustime()-start < slice) {
+        dict *d = server.dict[server.active_defrag_db];
+        void *table;
+
+        // the dict itself is referenced by the clients, only its table moves
+        if(server.active_defrag_cursor == 0 && d->table && (table = activeDefragAlloc(d->table)))
+            d->table = table;
+        server.active_defrag_cursor = dictDefragScan(d, server.active_defrag_cursor, activeDefragDbEntry, NULL);
+        if(server.active_defrag_cursor == 0 && ++server.active_defrag_db == server.dbnum) {
+            activeDefragEnd(1);
+            return;
+        }
+    }
+    latencyAddSampleIfNeeded("active-defrag-cycle", (ustime()-start)/1000);
+    createTimeEvent(el, REDIS_DEFRAG_PERIOD_MS-slice/1000, activeDefragTimer, clientData);
+}
+
+// called by serverCron, starts a pass or adjusts the effort of the running one
+static void activeDefragCron(void) {
+    double frag;
+    long long fragbytes;
+    int fragpct, lower, upper, cpu;
+
+    if(!server.active_defrag_enabled) {
+        if(server.active_defrag_running) activeDefragEnd(0);
+        return;
+    }
+    if(activeDefragPaused()) return;
+    frag = activeDefragFragmentation();
+    fragpct = (frag-1)*100;
+    fragbytes = (long long)zmalloc_get_rss()-(long long)zused_memory();
+    lower = server.active_defrag_threshold_lower;
+    upper = server.active_defrag_threshold_upper;
+    if(fragpct < lower || fragbytes < server.active_defrag_ignore_bytes) {
+        if(server.active_defrag_running) activeDefragEnd(0);
+        return;
+    }
+
+    cpu = server.active_defrag_cycle_max;
+    if(fragpct < upper && upper > lower)
+        cpu = server.active_defrag_cycle_min +
+            (server.active_defrag_cycle_max-server.active_defrag_cycle_min)*(fragpct-lower)/(upper-lower);
+    if(server.active_defrag_running) {
+        server.active_defrag_running = cpu;
+        return;
+    }
+    if(server.active_defrag_last_gain < 0.01 && frag < server.active_defrag_last_frag+0.05 &&
+       server.active_defrag_last_end &&
+       time(NULL)-server.active_defrag_last_end < REDIS_DEFRAG_IDLE_SECS) return;
+
+    server.active_defrag_running = cpu;
+    server.active_defrag_gen++;
+    server.active_defrag_db = 0;
+    server.active_defrag_cursor = 0;
+    server.active_defrag_start = ustime();
+    server.active_defrag_start_hits = server.stat_active_defrag_hits;
+    server.active_defrag_start_frag = frag;
+    redisLog(REDIS_NOTICE, "Starting active defrag, fragmentation %.2f (%lld bytes), %d%% of the CPU",
+        frag, fragbytes, cpu);
+    createTimeEvent(server.el, 0, activeDefragTimer, (void*)(long)server.active_defrag_gen);
+}
+
+// ============================ commands =====================
+
+// name -> redisCommand, built once at startup, case insensitive
+static void populateCommandTable(void) {
+    server.commands = dictCreate(&commandTableDictType, NULL);
+    for(int j = 0; cmdTable[j].name != NULL; j++)
+        dictAdd(server.commands, cmdTable[j].name, &cmdTable[j]);
+}
+
+static struct redisCommand *lookupCommand(char *name) {
+    dictEntry *de = dictFind(server.commands, name);
+
+    return de ? dictGetEntryValue(de) : NULL;
+}
+
+// Sends a write to the AOF and to the slaves, encoded once for both.
+static void propagate(struct redisCommand *cmd, int dictid, robj **argv, int argc) {
+    // a slave's offset counts its master's stream, not its own
+    int toslaves = !server.masterhost && (server.repl_backlog || listLength(server.slaves));
+    robj *cmdobj;
+
+    if(!server.appendonly && !toslaves) return;
+    cmdobj = createObject(REDIS_STRING, catAppendOnlyCommand(sdsempty(), cmd, argv, argc));
+    if(server.appendonly) feedAppendOnlyFile(dictid, cmdobj);
+    if(toslaves) replicationFeedSlaves(dictid, cmdobj);
+    decrRefCount(cmdobj);
+}
+
+// ---- command stats ----
+
+static int commandHistBucket(long long us) {
+    int msb, b;
+
+    if(us < (1 << REDIS_CMD_HIST_SUB_BITS)) return us < 0 ? 0 : us;
+    msb = 63-__builtin_clzll(us);
+    b = ((msb-REDIS_CMD_HIST_SUB_BITS+1) << REDIS_CMD_HIST_SUB_BITS) +
+        ((us >> (msb-REDIS_CMD_HIST_SUB_BITS)) & ((1 << REDIS_CMD_HIST_SUB_BITS)-1));
+    return b < REDIS_CMD_HIST_BUCKETS ? b : REDIS_CMD_HIST_BUCKETS-1;
+}
+
+// highest value counted in bucket b
+static long long commandHistBucketMax(int b) {
+    int sub = (1 << REDIS_CMD_HIST_SUB_BITS), shift;
+
+    if(b < sub) return b;
+    shift = (b >> REDIS_CMD_HIST_SUB_BITS)-1;
+    return ((long long)(sub + (b & (sub-1))) << shift) + (1LL << shift) - 1;
+}
+
+static void recordCommandStats(struct redisCommand *cmd, long long duration) {
+    __atomic_add_fetch(&cmd->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cmd->microseconds, duration, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cmd->latency_hist[commandHistBucket(duration)], 1, __ATOMIC_RELAXED);
+}
+
+static long long commandHistPercentile(struct redisCommand *cmd, double perc) {
+    long long total = 0, seen = 0;
+
+    for(int j = 0; j < REDIS_CMD_HIST_BUCKETS; j++)
+        total += __atomic_load_n(&cmd->latency_hist[j], __ATOMIC_RELAXED);
+    for(int j = 0; j < REDIS_CMD_HIST_BUCKETS; j++) {
+        seen += __atomic_load_n(&cmd->latency_hist[j], __ATOMIC_RELAXED);
+        if(total && seen >= total*perc/100) return commandHistBucketMax(j);
+    }
+    return 0;
+}
+
+static sds catCommandStats(sds info) {
+    for(int j = 0; cmdTable[j].name != NULL; j++) {
+        struct redisCommand *cmd = &cmdTable[j];
+        long long calls = __atomic_load_n(&cmd->calls, __ATOMIC_RELAXED);
+        long long us = __atomic_load_n(&cmd->microseconds, __ATOMIC_RELAXED);
+
+        if(calls == 0) continue;
+        info = sdscatprintf(info,
+            "cmdstat_%s:calls=%lld,usec=%lld,usec_per_call=%.2f,p50=%lld,p99=%lld,p999=%lld\r\n",
+            cmd->name, calls, us, (double)us/calls,
+            commandHistPercentile(cmd, 50),
+            commandHistPercentile(cmd, 99),
+            commandHistPercentile(cmd, 99.9));
+    }
+    return info;
+}
+
+static void resetCommandStats(void) {
+    for(int j = 0; cmdTable[j].name != NULL; j++) {
+        struct redisCommand *cmd = &cmdTable[j];
+
+        __atomic_store_n(&cmd->calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&cmd->microseconds, 0, __ATOMIC_RELAXED);
+        for(int k = 0; k < REDIS_CMD_HIST_BUCKETS; k++)
+            __atomic_store_n(&cmd->latency_hist[k], 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Called once a whole command is in c->argv. Returns 1 if the client is
+// still valid afterwards, 0 if it was freed.
+static int processCommand(redisClient *c) {
+    struct redisCommand *cmd;
+    long long dirty, start, duration;
+    int global = 0;
+
+    // clients mostly repeat the same command
+    if(c->lastcmd && !strcasecmp(c->argv[0]->ptr, c->lastcmd->name)) {
+        cmd = c->lastcmd;
+    } else {
+        if(!strcasecmp(c->argv[0]->ptr, "quit")) {
+            freeClient(c);
+            return 0;
+        }
+        if((cmd = lookupCommand(c->argv[0]->ptr)) != NULL) c->lastcmd = cmd;
+    }
+    if(!cmd) {
+        addReplySds(c, sdsnew("-ERR unknown command\r\n"));
+        resetClient(c);
+        return 1;
+    } else if((cmd->arity > 0 && cmd->arity != c->argc) ||
+              (c->argc < -cmd->arity)) {
+        addReplySds(c, sdsnew("-ERR wrong number of arguments\r\n"));
+        resetClient(c);
+        return 1;
+    } else if(cmd->flags & REDIS_CMD_BULK && c->bulklen == -1) {
+        // last inline argument is the payload length, read the payload
+        // and its trailing CRLF before running the command
+        int bulklen = atoi(c->argv[c->argc-1]->ptr);
+
+        decrRefCount(c->argv[c->argc-1]);
+        c->argc--;
+        if(bulklen < 0 || bulklen > 1024*1024*1024) {
+            addReplySds(c, sdsnew("-ERR invalid bulk write count\r\n"));
+            resetClient(c);
+            return 1;
+        }
+        c->bulklen = bulklen+2;
+        return 1;
+    }
+
+    if(server.loading && cmd->proc != infoCommand) {
+        addReplySds(c, sdsnew("-LOADING Redis is loading the dataset in memory\r\n"));
+        resetClient(c);
+        return 1;
+    }
+
+    if(server.shards_num > 1) {
+        int target = getCommandShard(c, cmd);
+
+        if(cmd->flags & REDIS_CMD_NOSHARD) {
+            addReplySds(c, sdsnew("-ERR command not available in shard mode\r\n"));
+            resetClient(c);
+            return 1;
+        }
+        if(target >= 0 && target != curshard->id) {
+            shardForwardCommand(c, cmd, target);
+            return 1;
+        }
+        global = (cmd->flags & REDIS_CMD_KEYSPACE) || target == -2;
+    }
+
+    dirty = server.dirty;
+    start = ustime();
+    if(global) shardCallGlobal(c, cmd);
+    else cmd->proc(c);
+    duration = ustime()-start;
+    recordCommandStats(cmd, duration);
+    hotkeysTrackCommand(cmd, c->dictid, c->argv, c->argc);
+    slowlogPushEntryIfNeeded(c, c->argv, c->argc, duration);
+    latencyAddSampleIfNeeded((cmd->flags & REDIS_CMD_FAST) ? "fast-command" : "command", duration/1000);
+    if((cmd->flags & REDIS_CMD_WRITE) && server.dirty != dirty)
+        propagate(cmd, c->dictid, c->argv, c->argc);
+    if(c->flags & REDIS_MASTER) {
+        // what is left in the query buffer is not applied yet
+        c->reploff = c->read_reploff - sdslen(c->querybuf);
+        server.master_repl_offset = c->reploff;
+    }
+    // shards update it concurrently
+    __atomic_add_fetch(&server.stat_numcommands, 1, __ATOMIC_RELAXED);
+
+    if(c->flags & REDIS_CLOSE) {
+        freeClient(c);
+        return 0;
+    }
+    resetClient(c);
+    return 1;
+}
+
+static void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask){
+    redisClient *c = (redisClient*)privdata;
+    REDIS_NOTUSED(fd);
+    REDIS_NOTUSED(mask);
+
+    if(c->zcpinned) reapZerocopyCompletions(c->fd, c->zcpinned);
+    if(el->recvbuf) {
+        // the loop read for us, see AE_RECV
+        if(appendClientQuery(c, el->recvbuf, el->recvlen) == REDIS_ERR) {
+            freeClient(c);
+            return;
+        }
+        processInputBuffer(c);
+        return;
+    }
+    if(postponeClientRead(c)) return;
+    if(readClientQuery(c) == REDIS_ERR) {
+        freeClient(c);
+        return;
+    }
+    processInputBuffer(c);
+}
+
+// select() can't watch an fd past FD_SETSIZE, FD_SET() would write past
+// the end of the fd_set. Such a connection is closed.
+static int clientFdFits(aeEventLoop *el, int cfd) {
+    if(el->apidata || cfd < FD_SETSIZE) return 1;
+    redisLog(REDIS_WARNING, "Too many open connections for select(), fd %d is past FD_SETSIZE (%d). Closing it, event-loop-backend io_uring has no such limit", cfd, FD_SETSIZE);
+    close(cfd);
+    return 0;
+}
+
+// The listener is non blocking: drain what is pending, up to a cap so
+// that a connection storm does not starve the clients already connected.
+static void acceptHandler(aeEventLoop *el, int fd, void *privData, int mask){
+    int cport, cfd, max = REDIS_MAX_ACCEPTS_PER_CALL;
+    char cip[128], err[ANET_ERR_LEN];
+    redisClient *c;
+    REDIS_NOTUSED(privData);
+    REDIS_NOTUSED(mask);
+
+    while(max--){
+        cfd = anetAccept(err, fd, cip, &cport);
+        if(cfd == ANET_ERR){
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                redisLog(REDIS_DEBUG, "Accepting client connection: %s", err);
+            return;
+        }
+        redisLog(REDIS_DEBUG, "Accepted %s:%d", cip, cport);
+        if(!clientFdFits(el, cfd)) continue;
+        if((c = createClient(cfd)) == NULL){
+            redisLog(REDIS_WARNING, "Error allocating resoures for the client");
+            close(cfd);
+            return;
+        }
+        __atomic_add_fetch(&server.stat_numconnections, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void acceptUnixHandler(aeEventLoop *el, int fd, void *privData, int mask){
+    int cfd, max = REDIS_MAX_ACCEPTS_PER_CALL;
+    char err[ANET_ERR_LEN];
+    redisClient *c;
+    REDIS_NOTUSED(privData);
+    REDIS_NOTUSED(mask);
+
+    while(max--){
+        cfd = anetUnixAccept(err, fd);
+        if(cfd == ANET_ERR){
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                redisLog(REDIS_DEBUG, "Accepting client connection: %s", err);
+            return;
+        }
+        redisLog(REDIS_DEBUG, "Accepted connection to %s", server.unixsocket);
+        if(!clientFdFits(el, cfd)) continue;
+        if((c = createClient(cfd)) == NULL){
+            redisLog(REDIS_WARNING, "Error allocating resoures for the client");
+            close(cfd);
+            return;
+        }
+        __atomic_add_fetch(&server.stat_numconnections, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// forked children must not keep accepting
+static void closeListeningSockets(void) {
+    close(server.fd);
+    if(server.ipfd6 != -1) close(server.ipfd6);
+    if(server.sofd != -1) close(server.sofd);
+    // shard 0 listens on server.fd, the others on their own sockets
+    for(int i = 1; i < server.shards_num; i++)
+        close(shards[i].fd);
+}
+
+static int selectDb(redisClient *c, int id){
+    c->dict = currentDb()[id];
+    c->dictid = id;
+    return REDIS_OK;
+}
+
+// fd must be non blocking already, accepted sockets are
+static redisClient *createClient(int fd){
+    redisClient *c = zmalloc(sizeof(*c));
+
+    anetTcpNoDelay(NULL, fd);
+
+    selectDb(c, 0);
+    c->fd = fd;
+    c->querybuf = sdsempty();
+    robj *argv[REDIS_MAX_ARGS];
+    c->argc = 0 ;
+    c->bulklen = -1;
+    c->reply = listCreate();
+    listSetFreeMethod(c->reply, decrRefCount);
+
+    c->sentlen = 0;
+    c->reply_bytes = 0;
+    c->obuf_soft_limit_reached_time = 0;
+    c->lastinteraction = time(NULL);
+    c->flags = 0;
+    c->replstate = REDIS_REPL_NONE;
+    c->repldbfd = -1;
+    c->replpreamble = NULL;
+    c->read_reploff = 0;
+    c->reploff = 0;
+    c->lastcmd = NULL;
+    c->zcpinned = NULL;
+    c->zcseq = 0;
+    c->sending = NULL;
+
+    createClientFileEvent(c, clientRingIO() ? AE_READABLE|AE_RECV : AE_READABLE, readQueryFromClient);
+    listNodeAddTail(currentClients(), c);
+    return c;
+}
+
+// listen() silently truncates the backlog to net.core.somaxconn
+static void checkTcpBacklogSettings(void) {
+    FILE *fp = fopen("/proc/sys/net/core/somaxconn", "r");
+    char buf[64];
+
+    if(!fp) return;
+    if(fgets(buf, sizeof(buf), fp) != NULL) {
+        int somaxconn = atoi(buf);
+
+        if(somaxconn > 0 && somaxconn < server.tcp_backlog)
+            redisLog(REDIS_WARNING, "WARNING: The TCP backlog setting of %d cannot be enforced because /proc/sys/net/core/somaxconn is set to the lower value of %d.",
+                server.tcp_backlog, somaxconn);
+    }
+    fclose(fp);
+}
+
+static void initServer() {
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    checkTcpBacklogSettings();
+    if(server.shards_num > 1 || server.reuseport)
+        server.fd = anetTcpServerReusePort(server.neterr, server.port, server.bindaddr, server.tcp_backlog);
+    else
+        server.fd = anetTcpServer(server.neterr, server.port, server.bindaddr, server.tcp_backlog);
+    if(server.fd == ANET_ERR) {
+        redisLog(REDIS_WARNING, "Opening port %d: %s", server.port, server.neterr);
+        exit(1);
+    }
+    anetNonBlock(NULL, server.fd);
+    if(server.bindaddr6) {
+        server.ipfd6 = anetTcp6Server(server.neterr, server.port, server.bindaddr6, server.tcp_backlog);
+        if(server.ipfd6 == ANET_ERR) {
+            redisLog(REDIS_WARNING, "Opening IPv6 port %d: %s", server.port, server.neterr);
+            exit(1);
+        }
+        anetNonBlock(NULL, server.ipfd6);
+    }
+    if(server.unixsocket) {
+        // a socket file left by a previous run makes bind() fail
+        unlink(server.unixsocket);
+        server.sofd = anetUnixServer(server.neterr, server.unixsocket, server.unixsocketperm, server.tcp_backlog);
+        if(server.sofd == ANET_ERR) {
+            redisLog(REDIS_WARNING, "Opening unix socket: %s", server.neterr);
+            exit(1);
+        }
+        anetNonBlock(NULL, server.sofd);
+    }
+    server.dict = zmalloc(sizeof(dict*) * server.dbnum);
+    for(int i=0; i<server.dbnum; i++){
+        server.dict[i] = dictCreate(&hashDictType, NULL);
+    }
+    server.clients = listCreate();
+    server.slaves = listCreate();
+    server.clients_pending_read = listCreate();
+    server.clients_pending_write = listCreate();
+    server.zcclosing = listCreate();
+    aeSetBackend(server.ae_backend);
+    server.el = aeCreateEventLoop();
+    if(server.ae_backend == AE_BACKEND_IO_URING && !server.el->apidata)
+        redisLog(REDIS_WARNING, "io_uring is not available, falling back to select");
+
+    // stat
+    // char neterr[ANET_ERR_LEN];
+    server.dirty  = 0;
+    server.cronloops = 0;
+    server.objfreelist = listCreate();
+    server.lastsave = time(NULL);
+    server.usedmemory = 0;
+    server.stat_peak_memory = 0;
+
+    server.stat_starttime = time(NULL);
+    slowlogInit();
+    latencyMonitorInit();
+    hotkeysInit();
+    server.active_defrag_running = 0;
+    server.active_defrag_gen = 0;
+    server.active_defrag_last_end = 0;
+    server.active_defrag_last_gain = 0;
+    server.active_defrag_last_frag = 0;
+    server.stat_active_defrag_hits = 0;
+    server.stat_active_defrag_misses = 0;
+    server.stat_active_defrag_scanned = 0;
+    server.stat_active_defrag_skipped = 0;
+    server.stat_numcommands = 0 ;
+    server.stat_numconnections = 0 ;
+    server.aofbuf = sdsempty();
+    server.selectcmds = zmalloc(sizeof(robj*) * server.dbnum);
+    for(int j = 0; j < server.dbnum; j++)
+        server.selectcmds[j] = createObject(REDIS_STRING, sdscatprintf(sdsempty(), "select %d\r\n", j));
+    getRandomHexChars(server.replid, REDIS_RUN_ID_SIZE);
+    server.replid[REDIS_RUN_ID_SIZE] = '\0';
+    server.aof_rewrite_buf = sdsempty();
+
+    if(server.shards_num > 1 && server.masterhost) {
+        redisLog(REDIS_WARNING, "Replication is not supported in shard mode");
+        server.masterhost = NULL;
+        server.replstate = REDIS_REPL_NONE;
+    }
+    if(server.shards_num > 1 && server.appendonly) {
+        redisLog(REDIS_WARNING, "The append only file is not supported in shard mode");
+        server.appendonly = 0;
+    }
+    if(server.shards_num > 1 && server.active_defrag_enabled) {
+        redisLog(REDIS_WARNING, "Active defrag is not supported in shard mode");
+        server.active_defrag_enabled = 0;
+    }
+    if(server.shards_num > 1 && server.io_threads_num > 1) {
+        redisLog(REDIS_WARNING, "I/O threads are not used in shard mode");
+        server.io_threads_num = 1;
+    }
+    if(server.io_threads_num > 1) {
+        // the threads spin waiting for work, past one per CPU they only
+        // take time from the main thread
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if(ncpu > 0 && server.io_threads_num > ncpu) {
+            redisLog(REDIS_WARNING, "io-threads %d is more than the %ld online CPUs, using %ld",
+                server.io_threads_num, ncpu, ncpu);
+            server.io_threads_num = ncpu;
+        }
+    }
+    initShards();
+    initThreadedIO();
+}
+
+int main(int argc, char **argv) {
+    initServerConfig();
+    if(argc == 2) loadServerConfig(argv[1]);
+    initServer();
+    aeFileEvent fe;
+    fe.fd = server.fd;
+    fe.mask = AE_READABLE;
+    fe.fileProc = acceptHandler;
+    fe.finalizerProc = NULL;
+    fe.clientData = NULL;
+    aeCreateFileEvent(server.el, &fe);
+    if(server.ipfd6 != -1)
+        createFileEvent(server.el, server.ipfd6, AE_READABLE, acceptHandler, NULL);
+    if(server.sofd != -1)
+        createFileEvent(server.el, server.sofd, AE_READABLE, acceptUnixHandler, NULL);
+    aeSetBeforeSleepProc(server.el, beforeSleep);
+    aeSetAfterSleepProc(server.el, afterSleep);
+    createTimeEvent(server.el, 1000, serverCron, NULL);
+    server.initial_memory_usage = zused_memory();
+    if(server.appendonly) {
+        loadAppendOnlyFile(server.appendfilename);
+        startAppendOnly();
+    } else if(loadDb(server.dbfilename) == REDIS_ERR && errno != ENOENT) {
+        redisLog(REDIS_WARNING, "Unrecoverable error loading the DB, exiting now");
+        exit(1);
+    }
+    startShards();
     aeMain(server.el);
 }
 
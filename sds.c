@@ -3,6 +3,8 @@
 # include <stdarg.h>
 # include <stdio.h>
 # include <stdlib.h>
+# include <string.h>
+# include <ctype.h>
 
 sds     sdsnewlen(const void* init, size_t initlen) {
     struct sdshdr*  sh;
@@ -73,10 +75,10 @@ sds sdsMakeRoom(sds s, size_t addlen){
 sds     sdscatlen(sds s, void* t, size_t len){
     struct sdshdr *sh;
 
-    sdsMakeRoom(s, len);
+    s = sdsMakeRoom(s, len);
     if(s == NULL) return NULL;
     memcpy(s+sdslen(s), t, len);
-    sh = s - sizeof(sds);
+    sh = (void *)(s - sizeof(struct sdshdr));
     sh->len = sh->len + len;
     sh->free = sh->free -len;
     s[sh->len] = '\0';
@@ -139,23 +141,22 @@ sds     sdscpy(sds s, char* t){
 
 sds     sdstrim(sds s, const char* cset){
     struct sdshdr *sh;
-    char *sp, *ep, *start, *end;
+    char *sp, *ep, *end;
     int fnl_len; 
 
-    sh = s - sizeof(struct sdshdr);
-    start = sp = s;
+    sh = (void *)(s - sizeof(struct sdshdr));
+    sp = s;
     end = ep = s + sdslen(s) - 1;
 
-    while(strchr(cset, *sp) < 0 && sp <= end) sp++;
-    while(strchr(cset, *ep) < 0 && ep >= start) ep--;
+    while(sp <= end && strchr(cset, *sp)) sp++;
+    while(ep > sp && strchr(cset, *ep)) ep--;
 
-    if (sp > ep)return sdsempty();
-    fnl_len = ep - sp + 1;
-    memcpy(s, sp, fnl_len);
+    fnl_len = (sp > ep) ? 0 : ep - sp + 1;
+    memmove(s, sp, fnl_len);
     s[fnl_len] = '\0';
     sh->free = sh->free + sh->len - fnl_len;
     sh->len = fnl_len;
-    return sh;
+    return s;
 }
 
 
@@ -163,14 +164,28 @@ void    sdsupdatelen(sds s) {
     struct sdshdr *sh;
     size_t real_len;
     
-    sh = s - sizeof(sds);
+    sh = (void *)(s - sizeof(struct sdshdr));
     real_len = strlen(s);
     sh->free = sh->len + sh->free - real_len;
     sh->len = real_len;
 }
 
 sds     sdsrange(sds s, long start, long end){
-    return sdscpylen(s, s + start, end - start + 1);
+    struct sdshdr *sh;
+    long len = sdslen(s), newlen;
+
+    // negative indexes count from the end, -1 is the last char
+    if(start < 0) start = len + start;
+    if(end < 0) end = len + end;
+    if(start < 0) start = 0;
+    if(end >= len) end = len - 1;
+    newlen = (start > end) ? 0 : end - start + 1;
+    if(newlen) memmove(s, s + start, newlen);
+    s[newlen] = '\0';
+    sh = (void *)(s - sizeof(struct sdshdr));
+    sh->free = sh->free + sh->len - newlen;
+    sh->len = newlen;
+    return s;
 }
 
 int     sdscmp(sds s1, sds s2) {
@@ -188,44 +203,31 @@ int     sdscmp(sds s1, sds s2) {
 }
 
 sds*    sdssplitlen(char *s, int len, char *sep, int seplen, int* count){
-    char *char_ptr;
-    sds *sds_ptr, *sds_start;
-    size_t cur_slots, used_slots;
-    cur_slots = 32;
-    used_slots = 0;
-    
-    sds_start = zmalloc(sizeof(sds) * cur_slots);
-    
-    while(1){
-        sds_ptr = sds_start + used_slots;
-        char_ptr = strstr(s, sep);
-        if (char_ptr == NULL) {
-            if(*s != '\0')
-                *sds_ptr = sdsnew(s);
-            return sds_start;
-        }
-        else{
-            *sds_ptr = sdsnewlen(s, char_ptr-s);
-            s = char_ptr + seplen;
-            used_slots += 1;
-            if(used_slots > cur_slots){
-                sds_start = zrealloc(sds_start, cur_slots *2);
-                cur_slots *= 2;
-            }
-
+    sds *tokens;
+    int slots = 32, elements = 0, start = 0;
+
+    tokens = zmalloc(sizeof(sds) * slots);
+    for(int j = 0; j <= len - seplen; j++){
+        if(memcmp(s+j, sep, seplen) != 0) continue;
+        // keep room for the last token too
+        if(elements + 2 > slots){
+            slots *= 2;
+            tokens = zrealloc(tokens, sizeof(sds) * slots);
         }
+        tokens[elements++] = sdsnewlen(s+start, j-start);
+        start = j + seplen;
+        j = j + seplen - 1;
     }
-    return sds_start;
+    tokens[elements++] = sdsnewlen(s+start, len-start);
+    *count = elements;
+    return tokens;
 }
 
-        
-        
-
-
 void    sdstolower(sds s){
     while(1){
         if(*s == '\0') break;
         *s = tolower(*s); 
+        s++;
     }
 }
 
@@ -7,7 +7,7 @@ typedef char* sds;
 struct sdshdr {
     long len;
     long free;
-    char* buf;
+    char buf[];
 };
 
 sds     sdsnewlen(const void* init, size_t initlen);
@@ -4,18 +4,33 @@
 # include <stdlib.h>
 # include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#define ZMALLOC_DEFRAG_MAX_SIZE (64*1024)
 
 static size_t used_memory = 0;
+static int zmalloc_thread_safe = 0;
+
+// once I/O threads are running, allocations happen concurrently
+#define update_zmalloc_stat_add(__n) do { \
+    if (zmalloc_thread_safe) __atomic_add_fetch(&used_memory, (__n), __ATOMIC_RELAXED); \
+    else used_memory += (__n); \
+} while(0)
+
+#define update_zmalloc_stat_sub(__n) do { \
+    if (zmalloc_thread_safe) __atomic_sub_fetch(&used_memory, (__n), __ATOMIC_RELAXED); \
+    else used_memory -= (__n); \
+} while(0)
 
 void *zmalloc(size_t size) {
-    printf("\nsize %d\n", size);
     void *ptr = malloc(size+sizeof(size_t));
 
-    printf("start pointer %p\n", ptr);
+    if (!ptr) return NULL;
     *((size_t*)ptr) = size;
-    used_memory += size + sizeof(size_t);
-    printf("contnet pointer %p\n", ptr);
-    fflush(stdout);
+    update_zmalloc_stat_add(size + sizeof(size_t));
     return ptr + sizeof(size_t);
 }
 
@@ -26,14 +41,14 @@ void *zrealloc(void *ptr, size_t size) {
 
     if (ptr == NULL) return zmalloc(size);
     realptr = ptr - sizeof(size_t);
-
+    oldsize = *((size_t*)realptr);
     newptr = realloc(realptr, size+sizeof(size_t));
     if (!newptr) return NULL;
 
-    newptr += sizeof(size_t);
-    oldsize = *((size_t*)realptr);
-    used_memory += size - oldsize;
-    return newptr;
+    *((size_t*)newptr) = size;
+    update_zmalloc_stat_sub(oldsize);
+    update_zmalloc_stat_add(size);
+    return newptr + sizeof(size_t);
 }
 
 size_t zsize(void* ptr) {
@@ -50,7 +65,7 @@ void zfree(void *ptr) {
     if (!ptr) return;
     realptr = ptr - sizeof(size_t);
 
-    used_memory -= *((size_t*)realptr) + sizeof(size_t);
+    update_zmalloc_stat_sub(*((size_t*)realptr) + sizeof(size_t));
     free(realptr);
 }
 
@@ -63,6 +78,60 @@ char *zstrdup(const char *s) {
     return p;
 }
 
-char zused_memory(void) {
+size_t zused_memory(void) {
+    if (zmalloc_thread_safe)
+        return __atomic_load_n(&used_memory, __ATOMIC_RELAXED);
     return used_memory;
 }
+
+// what the allocator really took for ptr, headers and rounding included
+size_t zmalloc_size(void *ptr) {
+#ifdef __GLIBC__
+    return malloc_usable_size(ptr - sizeof(size_t)) + sizeof(size_t);
+#else
+    return zsize(ptr) + sizeof(size_t);
+#endif
+}
+
+// resident set size from /proc, the allocated memory where there is none
+size_t zmalloc_get_rss(void) {
+    FILE *fp = fopen("/proc/self/statm", "r");
+    unsigned long size, rss;
+
+    if (!fp) return zused_memory();
+    if (fscanf(fp, "%lu %lu", &size, &rss) != 2) rss = 0;
+    fclose(fp);
+    return rss ? rss * sysconf(_SC_PAGESIZE) : zused_memory();
+}
+
+// Active defrag. glibc malloc has no hint about how full the page of a
+// block is, so a block of the same size is asked for and, when it lands
+// below ptr, the data is moved there and ptr freed, packing the live data
+// towards the bottom of the heap. Returns the new pointer, NULL if the
+// block stays. Large blocks are mmapped by malloc, moving them gains
+// nothing.
+void *zdefrag(void *ptr) {
+    size_t size = zsize(ptr) + sizeof(size_t);
+    void *realptr = ptr - sizeof(size_t), *newptr;
+
+    if (size >= ZMALLOC_DEFRAG_MAX_SIZE) return NULL;
+    if (!(newptr = malloc(size))) return NULL;
+    if (newptr > realptr) {
+        free(newptr);
+        return NULL;
+    }
+    memcpy(newptr, realptr, size);
+    free(realptr);
+    return newptr + sizeof(size_t);
+}
+
+// gives the free pages back to the kernel, also the ones between blocks
+void zmalloc_trim(void) {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+void zmalloc_enable_thread_safeness(void) {
+    zmalloc_thread_safe = 1;
+}
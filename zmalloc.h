@@ -11,5 +11,10 @@ size_t zsize(void* ptr);
 void* zfree(void* ptr);
 char* zstrdup(const char* s);
 size_t zused_memory(void);
+size_t zmalloc_size(void *ptr);
+size_t zmalloc_get_rss(void);
+void *zdefrag(void *ptr);
+void zmalloc_trim(void);
+void zmalloc_enable_thread_safeness(void);
 
 #endif